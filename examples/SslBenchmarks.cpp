@@ -0,0 +1,698 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define PRIMESOCKET_USE_SSL
+#include <PrimeSocket.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
+#define IDLE_PORT "5161"
+#define IDLE_CONNECTIONS 1000
+#define IDLE_SETTLE_MS 2000
+
+#define HANDSHAKE_BASE_PORT 5170
+#define HANDSHAKE_CLIENT_THREADS 8
+#define HANDSHAKE_SECONDS 5
+
+#define ENGINE_HANDSHAKES 2000
+#define ENGINE_MESSAGE_SIZE 1024
+#define ENGINE_MESSAGES_PER_BATCH 16
+#define ENGINE_TOTAL_BYTES (1024ULL * 1024 * 1024)
+
+#define SUITE_BASE_PORT 5190
+#define BULK_WRITE_SIZE 16384
+#define BULK_TOTAL_BYTES (512ULL * 1024 * 1024)
+#define BULK_MAX_QUEUED (4 * 1024 * 1024)
+#define LATENCY_MESSAGE_SIZE 64
+#define LATENCY_ROUNDS 10000
+
+// Self-signed certificate (P-256 or RSA 2048) generated in memory so the benchmarks don't need key files on disk
+SslContext* CreateBenchmarkServerContext(bool rsa = false)
+{
+	EVP_PKEY* key = 0;
+	EVP_PKEY_CTX* keyCtx = EVP_PKEY_CTX_new_id(rsa ? EVP_PKEY_RSA : EVP_PKEY_EC, 0);
+	if (!keyCtx || EVP_PKEY_keygen_init(keyCtx) <= 0 ||
+		(rsa ? EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048) : EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx, NID_X9_62_prime256v1)) <= 0 ||
+		EVP_PKEY_keygen(keyCtx, &key) <= 0)
+	{
+		EVP_PKEY_CTX_free(keyCtx);
+		return 0;
+	}
+	EVP_PKEY_CTX_free(keyCtx);
+
+	X509* cert = X509_new();
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+	X509_set_pubkey(cert, key);
+	X509_NAME* name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	X509_sign(cert, key, EVP_sha256());
+
+	SslContext* context = SslContext::CreateServer();
+	if (context && context->setCertificate(cert, key) != SSLSOCKET_SUCCESS)
+	{
+		context->Release();
+		context = 0;
+	}
+
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return context;
+}
+
+// Private memory (Windows) or resident set (Linux) of this process, in bytes
+long long GetProcessMemoryBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters)))
+		return 0;
+	return counters.PrivateUsage;
+#else
+	long long pages = 0, resident = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (!statm)
+		return 0;
+	if (fscanf(statm, "%lld %lld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(statm);
+	return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+typedef struct
+{
+	std::mutex lock;
+	std::vector<SslSocket*> sockets;
+	std::atomic<int> accepted;
+}IDLE_SERVER;
+
+void Idle_DataReceived(SslSocket* clientSocket, char* data, size_t dataSize, void* pointer)
+{
+}
+
+void Idle_ConnectionClosed(char* address, int port, void* pointer)
+{
+}
+
+void Idle_NewConnection(SSLCLIENT_CONNECTION_DATA* client)
+{
+	IDLE_SERVER* server = (IDLE_SERVER*)client->instance;
+	SslSocket* clientHandler = new SslSocket(client->clSsl, client->clPort, Idle_DataReceived, Idle_ConnectionClosed, server);
+	free(client);
+
+	std::lock_guard<std::mutex> guard(server->lock);
+	server->sockets.push_back(clientHandler);
+	server->accepted++;
+}
+
+// Opens IDLE_CONNECTIONS loopback TLS connections that never send data and reports the memory they hold.
+// Both ends of each connection live in this process, so the figures are per TLS endpoint
+bool RunIdleConnections(SslContext* serverContext, SslContext* clientContext, bool lowMemory, double* processBytes = 0, double* openSslBytes = 0)
+{
+	IDLE_SERVER server;
+	server.accepted = 0;
+
+	SslSocket* serverSocket = new SslSocket(serverContext);
+	serverSocket->setLowMemoryMode(lowMemory);
+	if (serverSocket->Listen((char*)"127.0.0.1", (char*)IDLE_PORT, Idle_NewConnection, &server) != SSLSOCKET_SUCCESS)
+	{
+		std::cout << "Failed to listen on port " << IDLE_PORT << "!\n";
+		return false;
+	}
+	Sleep(IDLE_SETTLE_MS);
+
+	long long processBefore = GetProcessMemoryBytes();
+	long long openSslBefore = SslContext::getAllocatedBytes();
+
+	std::vector<SslSocket*> clients;
+	for (int i = 0; i < IDLE_CONNECTIONS; i++)
+	{
+		SslSocket* clientSocket = new SslSocket(clientContext);
+		clientSocket->setLowMemoryMode(lowMemory);
+		clientSocket->setSessionReuse(false);
+		if (clientSocket->Connect((char*)"127.0.0.1", (char*)IDLE_PORT, Idle_DataReceived, Idle_ConnectionClosed, &server) != SSLSOCKET_SUCCESS)
+		{
+			std::cout << "Failed to connect!\n";
+			return false;
+		}
+		clients.push_back(clientSocket);
+	}
+
+	while (server.accepted < IDLE_CONNECTIONS)
+		Sleep(10);
+	// Let the read loops reach their idle wait and OpenSSL release the handshake buffers
+	Sleep(IDLE_SETTLE_MS);
+
+	double endpoints = IDLE_CONNECTIONS * 2.0;
+	double processPerEndpoint = (GetProcessMemoryBytes() - processBefore) / endpoints;
+	double openSslPerEndpoint = (SslContext::getAllocatedBytes() - openSslBefore) / endpoints;
+	printf("%-11s %8.1f KiB process memory per idle TLS endpoint  %8.1f KiB held by OpenSSL\n",
+		lowMemory ? "low-memory" : "default", processPerEndpoint / 1024, openSslPerEndpoint / 1024);
+	if (processBytes)
+		*processBytes = processPerEndpoint;
+	if (openSslBytes)
+		*openSslBytes = openSslPerEndpoint;
+
+	for (size_t i = 0; i < clients.size(); i++)
+		clients[i]->Cleanup();
+	for (size_t i = 0; i < server.sockets.size(); i++)
+		server.sockets[i]->Cleanup();
+	serverSocket->Cleanup();
+	Sleep(IDLE_SETTLE_MS);
+	return true;
+}
+
+// Call before anything else in the process touches OpenSSL, otherwise the OpenSSL column reads as not available
+int RunSslIdleMemoryBenchmark()
+{
+	if (!SslContext::EnableMemoryAccounting())
+		std::cout << "OpenSSL memory accounting is not available, OpenSSL was used before the benchmark started\n";
+
+	SslContext* serverContext = CreateBenchmarkServerContext();
+	SslContext* clientContext = SslContext::CreateClient();
+	if (!serverContext || !clientContext)
+	{
+		std::cout << "Failed to create the TLS contexts!\n";
+		return 1;
+	}
+
+	std::cout << IDLE_CONNECTIONS << " idle loopback TLS connections\n";
+	bool completed = RunIdleConnections(serverContext, clientContext, false) && RunIdleConnections(serverContext, clientContext, true);
+
+	serverContext->Release();
+	clientContext->Release();
+	return completed ? 0 : 1;
+}
+
+int GetProcessorCount()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+typedef struct
+{
+	SslContext* clientContext;
+	int port;
+	bool resume;
+	volatile bool* stop;
+	std::atomic<unsigned long long> resumed;
+}HANDSHAKE_CLIENT;
+
+// Handshakes in a loop straight on OpenSSL, so the client side costs as little as possible. With resume
+// each thread offers the session of its previous connection
+DWORD WINAPI HandshakeClient_Thread(LPVOID param)
+{
+	HANDSHAKE_CLIENT* client = (HANDSHAKE_CLIENT*)param;
+	SSL_SESSION* session = 0;
+
+	sockaddr_in address;
+	ZeroMemory(&address, sizeof(sockaddr_in));
+	address.sin_family = AF_INET;
+	address.sin_port = htons((u_short)client->port);
+	inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+
+	while (!*client->stop)
+	{
+		SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (sock == INVALID_SOCKET)
+			continue;
+
+		if (connect(sock, (sockaddr*)&address, sizeof(sockaddr_in)) != SOCKET_ERROR)
+		{
+			SSL* ssl = SSL_new(client->clientContext->getNativeContext());
+			SSL_set_fd(ssl, (int)sock);
+			if (client->resume && session)
+				SSL_set_session(ssl, session);
+			if (SSL_connect(ssl) == 1 && client->resume)
+			{
+				if (SSL_session_reused(ssl))
+					client->resumed++;
+
+				// TLS 1.3 tickets arrive after the handshake, read them until the server closes the connection
+				char drain[256];
+				while (SSL_read(ssl, drain, sizeof(drain)) > 0);
+				SSL_SESSION* next = SSL_get1_session(ssl);
+				if (next && SSL_SESSION_is_resumable(next))
+				{
+					if (session)
+						SSL_SESSION_free(session);
+					session = next;
+				}
+				else if (next)
+					SSL_SESSION_free(next);
+			}
+			SSL_free(ssl);
+		}
+		closesocket(sock);
+	}
+
+	if (session)
+		SSL_SESSION_free(session);
+	return 0;
+}
+
+void Handshake_NewConnection(SSLCLIENT_CONNECTION_DATA* client)
+{
+	SSL_free(client->clSsl);
+	closesocket(client->socket);
+	free(client);
+}
+
+bool RunHandshakes(SslContext* serverContext, SslContext* clientContext, const char* keyName, int port, int pollWorkers, int cryptoWorkers,
+	bool resume = false, double* handshakesPerSecond = 0)
+{
+	char portString[8];
+	sprintf(portString, "%d", port);
+
+	SslSocket* serverSocket = new SslSocket(serverContext);
+	serverSocket->setHandshakeWorkers(pollWorkers, SSL_HANDSHAKE_DEFAULT_DEADLINE_MS, cryptoWorkers);
+	if (serverSocket->Listen((char*)"127.0.0.1", portString, Handshake_NewConnection) != SSLSOCKET_SUCCESS)
+	{
+		std::cout << "Failed to listen on port " << portString << "!\n";
+		return false;
+	}
+
+	volatile bool stop = false;
+	HANDSHAKE_CLIENT client;
+	client.clientContext = clientContext;
+	client.port = port;
+	client.resume = resume;
+	client.stop = &stop;
+	client.resumed = 0;
+
+	HANDLE threads[HANDSHAKE_CLIENT_THREADS];
+	for (int i = 0; i < HANDSHAKE_CLIENT_THREADS; i++)
+		threads[i] = CreateThread(0, 0, HandshakeClient_Thread, &client, 0, 0);
+
+	// Skip the first second while the client threads ramp up
+	Sleep(1000);
+	SSL_HANDSHAKE_STATS before, after;
+	serverSocket->getHandshakeStats(&before);
+	Sleep(HANDSHAKE_SECONDS * 1000);
+	serverSocket->getHandshakeStats(&after);
+
+	stop = true;
+	for (int i = 0; i < HANDSHAKE_CLIENT_THREADS; i++)
+	{
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+
+	double rate = (after.completed - before.completed) / (double)HANDSHAKE_SECONDS;
+	printf("%-10s %-7s %2d poll / %2d crypto workers  %10.0f handshakes/s  (%llu failed, %llu timed out, %llu shed, %llu resumed)\n", keyName,
+		resume ? "resumed" : "full", pollWorkers, cryptoWorkers, rate, after.failed - before.failed, after.timedOut - before.timedOut,
+		after.shed - before.shed, client.resumed.load());
+	if (handshakesPerSecond)
+		*handshakesPerSecond = rate;
+
+	serverSocket->Cleanup();
+	Sleep(IDLE_SETTLE_MS);
+	return true;
+}
+
+// Server handshakes per second over loopback, with the handshake steps on the poll workers and on a crypto pool
+int RunSslHandshakeBenchmark()
+{
+	int processors = GetProcessorCount();
+	SslContext* clientContext = SslContext::CreateClient();
+	if (!clientContext)
+	{
+		std::cout << "Failed to create the TLS contexts!\n";
+		return 1;
+	}
+
+	int port = HANDSHAKE_BASE_PORT;
+	for (int rsa = 0; rsa < 2; rsa++)
+	{
+		SslContext* serverContext = CreateBenchmarkServerContext(rsa != 0);
+		if (!serverContext)
+		{
+			std::cout << "Failed to create the TLS contexts!\n";
+			return 1;
+		}
+
+		const char* keyName = rsa ? "RSA-2048" : "ECDSA-P256";
+		bool completed = RunHandshakes(serverContext, clientContext, keyName, port++, processors, 0) &&
+			RunHandshakes(serverContext, clientContext, keyName, port++, 1, processors);
+		serverContext->Release();
+		if (!completed)
+			return 1;
+	}
+
+	clientContext->Release();
+	return 0;
+}
+
+// Moves all pending ciphertext from one engine to the other, this is the whole "transport"
+void PumpCiphertext(SslEngine* from, SslEngine* to, char* buffer, size_t bufferSize)
+{
+	size_t len;
+	while ((len = from->ReadCiphertext(buffer, bufferSize)) > 0)
+		to->FeedCiphertext(buffer, len);
+}
+
+bool HandshakeInMemory(SslEngine* client, SslEngine* server, char* buffer, size_t bufferSize)
+{
+	int clientState = SSLENGINE_WANT_IO, serverState = SSLENGINE_WANT_IO;
+	while (clientState == SSLENGINE_WANT_IO || serverState == SSLENGINE_WANT_IO)
+	{
+		clientState = client->Handshake();
+		PumpCiphertext(client, server, buffer, bufferSize);
+		serverState = server->Handshake();
+		PumpCiphertext(server, client, buffer, bufferSize);
+		if (clientState == SSLENGINE_ERROR || serverState == SSLENGINE_ERROR)
+			return false;
+	}
+
+	return true;
+}
+
+// TLS without sockets: handshakes and bulk transfer between two SslEngine instances in the same thread
+int RunSslEngineBenchmark()
+{
+	SslContext* serverContext = CreateBenchmarkServerContext();
+	SslContext* clientContext = SslContext::CreateClient();
+	if (!serverContext || !clientContext)
+	{
+		std::cout << "Failed to create the TLS contexts!\n";
+		return 1;
+	}
+
+	size_t bufferSize = 256 * 1024;
+	char* buffer = (char*)malloc(bufferSize);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ENGINE_HANDSHAKES; i++)
+	{
+		SslEngine client(clientContext), server(serverContext);
+		if (!HandshakeInMemory(&client, &server, buffer, bufferSize))
+		{
+			std::cout << "In-memory handshake failed!\n";
+			return 1;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	printf("in-memory  %10.0f handshakes/s (client and server on one thread)\n", ENGINE_HANDSHAKES / elapsed.count());
+
+	SslEngine client(clientContext), server(serverContext);
+	if (!HandshakeInMemory(&client, &server, buffer, bufferSize))
+	{
+		std::cout << "In-memory handshake failed!\n";
+		return 1;
+	}
+
+	// Several writes are encrypted into one ciphertext batch before it is handed over, like one send per event loop turn
+	char message[ENGINE_MESSAGE_SIZE];
+	memset(message, 'E', ENGINE_MESSAGE_SIZE);
+	char plaintext[16384];
+	ULONGLONG received = 0;
+	start = std::chrono::steady_clock::now();
+	while (received < ENGINE_TOTAL_BYTES)
+	{
+		for (int i = 0; i < ENGINE_MESSAGES_PER_BATCH; i++)
+			client.Encrypt(message, ENGINE_MESSAGE_SIZE);
+		PumpCiphertext(&client, &server, buffer, bufferSize);
+
+		int len;
+		while ((len = server.Decrypt(plaintext, sizeof(plaintext))) > 0)
+			received += len;
+		if (len < 0)
+		{
+			std::cout << "In-memory decrypt failed!\n";
+			return 1;
+		}
+	}
+	elapsed = std::chrono::steady_clock::now() - start;
+	printf("in-memory  %10.2f GB/s encrypt + decrypt in %d byte writes\n", received / (1024.0 * 1024.0 * 1024.0) / elapsed.count(), ENGINE_MESSAGE_SIZE);
+
+	free(buffer);
+	serverContext->Release();
+	clientContext->Release();
+	return 0;
+}
+
+typedef struct
+{
+	std::string name;
+	double value;
+	const char* unit;
+}BENCHMARK_METRIC;
+
+void Bulk_DataReceived(SslSocket* clientSocket, char* data, size_t dataSize, void* pointer)
+{
+	*(std::atomic<ULONGLONG>*)pointer += dataSize;
+}
+
+void Bulk_ConnectionClosed(char* address, int port, void* pointer)
+{
+}
+
+void Bulk_NewConnection(SSLCLIENT_CONNECTION_DATA* client)
+{
+	new SslSocket(client->clSsl, client->clPort, Bulk_DataReceived, Bulk_ConnectionClosed, client->instance);
+	free(client);
+}
+
+void Echo_DataReceived(SslSocket* clientSocket, char* data, size_t dataSize, void* pointer)
+{
+	clientSocket->Write(data, dataSize);
+}
+
+void Echo_NewConnection(SSLCLIENT_CONNECTION_DATA* client)
+{
+	new SslSocket(client->clSsl, client->clPort, Echo_DataReceived, Bulk_ConnectionClosed, client->instance);
+	free(client);
+}
+
+// Listener on the given port, the accepted connections pass received bytes to the callback of newConnCallback
+SslSocket* ListenForBenchmark(SslContext* serverContext, int port, SSLNEW_CONNECTION_MEMBER_CALLBACK newConnCallback, void* dataPointers)
+{
+	char portString[8];
+	sprintf(portString, "%d", port);
+
+	SslSocket* serverSocket = new SslSocket(serverContext);
+	if (serverSocket->Listen((char*)"127.0.0.1", portString, newConnCallback, dataPointers) != SSLSOCKET_SUCCESS)
+	{
+		std::cout << "Failed to listen on port " << portString << "!\n";
+		serverSocket->Cleanup();
+		return 0;
+	}
+	return serverSocket;
+}
+
+// Streams BULK_TOTAL_BYTES through SslSocket::Write with the client restricted to one TLS 1.3 cipher suite
+bool RunBulkTransfer(SslContext* serverContext, const char* cipherSuite, int port, double* gigabytesPerSecond)
+{
+	std::atomic<ULONGLONG> serverReceived(0), clientReceived(0);
+	SslSocket* serverSocket = ListenForBenchmark(serverContext, port, Bulk_NewConnection, &serverReceived);
+	if (!serverSocket)
+		return false;
+
+	SslContext* clientContext = SslContext::CreateClient();
+	if (!clientContext || !clientContext->setCipherPolicy(0, cipherSuite, TLS1_3_VERSION))
+	{
+		std::cout << "Cipher suite " << cipherSuite << " is not available!\n";
+		return false;
+	}
+
+	char portString[8];
+	sprintf(portString, "%d", port);
+	SslSocket* clientSocket = new SslSocket(clientContext);
+	clientContext->Release();
+	if (clientSocket->Connect((char*)"127.0.0.1", portString, Bulk_DataReceived, Bulk_ConnectionClosed, &clientReceived) != SSLSOCKET_SUCCESS)
+	{
+		std::cout << "Failed to connect!\n";
+		return false;
+	}
+
+	char* block = (char*)malloc(BULK_WRITE_SIZE);
+	memset(block, 'B', BULK_WRITE_SIZE);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (ULONGLONG sent = 0; sent < BULK_TOTAL_BYTES; sent += BULK_WRITE_SIZE)
+	{
+		if (!clientSocket->Write(block, BULK_WRITE_SIZE))
+		{
+			std::cout << "Write failed during the benchmark!\n";
+			return false;
+		}
+		if (clientSocket->getQueuedBytes() > BULK_MAX_QUEUED)
+			clientSocket->Flush();
+	}
+	while (serverReceived < BULK_TOTAL_BYTES)
+		Sleep(1);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	*gigabytesPerSecond = BULK_TOTAL_BYTES / (1024.0 * 1024.0 * 1024.0) / elapsed.count();
+	printf("%-28s %8.2f GB/s\n", cipherSuite, *gigabytesPerSecond);
+
+	free(block);
+	clientSocket->Cleanup();
+	serverSocket->Cleanup();
+	Sleep(IDLE_SETTLE_MS);
+	return true;
+}
+
+// Round trip of a small message through an echo server, measured from Write until the echo reached the data callback
+bool RunWriteLatency(SslContext* serverContext, SslContext* clientContext, int port, std::vector<double>& samples)
+{
+	std::atomic<ULONGLONG> serverReceived(0), clientReceived(0);
+	SslSocket* serverSocket = ListenForBenchmark(serverContext, port, Echo_NewConnection, &serverReceived);
+	if (!serverSocket)
+		return false;
+
+	char portString[8];
+	sprintf(portString, "%d", port);
+	SslSocket* clientSocket = new SslSocket(clientContext);
+	if (clientSocket->Connect((char*)"127.0.0.1", portString, Bulk_DataReceived, Bulk_ConnectionClosed, &clientReceived) != SSLSOCKET_SUCCESS)
+	{
+		std::cout << "Failed to connect!\n";
+		return false;
+	}
+
+	char message[LATENCY_MESSAGE_SIZE];
+	memset(message, 'L', LATENCY_MESSAGE_SIZE);
+	samples.reserve(LATENCY_ROUNDS);
+	for (int i = 0; i < LATENCY_ROUNDS; i++)
+	{
+		ULONGLONG expected = clientReceived + LATENCY_MESSAGE_SIZE;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		clientSocket->Write(message, LATENCY_MESSAGE_SIZE);
+		while (clientReceived < expected)
+			std::this_thread::yield();
+
+		std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+		samples.push_back(elapsed.count());
+	}
+	std::sort(samples.begin(), samples.end());
+	printf("write round trip  p50 %8.2fus  p99 %8.2fus  max %8.2fus\n",
+		samples[samples.size() * 50 / 100], samples[samples.size() * 99 / 100], samples[samples.size() - 1]);
+
+	clientSocket->Cleanup();
+	serverSocket->Cleanup();
+	Sleep(IDLE_SETTLE_MS);
+	return true;
+}
+
+bool WriteBenchmarkJson(const char* jsonPath, std::vector<BENCHMARK_METRIC>& metrics)
+{
+	FILE* file = fopen(jsonPath, "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "{\n  \"library\": \"PrimeSocket %s\",\n  \"openssl\": \"%s\",\n  \"metrics\": [\n", PRIMESOCKET_VERSION_STRING, OpenSSL_version(OPENSSL_VERSION));
+	for (size_t i = 0; i < metrics.size(); i++)
+	{
+		fprintf(file, "    { \"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\" }%s\n", metrics[i].name.c_str(), metrics[i].value, metrics[i].unit,
+			i + 1 < metrics.size() ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	fclose(file);
+	return true;
+}
+
+// Full and resumed handshakes, bulk throughput per cipher suite, write latency and idle memory per connection
+// over loopback, written to jsonPath. Call before anything else in the process uses OpenSSL for the memory figures
+int RunSslBenchmarkSuite(const char* jsonPath)
+{
+	const char* cipherSuites[] = { "TLS_AES_128_GCM_SHA256", "TLS_AES_256_GCM_SHA384", "TLS_CHACHA20_POLY1305_SHA256" };
+	std::vector<BENCHMARK_METRIC> metrics;
+	BENCHMARK_METRIC metric;
+	int port = SUITE_BASE_PORT;
+
+	SslContext::EnableMemoryAccounting();
+	SslContext* serverContext = CreateBenchmarkServerContext();
+	SslContext* clientContext = SslContext::CreateClient();
+	if (!serverContext || !clientContext || serverContext->enableSessionResumption() != SSLSOCKET_SUCCESS)
+	{
+		std::cout << "Failed to create the TLS contexts!\n";
+		return 1;
+	}
+
+	for (int resume = 0; resume < 2; resume++)
+	{
+		if (!RunHandshakes(serverContext, clientContext, "ECDSA-P256", port++, 0, 0, resume != 0, &metric.value))
+			return 1;
+		metric.name = resume ? "handshakes.resumed" : "handshakes.full";
+		metric.unit = "handshakes/s";
+		metrics.push_back(metric);
+	}
+
+	for (int i = 0; i < sizeof(cipherSuites) / sizeof(cipherSuites[0]); i++)
+	{
+		if (!RunBulkTransfer(serverContext, cipherSuites[i], port++, &metric.value))
+			return 1;
+		metric.name = std::string("bulk.") + cipherSuites[i];
+		metric.unit = "GB/s";
+		metrics.push_back(metric);
+	}
+
+	std::vector<double> samples;
+	if (!RunWriteLatency(serverContext, clientContext, port++, samples))
+		return 1;
+	metric.unit = "us";
+	metric.name = "write_latency.p50";
+	metric.value = samples[samples.size() * 50 / 100];
+	metrics.push_back(metric);
+	metric.name = "write_latency.p99";
+	metric.value = samples[samples.size() * 99 / 100];
+	metrics.push_back(metric);
+
+	for (int lowMemory = 0; lowMemory < 2; lowMemory++)
+	{
+		double processBytes = 0, openSslBytes = 0;
+		if (!RunIdleConnections(serverContext, clientContext, lowMemory != 0, &processBytes, &openSslBytes))
+			return 1;
+		metric.unit = "bytes";
+		metric.name = lowMemory ? "idle_memory.low_memory.process" : "idle_memory.default.process";
+		metric.value = processBytes;
+		metrics.push_back(metric);
+		metric.name = lowMemory ? "idle_memory.low_memory.openssl" : "idle_memory.default.openssl";
+		metric.value = openSslBytes;
+		metrics.push_back(metric);
+	}
+
+	serverContext->Release();
+	clientContext->Release();
+	if (!WriteBenchmarkJson(jsonPath, metrics))
+	{
+		std::cout << "Failed to write " << jsonPath << "!\n";
+		return 1;
+	}
+
+	std::cout << "Results written to " << jsonPath << "\n";
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,333 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <PrimeSocket.h>
+#include <vector>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#define PINGPONG_PORT "5151"
+#define PINGPONG_MESSAGE_SIZE 64
+#define PINGPONG_ROUNDS 100000
+
+#define ZEROCOPY_PORT "5152"
+
+#define RECEIVE_DELAY_PORT "5153"
+#define RECEIVE_DELAY_BUSY_POLL_PORT "5154"
+#define RECEIVE_DELAY_MESSAGES 100000
+#define ZEROCOPY_BUFFER_SIZE (4 * 1024 * 1024)
+#define ZEROCOPY_BUFFER_COUNT 8
+#define ZEROCOPY_TOTAL_BYTES (4ULL * 1024 * 1024 * 1024)
+
+void PingPong_DataReceived(TcpSocket* clientSocket, char* data, size_t dataSize, void* pointer)
+{
+	clientSocket->Write(data, dataSize);
+}
+
+void PingPong_ConnectionClosed(char* address, int port, void* pointer)
+{
+}
+
+void PingPong_NewConnection(CLIENT_CONNECTION_DATA* client)
+{
+	bool busyPoll = *(bool*)client->dataPointers;
+
+	TcpSocket* clientHandler = new TcpSocket(client->clientSock, client->clPort, PingPong_DataReceived, PingPong_ConnectionClosed, client->dataPointers);
+	clientHandler->setSocketOption(TcpSocket::SOCKETOPT::NoDelay, 1);
+	clientHandler->setBusyPoll(busyPoll);
+}
+
+void PrintLatencyDistribution(const char* mode, std::vector<double>& samples)
+{
+	std::sort(samples.begin(), samples.end());
+	size_t count = samples.size();
+
+	printf("%-10s p50 %8.2fus  p90 %8.2fus  p99 %8.2fus  p99.9 %8.2fus  max %8.2fus\n", mode,
+		samples[count * 50 / 100], samples[count * 90 / 100], samples[count * 99 / 100],
+		samples[count * 999 / 1000], samples[count - 1]);
+}
+
+// Measures the round trip time of a small message over loopback, with the echo server and client in the same mode
+bool RunPingPong(bool busyPoll)
+{
+	TcpSocket* serverSocket = new TcpSocket();
+	if (!serverSocket->Listen((char*)"127.0.0.1", (char*)PINGPONG_PORT, PingPong_NewConnection, &busyPoll))
+	{
+		std::cout << "Failed to listen on port " << PINGPONG_PORT << "!\n";
+		return false;
+	}
+
+	TcpSocket* clientSocket = new TcpSocket();
+	if (!clientSocket->Connect((char*)"127.0.0.1", (char*)PINGPONG_PORT, 0, 0))
+	{
+		std::cout << "Failed to connect!\n";
+		return false;
+	}
+	clientSocket->setSocketOption(TcpSocket::SOCKETOPT::NoDelay, 1);
+	clientSocket->setBusyPoll(busyPoll);
+
+	char message[PINGPONG_MESSAGE_SIZE];
+	memset(message, 'P', PINGPONG_MESSAGE_SIZE);
+
+	std::vector<double> samples;
+	samples.reserve(PINGPONG_ROUNDS);
+	for (int i = 0; i < PINGPONG_ROUNDS; i++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		clientSocket->Write(message, PINGPONG_MESSAGE_SIZE);
+
+		size_t received = 0;
+		while (received < PINGPONG_MESSAGE_SIZE)
+		{
+			char* response = clientSocket->Read(PINGPONG_MESSAGE_SIZE - received);
+			if (response == 0 || response == (char*)-1)
+			{
+				std::cout << "Connection lost during the benchmark!\n";
+				return false;
+			}
+			received += strlen(response);
+			free(response);
+		}
+
+		std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+		samples.push_back(elapsed.count());
+	}
+
+	PrintLatencyDistribution(busyPoll ? "busy-poll" : "blocking", samples);
+
+	clientSocket->Close();
+	serverSocket->Close();
+	return true;
+}
+
+int RunTcpLatencyBenchmark()
+{
+	std::cout << "Loopback ping-pong, " << PINGPONG_ROUNDS << " rounds of " << PINGPONG_MESSAGE_SIZE << " bytes\n";
+	if (!RunPingPong(false))
+		return 1;
+	if (!RunPingPong(true))
+		return 1;
+
+	return 0;
+}
+
+// User + kernel CPU time consumed by this process, in seconds
+double GetProcessCpuSeconds()
+{
+#ifdef _WIN32
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+	ULONGLONG kernel = ((ULONGLONG)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime;
+	ULONGLONG user = ((ULONGLONG)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime;
+	return (kernel + user) / 10000000.0;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+#endif
+}
+
+void ZeroCopySink_DataReceived(TcpSocket* clientSocket, char* data, size_t dataSize, void* pointer)
+{
+}
+
+void ZeroCopySink_NewConnection(CLIENT_CONNECTION_DATA* client)
+{
+	TcpSocket* clientHandler = new TcpSocket(client->clientSock, client->clPort, ZeroCopySink_DataReceived, PingPong_ConnectionClosed, client->dataPointers);
+	// Run the sink callback on the read loop so the receiver doesn't spawn a thread per chunk
+	clientHandler->setBusyPoll(true);
+}
+
+void ZeroCopy_BufferReleased(void* data, size_t dataSize, void* context)
+{
+	volatile bool* released = (volatile bool*)context;
+	*released = true;
+}
+
+// Streams ZEROCOPY_TOTAL_BYTES to a local sink, cycling through a fixed set of buffers and waiting for each one to be released before reuse
+bool RunZeroCopyStream(bool zeroCopy)
+{
+	bool serverData = false;
+	TcpSocket* serverSocket = new TcpSocket();
+	if (!serverSocket->Listen((char*)"127.0.0.1", (char*)ZEROCOPY_PORT, ZeroCopySink_NewConnection, &serverData))
+	{
+		std::cout << "Failed to listen on port " << ZEROCOPY_PORT << "!\n";
+		return false;
+	}
+
+	TcpSocket* clientSocket = new TcpSocket();
+	if (!clientSocket->Connect((char*)"127.0.0.1", (char*)ZEROCOPY_PORT, 0, 0))
+	{
+		std::cout << "Failed to connect!\n";
+		return false;
+	}
+	if (zeroCopy && !clientSocket->setZeroCopy(true))
+		std::cout << "Zero-copy is not supported on this platform, the copying path is measured instead\n";
+
+	char* buffers[ZEROCOPY_BUFFER_COUNT];
+	volatile bool released[ZEROCOPY_BUFFER_COUNT];
+	for (int i = 0; i < ZEROCOPY_BUFFER_COUNT; i++)
+	{
+		buffers[i] = (char*)malloc(ZEROCOPY_BUFFER_SIZE);
+		memset(buffers[i], 'Z', ZEROCOPY_BUFFER_SIZE);
+		released[i] = true;
+	}
+
+	double cpuStart = GetProcessCpuSeconds();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (ULONGLONG sent = 0, i = 0; sent < ZEROCOPY_TOTAL_BYTES; sent += ZEROCOPY_BUFFER_SIZE, i++)
+	{
+		int index = i % ZEROCOPY_BUFFER_COUNT;
+		while (!released[index])
+			clientSocket->FlushZeroCopy(ZEROCOPY_POLL_INTERVAL_MS);
+
+		released[index] = false;
+		if (!clientSocket->WriteZeroCopy(buffers[index], ZEROCOPY_BUFFER_SIZE, ZeroCopy_BufferReleased, (void*)&released[index]))
+		{
+			std::cout << "Write failed during the benchmark!\n";
+			return false;
+		}
+	}
+	clientSocket->FlushZeroCopy(INFINITE);
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	double cpuSeconds = GetProcessCpuSeconds() - cpuStart;
+	double gigabytes = ZEROCOPY_TOTAL_BYTES / (1024.0 * 1024.0 * 1024.0);
+
+	ZEROCOPY_STATS stats;
+	clientSocket->getZeroCopyStats(&stats);
+	printf("%-10s %8.2f GB/s  %6.3f CPU seconds per GB  (zero-copy %llu bytes, copied %llu bytes, kernel copied %llu sends)\n",
+		zeroCopy ? "zero-copy" : "copy", gigabytes / elapsed.count(), cpuSeconds / gigabytes,
+		stats.zeroCopyBytes, stats.copiedBytes, stats.kernelCopiedWrites);
+
+	clientSocket->Close();
+	serverSocket->Close();
+	for (int i = 0; i < ZEROCOPY_BUFFER_COUNT; i++)
+		free(buffers[i]);
+	return true;
+}
+
+// Note: over loopback the kernel falls back to copying on the receive side, run the sink on another host for real numbers
+int RunTcpZeroCopyBenchmark()
+{
+	std::cout << "Streaming " << ZEROCOPY_TOTAL_BYTES / (1024 * 1024) << " MiB in " << ZEROCOPY_BUFFER_SIZE / 1024 << " KiB writes\n";
+	if (!RunZeroCopyStream(false))
+		return 1;
+	if (!RunZeroCopyStream(true))
+		return 1;
+
+	return 0;
+}
+
+typedef struct
+{
+	bool busyPoll;
+	TcpSocket* handler;
+	std::atomic<unsigned long long> chunks;
+	std::atomic<unsigned long long> stamped;
+}RECEIVE_DELAY_SINK;
+
+void ReceiveDelaySink_DataReceived(TcpSocket* clientSocket, char* data, size_t dataSize, void* pointer)
+{
+	RECEIVE_DELAY_SINK* sink = (RECEIVE_DELAY_SINK*)pointer;
+	RECEIVE_TIMESTAMP timestamp;
+	sink->chunks++;
+	if (TcpSocket::getReceiveTimestamp(&timestamp) && timestamp.softwareNs != 0)
+		sink->stamped++;
+}
+
+void ReceiveDelaySink_NewConnection(CLIENT_CONNECTION_DATA* client)
+{
+	RECEIVE_DELAY_SINK* sink = (RECEIVE_DELAY_SINK*)client->dataPointers;
+
+	// Picks up the receive timestamps the listener enabled
+	TcpSocket* clientHandler = new TcpSocket(client->clientSock, client->clPort, ReceiveDelaySink_DataReceived, PingPong_ConnectionClosed, client->dataPointers);
+	clientHandler->setBusyPoll(sink->busyPoll);
+	sink->handler = clientHandler;
+}
+
+// Delay from the kernel receive timestamp to the data callback for a stream of small messages, with the callback
+// on a thread per chunk or on the read loop
+bool RunStreamReceiveDelay(bool busyPoll)
+{
+	const char* port = busyPoll ? RECEIVE_DELAY_BUSY_POLL_PORT : RECEIVE_DELAY_PORT;
+	RECEIVE_DELAY_SINK sink;
+	sink.busyPoll = busyPoll;
+	sink.handler = 0;
+	sink.chunks = 0;
+	sink.stamped = 0;
+
+	TcpSocket* serverSocket = new TcpSocket();
+	if (!serverSocket->setReceiveTimestamps(true))
+	{
+		std::cout << "Receive timestamps are not supported\n";
+		return false;
+	}
+	if (!serverSocket->Listen((char*)"127.0.0.1", (char*)port, ReceiveDelaySink_NewConnection, &sink))
+	{
+		std::cout << "Failed to listen on port " << port << "!\n";
+		return false;
+	}
+
+	TcpSocket* clientSocket = new TcpSocket();
+	if (!clientSocket->Connect((char*)"127.0.0.1", (char*)port, 0, 0))
+	{
+		std::cout << "Failed to connect!\n";
+		return false;
+	}
+	clientSocket->setSocketOption(TcpSocket::SOCKETOPT::NoDelay, 1);
+
+	char message[PINGPONG_MESSAGE_SIZE];
+	memset(message, 'R', PINGPONG_MESSAGE_SIZE);
+	for (int i = 0; i < RECEIVE_DELAY_MESSAGES; i++)
+		clientSocket->Write(message, PINGPONG_MESSAGE_SIZE);
+
+	Sleep(1000);
+	RECEIVE_DELAY_STATS stats;
+	if (sink.handler == 0 || !sink.handler->getReceiveDelayStats(&stats))
+	{
+		std::cout << "The accepted connection has no receive timestamps!\n";
+		return false;
+	}
+	printf("%-10s avg %8.1fus  p50 %8.1fus  p99 %8.1fus  p99.9 %8.1fus  max %8.1fus  (%llu chunks, %llu with timestamp)\n",
+		busyPoll ? "busy-poll" : "blocking", stats.averageUs, stats.p50Us, stats.p99Us, stats.p999Us, stats.maxUs,
+		(unsigned long long)sink.chunks, (unsigned long long)sink.stamped);
+
+	clientSocket->Close();
+	serverSocket->Close();
+	Sleep(100);
+	return sink.stamped == sink.chunks;
+}
+
+int RunTcpReceiveDelayBenchmark()
+{
+	std::cout << "Kernel receive to data callback delay, " << RECEIVE_DELAY_MESSAGES << " writes of " << PINGPONG_MESSAGE_SIZE << " bytes\n";
+	if (!RunStreamReceiveDelay(false))
+		return 1;
+	if (!RunStreamReceiveDelay(true))
+		return 1;
+
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,1052 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <PrimeSocket.h>
+#include <thread>
+#include <string>
+#include <unordered_map>
+
+#define PPS_BASE_PORT 5200
+#define PPS_PAYLOAD_SIZE 64
+#define PPS_SENDER_THREADS 2
+#define PPS_SECONDS 5
+
+#define SEND_BASE_PORT 5210
+#define SEND_DATAGRAMS 1000000
+#define SEND_BATCH_SIZE 256
+#define SEND_PEERS 16
+
+#define ENDPOINT_PORT 5240
+
+#define SHARD_BASE_PORT 5250
+#define SHARD_SENDER_THREADS 8
+
+#define SESSION_PEERS 10000
+#define SESSION_DATAGRAMS 10000000
+
+#define CHANNEL_BASE_PORT 5260
+#define CHANNEL_MESSAGES 20000
+#define CHANNEL_STREAMS 4
+#define CHANNEL_TIMEOUT_SECONDS 60
+
+#define MULTICAST_PORT 5270
+#define MULTICAST_GROUPS 4
+#define MULTICAST_DATAGRAMS 200000
+
+#define PACER_BASE_PORT 5290
+#define PACER_DATAGRAMS 20000
+#define PACER_DATAGRAM_SIZE 1200
+#define PACER_GLOBAL_RATE (30 * 1000 * 1000) // Bytes per second
+#define PACER_SLOW_RATE (10 * 1000 * 1000) // Second destination only
+
+#define TIMESTAMP_BASE_PORT 5300
+#define TIMESTAMP_SECONDS 3
+
+#define OFFLOAD_PORT 5230
+#define OFFLOAD_SEGMENT_SIZE 1200
+#define OFFLOAD_WRITE_SIZE (64 * 1024)
+#define OFFLOAD_SECONDS 5
+
+typedef struct
+{
+	int port;
+	volatile bool* stop;
+}PPS_SENDER;
+
+typedef struct
+{
+	std::atomic<unsigned long long> datagrams;
+	std::atomic<unsigned long long> batches;
+}PPS_COUNTERS;
+
+// Sends small datagrams to the receiver as fast as sendto allows
+DWORD WINAPI PpsSender_Thread(LPVOID param)
+{
+	PPS_SENDER* sender = (PPS_SENDER*)param;
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	sockaddr_in address;
+	ZeroMemory(&address, sizeof(sockaddr_in));
+	address.sin_family = AF_INET;
+	address.sin_port = htons((u_short)sender->port);
+	inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+
+	char payload[PPS_PAYLOAD_SIZE];
+	memset(payload, 'U', PPS_PAYLOAD_SIZE);
+	while (!*sender->stop)
+		sendto(sock, payload, PPS_PAYLOAD_SIZE, 0, (sockaddr*)&address, sizeof(sockaddr_in));
+
+	closesocket(sock);
+	return 0;
+}
+
+void Pps_DatagramReceived(UDP_DATAGRAM* datagram, void* dataPointers)
+{
+	PPS_COUNTERS* counters = (PPS_COUNTERS*)dataPointers;
+	counters->datagrams++;
+	counters->batches++;
+	free(datagram);
+}
+
+void Pps_PacketReceived(UDP_PACKET* packet, void* dataPointers)
+{
+	PPS_COUNTERS* counters = (PPS_COUNTERS*)dataPointers;
+	counters->datagrams++;
+	counters->batches++;
+	UdpPacketPool::Release(packet);
+}
+
+void Pps_BatchReceived(UDP_DATAGRAM_BATCH* batch, void* dataPointers)
+{
+	PPS_COUNTERS* counters = (PPS_COUNTERS*)dataPointers;
+	counters->datagrams += batch->count;
+	counters->batches++;
+}
+
+// Datagrams per second the receiver delivers to its callback while the senders flood it over loopback.
+// batchSize 0 delivers one UDP_DATAGRAM per callback, or one UDP_PACKET with packets
+bool RunPps(unsigned int batchSize, int port, bool packets = false)
+{
+	char portString[8];
+	sprintf(portString, "%d", port);
+
+	PPS_COUNTERS counters;
+	counters.datagrams = 0;
+	counters.batches = 0;
+
+	UdpSocket* receiver = new UdpSocket();
+	bool bound;
+	if (batchSize == 0 && packets)
+		bound = receiver->Bind((char*)"127.0.0.1", portString, Pps_PacketReceived, &counters);
+	else if (batchSize == 0)
+		bound = receiver->Bind((char*)"127.0.0.1", portString, Pps_DatagramReceived, &counters);
+	else
+		bound = receiver->setReceiveBatch(batchSize, PPS_PAYLOAD_SIZE) && receiver->Bind((char*)"127.0.0.1", portString, Pps_BatchReceived, &counters);
+	if (!bound)
+	{
+		std::cout << "Failed to bind port " << portString << "!\n";
+		return false;
+	}
+
+	volatile bool stop = false;
+	PPS_SENDER sender;
+	sender.port = port;
+	sender.stop = &stop;
+
+	HANDLE threads[PPS_SENDER_THREADS];
+	for (int i = 0; i < PPS_SENDER_THREADS; i++)
+		threads[i] = CreateThread(0, 0, PpsSender_Thread, &sender, 0, 0);
+
+	// Skip the first second while the senders ramp up
+	Sleep(1000);
+	unsigned long long datagramsBefore = counters.datagrams, batchesBefore = counters.batches;
+	Sleep(PPS_SECONDS * 1000);
+	unsigned long long datagrams = counters.datagrams - datagramsBefore, batches = counters.batches - batchesBefore;
+
+	stop = true;
+	for (int i = 0; i < PPS_SENDER_THREADS; i++)
+	{
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	receiver->Close();
+
+	char mode[32];
+	if (batchSize == 0)
+		sprintf(mode, packets ? "per-packet" : "per-datagram");
+	else
+		sprintf(mode, "batch of %u", batchSize);
+	printf("%-13s %12.0f datagrams/s  %8.1f datagrams per callback\n", mode, datagrams / (double)PPS_SECONDS,
+		batches ? datagrams / (double)batches : 0.0);
+
+	// Let the per-datagram worker threads finish before the counters go out of scope
+	Sleep(1000);
+	return true;
+}
+
+int RunUdpReceiveBenchmark()
+{
+	std::cout << "Loopback receive rate, " << PPS_SENDER_THREADS << " senders of " << PPS_PAYLOAD_SIZE << " byte datagrams\n";
+	UDP_PACKET* packet = UdpPacketPool::Alloc(PPS_PAYLOAD_SIZE);
+	std::cout << "Memory per datagram: " << sizeof(UDP_DATAGRAM) << " bytes as UDP_DATAGRAM, " << offsetof(UDP_PACKET, data) + packet->capacity << " bytes as UDP_PACKET\n";
+	UdpPacketPool::Release(packet);
+	int port = PPS_BASE_PORT;
+	if (!RunPps(0, port++))
+		return 1;
+	if (!RunPps(0, port++, true))
+		return 1;
+	if (!RunPps(UDP_RECV_BATCH_DEFAULT, port++))
+		return 1;
+	if (!RunPps(UDP_RECV_BATCH_MAX, port++))
+		return 1;
+
+	return 0;
+}
+
+// Sends SEND_DATAGRAMS datagrams round robin to the sink ports, with Write per datagram or WriteBatch
+bool RunSend(bool batch, int peers)
+{
+	// Nobody reads the sinks, the kernel drops what does not fit in their receive buffers
+	UdpSocket* sender = new UdpSocket();
+	SOCKET sinks[SEND_PEERS];
+	UDP_ENDPOINT endpoints[SEND_PEERS];
+	for (int i = 0; i < peers; i++)
+	{
+		sender->ResolveEndpoint((char*)"127.0.0.1", SEND_BASE_PORT + i, &endpoints[i]);
+		sinks[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (bind(sinks[i], (sockaddr*)&endpoints[i].address, endpoints[i].addressLen) == SOCKET_ERROR)
+		{
+			std::cout << "Failed to bind port " << SEND_BASE_PORT + i << "!\n";
+			return false;
+		}
+	}
+
+	char payload[PPS_PAYLOAD_SIZE];
+	memset(payload, 'U', PPS_PAYLOAD_SIZE);
+
+	UDP_BATCH_DATAGRAM* datagrams = (UDP_BATCH_DATAGRAM*)malloc(SEND_BATCH_SIZE * sizeof(UDP_BATCH_DATAGRAM));
+	unsigned long long sent = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (batch)
+	{
+		for (int first = 0; first < SEND_DATAGRAMS; first += SEND_BATCH_SIZE)
+		{
+			int count = SEND_DATAGRAMS - first < SEND_BATCH_SIZE ? SEND_DATAGRAMS - first : SEND_BATCH_SIZE;
+			for (int i = 0; i < count; i++)
+			{
+				datagrams[i].data = payload;
+				datagrams[i].len = PPS_PAYLOAD_SIZE;
+				datagrams[i].to = &endpoints[(first + i) % peers];
+			}
+			sent += sender->WriteBatch(datagrams, count);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < SEND_DATAGRAMS; i++)
+		{
+			if (sender->Write((char*)"127.0.0.1", SEND_BASE_PORT + i % peers, payload, PPS_PAYLOAD_SIZE))
+				sent++;
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	printf("%-10s %2d peers  %12.0f datagrams/s  (%llu of %d sent)\n", batch ? "WriteBatch" : "Write", peers, sent / elapsed.count(),
+		sent, SEND_DATAGRAMS);
+
+	free(datagrams);
+	sender->Close();
+	for (int i = 0; i < peers; i++)
+		closesocket(sinks[i]);
+	return true;
+}
+
+int RunUdpSendBenchmark()
+{
+	std::cout << "Loopback send rate, " << SEND_DATAGRAMS << " datagrams of " << PPS_PAYLOAD_SIZE << " bytes\n";
+	if (!RunSend(false, 1) || !RunSend(true, 1))
+		return 1;
+	if (!RunSend(false, SEND_PEERS) || !RunSend(true, SEND_PEERS))
+		return 1;
+
+	return 0;
+}
+
+// Sends SEND_DATAGRAMS datagrams to one sink: by address string, to a preresolved endpoint or on a connected socket
+bool RunEndpointSend(const char* mode, int family, bool resolved, bool connected)
+{
+	UdpSocket* sender = new UdpSocket(family);
+	UDP_ENDPOINT endpoint;
+	const char* sinkAddress = family == AF_INET6 ? "::1" : "127.0.0.1";
+	if (!sender->ResolveEndpoint((char*)sinkAddress, ENDPOINT_PORT, &endpoint))
+	{
+		std::cout << "Failed to resolve " << sinkAddress << "!\n";
+		return false;
+	}
+
+	SOCKET sink = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	if (bind(sink, (sockaddr*)&endpoint.address, endpoint.addressLen) == SOCKET_ERROR)
+	{
+		std::cout << "Failed to bind " << sinkAddress << " port " << ENDPOINT_PORT << "!\n";
+		closesocket(sink);
+		return false;
+	}
+	if (connected && !sender->Connect(&endpoint))
+	{
+		std::cout << "Failed to connect!\n";
+		return false;
+	}
+
+	char payload[PPS_PAYLOAD_SIZE];
+	memset(payload, 'E', PPS_PAYLOAD_SIZE);
+
+	unsigned long long sent = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < SEND_DATAGRAMS; i++)
+	{
+		bool result;
+		if (connected)
+			result = sender->Send(payload, PPS_PAYLOAD_SIZE);
+		else if (resolved)
+			result = sender->Write(&endpoint, payload, PPS_PAYLOAD_SIZE);
+		else
+			result = sender->Write((char*)sinkAddress, ENDPOINT_PORT, payload, PPS_PAYLOAD_SIZE);
+		if (result)
+			sent++;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	printf("%-16s %12.0f datagrams/s  (%llu of %d sent)\n", mode, sent / elapsed.count(), sent, SEND_DATAGRAMS);
+
+	sender->Close();
+	closesocket(sink);
+	return true;
+}
+
+int RunUdpEndpointBenchmark()
+{
+	std::cout << "Loopback send rate, " << SEND_DATAGRAMS << " datagrams of " << PPS_PAYLOAD_SIZE << " bytes to one peer\n";
+	if (!RunEndpointSend("address string", AF_INET, false, false) || !RunEndpointSend("endpoint", AF_INET, true, false) ||
+		!RunEndpointSend("connected", AF_INET, true, true))
+		return 1;
+
+	// IPv6 loopback may be disabled, that is not a failure of the benchmark
+	RunEndpointSend("IPv6 endpoint", AF_INET6, true, false);
+	RunEndpointSend("IPv6 connected", AF_INET6, true, true);
+	return 0;
+}
+
+// Streams OFFLOAD_SEGMENT_SIZE datagrams to a batch receiver, as UDP_SEGMENT sends and UDP_GRO receives or as WriteBatch of single datagrams
+bool RunOffload(bool offload)
+{
+	char portString[8];
+	sprintf(portString, "%d", OFFLOAD_PORT + (offload ? 1 : 0));
+
+	PPS_COUNTERS counters;
+	counters.datagrams = 0;
+	counters.batches = 0;
+
+	UdpSocket* receiver = new UdpSocket();
+	receiver->setReceiveBatch(UDP_RECV_BATCH_DEFAULT, OFFLOAD_SEGMENT_SIZE);
+	if (offload && !receiver->setReceiveOffload(true))
+		std::cout << "UDP_GRO is not supported here, receiving without it\n";
+	if (!receiver->Bind((char*)"127.0.0.1", portString, Pps_BatchReceived, &counters))
+	{
+		std::cout << "Failed to bind port " << portString << "!\n";
+		return false;
+	}
+
+	UdpSocket* sender = new UdpSocket();
+	UDP_ENDPOINT endpoint;
+	sender->ResolveEndpoint((char*)"127.0.0.1", atoi(portString), &endpoint);
+
+	char* data = (char*)malloc(OFFLOAD_WRITE_SIZE);
+	memset(data, 'G', OFFLOAD_WRITE_SIZE);
+
+	// Without offload the same buffer goes out as one WriteBatch of single datagrams
+	int datagramCount = (OFFLOAD_WRITE_SIZE + OFFLOAD_SEGMENT_SIZE - 1) / OFFLOAD_SEGMENT_SIZE;
+	UDP_BATCH_DATAGRAM* datagrams = (UDP_BATCH_DATAGRAM*)malloc(datagramCount * sizeof(UDP_BATCH_DATAGRAM));
+	for (int i = 0; i < datagramCount; i++)
+	{
+		size_t offset = i * OFFLOAD_SEGMENT_SIZE;
+		datagrams[i].data = data + offset;
+		datagrams[i].len = OFFLOAD_WRITE_SIZE - offset < OFFLOAD_SEGMENT_SIZE ? OFFLOAD_WRITE_SIZE - offset : OFFLOAD_SEGMENT_SIZE;
+		datagrams[i].to = &endpoint;
+	}
+
+	unsigned long long sentBytes = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed;
+	do
+	{
+		if (offload)
+		{
+			if (sender->WriteSegmented(&endpoint, data, OFFLOAD_WRITE_SIZE, OFFLOAD_SEGMENT_SIZE))
+				sentBytes += OFFLOAD_WRITE_SIZE;
+		}
+		else
+		{
+			int sent = sender->WriteBatch(datagrams, datagramCount);
+			for (int i = 0; i < sent; i++)
+				sentBytes += datagrams[i].len;
+		}
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed.count() < OFFLOAD_SECONDS);
+
+	// Let the receiver catch up with what is still queued
+	Sleep(500);
+	unsigned long long received = counters.datagrams, batches = counters.batches;
+
+	printf("%-10s sent %8.2f Gbit/s  received %10.0f datagrams/s  %6.1f datagrams per callback\n", offload ? "GSO + GRO" : "no offload",
+		sentBytes * 8 / elapsed.count() / 1e9, received / elapsed.count(), batches ? received / (double)batches : 0.0);
+
+	free(datagrams);
+	free(data);
+	sender->Close();
+	receiver->Close();
+	return true;
+}
+
+int RunUdpOffloadBenchmark()
+{
+	std::cout << "Loopback UDP stream of " << OFFLOAD_SEGMENT_SIZE << " byte datagrams for " << OFFLOAD_SECONDS << " seconds\n";
+	if (!RunOffload(false) || !RunOffload(true))
+		return 1;
+
+	return 0;
+}
+
+typedef struct
+{
+	int index;
+	int port;
+	volatile bool* stop;
+}SHARD_SENDER;
+
+typedef struct
+{
+	std::atomic<unsigned long long> datagrams[UDP_MAX_SHARDS];
+	std::atomic<unsigned long long> senderShards[SHARD_SENDER_THREADS]; // Bit per shard that received datagrams of the sender
+}SHARD_COUNTERS;
+
+// Each sender is its own flow (own source port) and tags its datagrams with its index
+DWORD WINAPI ShardSender_Thread(LPVOID param)
+{
+	SHARD_SENDER* sender = (SHARD_SENDER*)param;
+	UdpSocket* sock = new UdpSocket();
+	UDP_ENDPOINT endpoint;
+	sock->ResolveEndpoint((char*)"127.0.0.1", sender->port, &endpoint);
+
+	char payload[PPS_PAYLOAD_SIZE];
+	memset(payload, 'S', PPS_PAYLOAD_SIZE);
+	payload[0] = (char)sender->index;
+	while (!*sender->stop)
+		sock->Write(&endpoint, payload, PPS_PAYLOAD_SIZE);
+
+	sock->Close();
+	return 0;
+}
+
+void Shard_BatchReceived(UDP_DATAGRAM_BATCH* batch, void* dataPointers)
+{
+	SHARD_COUNTERS* counters = (SHARD_COUNTERS*)dataPointers;
+	counters->datagrams[batch->shard] += batch->count;
+	for (size_t i = 0; i < batch->count; i++)
+	{
+		int sender = batch->entries[i].data[0];
+		if (sender >= 0 && sender < SHARD_SENDER_THREADS)
+			counters->senderShards[sender].fetch_or(1ULL << batch->shard);
+	}
+}
+
+// Receive rate over loopback with the port split over shardCount cores, and how many senders were seen by more than one shard
+bool RunShardedReceive(unsigned int shardCount, bool flowSteering, int port)
+{
+	SHARD_COUNTERS* counters = new SHARD_COUNTERS();
+	for (int i = 0; i < UDP_MAX_SHARDS; i++)
+		counters->datagrams[i] = 0;
+	for (int i = 0; i < SHARD_SENDER_THREADS; i++)
+		counters->senderShards[i] = 0;
+
+	char portString[8];
+	sprintf(portString, "%d", port);
+
+	UdpShardedSocket* receiver = new UdpShardedSocket();
+	if (flowSteering && !receiver->setFlowSteering(true))
+	{
+		std::cout << "Flow steering is not supported here\n";
+		return false;
+	}
+	if (!receiver->Bind((char*)"127.0.0.1", portString, shardCount, Shard_BatchReceived, counters))
+	{
+		std::cout << "Failed to bind " << shardCount << " shards on port " << portString << "!\n";
+		return false;
+	}
+
+	volatile bool stop = false;
+	SHARD_SENDER senders[SHARD_SENDER_THREADS];
+	HANDLE threads[SHARD_SENDER_THREADS];
+	for (int i = 0; i < SHARD_SENDER_THREADS; i++)
+	{
+		senders[i].index = i;
+		senders[i].port = port;
+		senders[i].stop = &stop;
+		threads[i] = CreateThread(0, 0, ShardSender_Thread, &senders[i], 0, 0);
+	}
+
+	Sleep(1000);
+	unsigned int shards = receiver->getShardCount();
+	unsigned long long before = 0, after = 0;
+	for (unsigned int i = 0; i < shards; i++)
+		before += counters->datagrams[i];
+	Sleep(PPS_SECONDS * 1000);
+	for (unsigned int i = 0; i < shards; i++)
+		after += counters->datagrams[i];
+
+	stop = true;
+	for (int i = 0; i < SHARD_SENDER_THREADS; i++)
+	{
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	receiver->Close();
+
+	int splitSenders = 0;
+	for (int i = 0; i < SHARD_SENDER_THREADS; i++)
+	{
+		unsigned long long seenBy = counters->senderShards[i];
+		if (seenBy & (seenBy - 1))
+			splitSenders++;
+	}
+
+	printf("%2u shards %-13s %12.0f datagrams/s  %d of %d senders split over shards\n", shards,
+		flowSteering ? "flow steering" : "", (after - before) / (double)PPS_SECONDS, splitSenders, SHARD_SENDER_THREADS);
+
+	// The read loops are gone, but give any callback still running time to finish with the counters
+	Sleep(1000);
+	delete counters;
+	return true;
+}
+
+int RunUdpShardBenchmark()
+{
+	unsigned int processors = std::thread::hardware_concurrency();
+	if (processors == 0)
+		processors = 1;
+	if (processors > UDP_MAX_SHARDS)
+		processors = UDP_MAX_SHARDS;
+
+	std::cout << "Loopback receive rate with SO_REUSEPORT shards, " << SHARD_SENDER_THREADS << " senders of " << PPS_PAYLOAD_SIZE << " byte datagrams\n";
+	int port = SHARD_BASE_PORT;
+	if (!RunShardedReceive(1, false, port++) || !RunShardedReceive(processors, false, port++))
+		return 1;
+
+	// Steering needs a kernel with reuseport BPF, report but don't fail without it
+	RunShardedReceive(processors, true, port++);
+	return 0;
+}
+
+typedef struct
+{
+	unsigned long long datagrams;
+}SESSION_STATE;
+
+bool Session_Opened(UDP_SESSION* session, void* dataPointers)
+{
+	session->context = calloc(1, sizeof(SESSION_STATE));
+	return true;
+}
+
+void Session_DatagramReceived(UDP_SESSION* session, char* data, size_t len, void* dataPointers)
+{
+	((SESSION_STATE*)session->context)->datagrams++;
+}
+
+void Session_Closed(UDP_SESSION* session, void* dataPointers)
+{
+	free(session->context);
+}
+
+// Per-datagram cost of finding the state of the sender among SESSION_PEERS peers: UdpSessionTable against
+// formatting the address and looking it up in a string keyed map, the way UDP_DATAGRAM::peer is used today
+int RunUdpSessionBenchmark()
+{
+	sockaddr_storage* peers = (sockaddr_storage*)calloc(SESSION_PEERS, sizeof(sockaddr_storage));
+	for (int i = 0; i < SESSION_PEERS; i++)
+	{
+		sockaddr_in* address = (sockaddr_in*)&peers[i];
+		address->sin_family = AF_INET;
+		address->sin_addr.s_addr = htonl(0x0A000000 + i / 16);
+		address->sin_port = htons((u_short)(20000 + i % 16));
+	}
+
+	char payload[PPS_PAYLOAD_SIZE];
+	memset(payload, 'D', PPS_PAYLOAD_SIZE);
+	std::cout << "Session lookup, " << SESSION_DATAGRAMS << " datagrams from " << SESSION_PEERS << " peers\n";
+
+	UdpSessionTable* table = new UdpSessionTable(Session_Opened, Session_DatagramReceived, Session_Closed, 0, SESSION_PEERS);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < SESSION_DATAGRAMS; i++)
+		table->Dispatch(&peers[(i * 7919ULL) % SESSION_PEERS], payload, PPS_PAYLOAD_SIZE);
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	UDP_SESSION_STATS stats;
+	table->getStats(&stats);
+	printf("%-16s %8.1f ns/datagram  (%zu sessions, %llu dropped)\n", "UdpSessionTable", elapsed.count() / SESSION_DATAGRAMS, stats.sessions, stats.dropped);
+	delete table;
+
+	std::unordered_map<std::string, SESSION_STATE> states;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < SESSION_DATAGRAMS; i++)
+	{
+		sockaddr_in* address = (sockaddr_in*)&peers[(i * 7919ULL) % SESSION_PEERS];
+		char key[INET_ADDRSTRLEN + 8];
+		inet_ntop(AF_INET, &address->sin_addr, key, INET_ADDRSTRLEN);
+		sprintf(key + strlen(key), ":%d", ntohs(address->sin_port));
+		states[key].datagrams++;
+	}
+	elapsed = std::chrono::steady_clock::now() - start;
+	printf("%-16s %8.1f ns/datagram  (%zu peers)\n", "string map", elapsed.count() / SESSION_DATAGRAMS, states.size());
+
+	free(peers);
+	return 0;
+}
+
+typedef struct
+{
+	std::atomic<unsigned long long> delivered;
+	std::atomic<unsigned long long> outOfOrder;
+	unsigned int expected[CHANNEL_STREAMS];
+}CHANNEL_COUNTERS;
+
+void Channel_BatchReceived(UDP_DATAGRAM_BATCH* batch, void* dataPointers)
+{
+	UdpChannel* channel = (UdpChannel*)dataPointers;
+	for (unsigned int i = 0; i < batch->count; i++)
+		channel->Receive(batch->entries[i].data, batch->entries[i].len);
+}
+
+// Every message starts with its index on the stream, the channel must deliver them complete and in order
+void Channel_MessageReceived(UdpChannel* channel, unsigned short stream, char* data, size_t len, void* dataPointers)
+{
+	CHANNEL_COUNTERS* counters = (CHANNEL_COUNTERS*)dataPointers;
+	unsigned int index;
+	memcpy(&index, data, sizeof(unsigned int));
+	if (stream >= CHANNEL_STREAMS || index != counters->expected[stream] || len != 100 + index % 3000)
+		counters->outOfOrder++;
+	else
+		counters->expected[stream]++;
+	counters->delivered++;
+}
+
+bool RunChannel(double lossRate, DWORD jitterMs, int port)
+{
+	char portString[8];
+	UdpSocket* sender = new UdpSocket();
+	UdpSocket* receiver = new UdpSocket();
+	UDP_ENDPOINT senderEndpoint, receiverEndpoint;
+	sender->ResolveEndpoint((char*)"127.0.0.1", port, &senderEndpoint);
+	receiver->ResolveEndpoint((char*)"127.0.0.1", port + 1, &receiverEndpoint);
+
+	CHANNEL_COUNTERS* counters = new CHANNEL_COUNTERS();
+	UdpChannel* sendChannel = new UdpChannel(sender, &receiverEndpoint, Channel_MessageReceived, 0);
+	UdpChannel* receiveChannel = new UdpChannel(receiver, &senderEndpoint, Channel_MessageReceived, counters);
+
+	// Loss applies to both directions, acknowledgements get lost too
+	UDP_LOSS_SIMULATOR simulator;
+	simulator.lossRate = lossRate;
+	simulator.delayMs = 0;
+	simulator.jitterMs = jitterMs;
+	sendChannel->setLossSimulator(&simulator);
+	receiveChannel->setLossSimulator(&simulator);
+
+	sprintf(portString, "%d", port);
+	bool bound = sender->Bind((char*)"127.0.0.1", portString, Channel_BatchReceived, sendChannel);
+	sprintf(portString, "%d", port + 1);
+	bound = bound && receiver->Bind((char*)"127.0.0.1", portString, Channel_BatchReceived, receiveChannel);
+	if (!bound)
+	{
+		std::cout << "Bind failed on port " << port << "\n";
+		return false;
+	}
+
+	char* message = (char*)malloc(100 + 3000);
+	memset(message, 'C', 100 + 3000);
+	unsigned int sent[CHANNEL_STREAMS] = { 0 };
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < CHANNEL_MESSAGES; i++)
+	{
+		unsigned short stream = (unsigned short)(i % CHANNEL_STREAMS);
+		unsigned int index = sent[stream]++;
+		memcpy(message, &index, sizeof(unsigned int));
+		while (!sendChannel->Send(stream, message, 100 + index % 3000))
+			Sleep(1);
+	}
+
+	while (counters->delivered < CHANNEL_MESSAGES && std::chrono::steady_clock::now() - start < std::chrono::seconds(CHANNEL_TIMEOUT_SECONDS))
+		Sleep(1);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	UDP_CHANNEL_STATS stats;
+	sendChannel->getStats(&stats);
+	printf("loss %4.1f%% jitter %lu ms  %8.0f msg/s  %6llu/%d delivered, %llu out of order  %7llu retransmits (%llu fast, %llu timeouts)  srtt %.2f ms\n",
+		lossRate * 100, (unsigned long)jitterMs, counters->delivered / elapsed.count(), (unsigned long long)counters->delivered, CHANNEL_MESSAGES, (unsigned long long)counters->outOfOrder,
+		stats.retransmissions, stats.fastRetransmits, stats.timeouts, stats.srttMs);
+
+	bool complete = counters->delivered == CHANNEL_MESSAGES && counters->outOfOrder == 0;
+	sender->Close();
+	receiver->Close();
+	delete sendChannel;
+	delete receiveChannel;
+	delete counters;
+	free(message);
+	return complete;
+}
+
+// Messages of 100 to 3100 bytes on CHANNEL_STREAMS streams over loopback, with simulated loss and reordering
+int RunUdpChannelBenchmark()
+{
+	std::cout << "Reliable channel, " << CHANNEL_MESSAGES << " messages on " << CHANNEL_STREAMS << " streams\n";
+	int port = CHANNEL_BASE_PORT;
+	if (!RunChannel(0, 0, port) || !RunChannel(0.01, 0, port + 2) || !RunChannel(0.05, 0, port + 4) || !RunChannel(0.01, 1, port + 6))
+		return 1;
+	return 0;
+}
+
+typedef struct
+{
+	int index; // Group index JoinGroup returned
+	std::atomic<unsigned long long> datagrams;
+	std::atomic<unsigned long long> misrouted;
+}MULTICAST_COUNTERS;
+
+// Every datagram carries the number of the group it was sent to
+void Multicast_GroupReceived(UDP_DATAGRAM_BATCH* batch, void* dataPointers)
+{
+	MULTICAST_COUNTERS* counters = (MULTICAST_COUNTERS*)dataPointers;
+	for (size_t i = 0; i < batch->count; i++)
+	{
+		if (batch->entries[i].group != counters->index || batch->entries[i].data[0] != counters->index)
+			counters->misrouted++;
+	}
+	counters->datagrams += batch->count;
+}
+
+bool RunMulticast(int family, const char* groupFormat, const char* source, int port)
+{
+	char portString[8];
+	sprintf(portString, "%d", port);
+	unsigned int loopback = UdpSocket::getInterfaceIndex((char*)"lo");
+
+	// All groups on one socket with its read loop pinned to the first CPU
+	PPS_COUNTERS unmatched;
+	unmatched.datagrams = 0;
+	unmatched.batches = 0;
+	MULTICAST_COUNTERS counters[MULTICAST_GROUPS];
+	UdpSocket* receiver = new UdpSocket(family);
+	receiver->setReadLoopAffinity(1);
+	if (!receiver->Bind((char*)(family == AF_INET6 ? "::" : "0.0.0.0"), portString, Pps_BatchReceived, &unmatched))
+	{
+		std::cout << "Bind failed on port " << port << "\n";
+		return false;
+	}
+
+	char groups[MULTICAST_GROUPS][INET6_ADDRSTRLEN];
+	for (int i = 0; i < MULTICAST_GROUPS; i++)
+	{
+		sprintf(groups[i], groupFormat, i + 1);
+		counters[i].datagrams = 0;
+		counters[i].misrouted = 0;
+		counters[i].index = receiver->JoinGroup(groups[i], (char*)source, loopback, Multicast_GroupReceived, &counters[i]);
+		if (counters[i].index != i)
+		{
+			std::cout << "JoinGroup " << groups[i] << " failed\n";
+			receiver->Close();
+			return false;
+		}
+	}
+
+	// Source-specific groups only accept the source address, which the kernel would otherwise pick from the default route
+	UdpSocket* sender = new UdpSocket(family);
+	sprintf(portString, "%d", port + 100);
+	if (source && !sender->Bind((char*)source, portString, Pps_BatchReceived, &unmatched))
+	{
+		std::cout << "Bind failed on " << source << "\n";
+		receiver->Close();
+		return false;
+	}
+	sender->setMulticastInterface(loopback);
+	sender->setMulticastLoopback(true);
+	sender->setMulticastHops(1);
+	UDP_ENDPOINT endpoints[MULTICAST_GROUPS];
+	for (int i = 0; i < MULTICAST_GROUPS; i++)
+		sender->ResolveEndpoint(groups[i], port, &endpoints[i]);
+
+	char payload[PPS_PAYLOAD_SIZE];
+	memset(payload, 'M', PPS_PAYLOAD_SIZE);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < MULTICAST_DATAGRAMS; i++)
+	{
+		payload[0] = (char)(i % MULTICAST_GROUPS);
+		sender->Write(&endpoints[i % MULTICAST_GROUPS], payload, PPS_PAYLOAD_SIZE);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	Sleep(200);
+
+	// The last group is left halfway, nothing sent to it afterwards may arrive
+	bool left = receiver->LeaveGroup(groups[MULTICAST_GROUPS - 1], (char*)source, loopback);
+	unsigned long long beforeLeave = counters[MULTICAST_GROUPS - 1].datagrams;
+	for (int i = 0; i < 1000; i++)
+		sender->Write(&endpoints[MULTICAST_GROUPS - 1], payload, PPS_PAYLOAD_SIZE);
+	Sleep(200);
+
+	// Another source sending to a source-specific group must be filtered by the kernel
+	unsigned long long beforeStranger = counters[0].datagrams;
+	if (source)
+	{
+		UdpSocket* stranger = new UdpSocket(family);
+		sprintf(portString, "%d", port + 200);
+		stranger->Bind((char*)(family == AF_INET6 ? "::1" : "127.0.0.2"), portString, Pps_BatchReceived, &unmatched);
+		stranger->setMulticastInterface(loopback);
+		stranger->setMulticastLoopback(true);
+		for (int i = 0; i < 1000; i++)
+		{
+			payload[0] = 0;
+			stranger->Write(&endpoints[0], payload, PPS_PAYLOAD_SIZE);
+		}
+		Sleep(200);
+		stranger->Close();
+	}
+
+	unsigned long long delivered = 0, misrouted = 0;
+	for (int i = 0; i < MULTICAST_GROUPS; i++)
+	{
+		delivered += counters[i].datagrams;
+		misrouted += counters[i].misrouted;
+	}
+	bool correct = delivered > 0 && misrouted == 0 && unmatched.datagrams == 0 && left && counters[MULTICAST_GROUPS - 1].datagrams == beforeLeave && counters[0].datagrams == beforeStranger;
+	printf("%-4s %-4s %d groups  %10.0f datagrams/s  %llu/%d delivered, %llu misrouted, %llu unmatched, %s after leave%s\n",
+		family == AF_INET6 ? "IPv6" : "IPv4", source ? "SSM" : "ASM", MULTICAST_GROUPS, delivered / elapsed.count(), delivered, MULTICAST_DATAGRAMS,
+		misrouted, (unsigned long long)unmatched.datagrams, counters[MULTICAST_GROUPS - 1].datagrams == beforeLeave ? "silent" : "still receiving",
+		counters[0].datagrams == beforeStranger ? "" : ", other source let through");
+
+	sender->Close();
+	receiver->Close();
+	return correct;
+}
+
+// Several multicast groups on one pinned socket over the loopback interface, each dispatched to its own callback
+int RunUdpMulticastBenchmark()
+{
+	std::cout << "Multicast over loopback, " << MULTICAST_DATAGRAMS << " datagrams of " << PPS_PAYLOAD_SIZE << " bytes\n";
+	if (!RunMulticast(AF_INET, "239.1.1.%d", 0, MULTICAST_PORT) || !RunMulticast(AF_INET, "232.1.1.%d", "127.0.0.1", MULTICAST_PORT + 1))
+		return 1;
+
+	// IPv6 multicast needs a loopback interface with multicast enabled, report but don't fail without it
+	RunMulticast(AF_INET6, "ff12::1:%d", 0, MULTICAST_PORT + 2);
+	RunMulticast(AF_INET6, "ff32::8000:%d", "::1", MULTICAST_PORT + 3);
+	return 0;
+}
+
+typedef struct
+{
+	std::atomic<unsigned long long> datagrams;
+	std::atomic<ULONGLONG> lastNs;
+}PACER_COUNTERS;
+
+void Pacer_BatchReceived(UDP_DATAGRAM_BATCH* batch, void* dataPointers)
+{
+	PACER_COUNTERS* counters = (PACER_COUNTERS*)dataPointers;
+	counters->datagrams += batch->count;
+	counters->lastNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Two destinations get one burst of PACER_DATAGRAMS between them, written as fast as possible. paced == false writes
+// straight to the socket, otherwise through a UdpPacer limited to PACER_GLOBAL_RATE and PACER_SLOW_RATE for the second destination
+bool RunPacer(bool paced, bool kernelPacing, int port)
+{
+	char portString[8];
+	PACER_COUNTERS counters[2];
+	UdpSocket* receivers[2];
+	UdpSocket* sender = new UdpSocket();
+	UDP_ENDPOINT endpoints[2];
+	for (int i = 0; i < 2; i++)
+	{
+		counters[i].datagrams = 0;
+		counters[i].lastNs = 0;
+		receivers[i] = new UdpSocket();
+		sprintf(portString, "%d", port + i);
+		if (!receivers[i]->Bind((char*)"127.0.0.1", portString, Pacer_BatchReceived, &counters[i]))
+		{
+			std::cout << "Bind failed on port " << port + i << "\n";
+			return false;
+		}
+		sender->ResolveEndpoint((char*)"127.0.0.1", port + i, &endpoints[i]);
+	}
+
+	UdpPacer* pacer = 0;
+	if (paced)
+	{
+		pacer = new UdpPacer(sender, PACER_GLOBAL_RATE);
+		pacer->setDestinationRate(&endpoints[1], PACER_SLOW_RATE);
+		if (kernelPacing && !pacer->setKernelPacing(true))
+		{
+			std::cout << "SO_TXTIME is not supported\n";
+			delete pacer;
+			sender->Close();
+			return false;
+		}
+	}
+
+	char payload[PACER_DATAGRAM_SIZE];
+	memset(payload, 'P', PACER_DATAGRAM_SIZE);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < PACER_DATAGRAMS; i++)
+	{
+		if (pacer)
+			pacer->Write(&endpoints[i % 2], payload, PACER_DATAGRAM_SIZE);
+		else
+			sender->Write(&endpoints[i % 2], payload, PACER_DATAGRAM_SIZE);
+	}
+
+	UDP_PACER_STATS stats;
+	double maxQueueDelayUs = 0;
+	if (pacer)
+	{
+		// Paced datagrams leave over the next PACER_DATAGRAMS * PACER_DATAGRAM_SIZE / PACER_GLOBAL_RATE seconds
+		do
+		{
+			Sleep(10);
+			pacer->getStats(&stats);
+			if (stats.maxQueueDelayUs > maxQueueDelayUs)
+				maxQueueDelayUs = stats.maxQueueDelayUs;
+		} while (stats.queuedDatagrams > 0);
+	}
+	Sleep(200);
+
+	ULONGLONG startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count();
+	printf("%-16s", !paced ? "unpaced" : kernelPacing ? "SO_TXTIME" : "timer wheel");
+	for (int i = 0; i < 2; i++)
+	{
+		double seconds = counters[i].lastNs > startNs ? (counters[i].lastNs - startNs) / 1e9 : 0;
+		printf("  dest %d: %5llu/%d received %6.1f MB/s", i, (unsigned long long)counters[i].datagrams, PACER_DATAGRAMS / 2,
+			seconds > 0 ? counters[i].datagrams * PACER_DATAGRAM_SIZE / seconds / 1e6 : 0);
+	}
+	if (pacer)
+		printf("  queue delay max %.0f ms", maxQueueDelayUs / 1000);
+	printf("\n");
+
+	delete pacer;
+	sender->Close();
+	receivers[0]->Close();
+	receivers[1]->Close();
+	return true;
+}
+
+int RunUdpPacerBenchmark()
+{
+	std::cout << "Burst of " << PACER_DATAGRAMS << " datagrams of " << PACER_DATAGRAM_SIZE << " bytes to two receivers, paced to "
+		<< PACER_GLOBAL_RATE / 1000000 << " MB/s overall and " << PACER_SLOW_RATE / 1000000 << " MB/s for dest 1\n";
+	if (!RunPacer(false, false, PACER_BASE_PORT) || !RunPacer(true, false, PACER_BASE_PORT + 2))
+		return 1;
+
+	// Only paces when the egress device runs the fq qdisc, loopback usually does not
+	RunPacer(true, true, PACER_BASE_PORT + 4);
+	return 0;
+}
+
+void Timestamp_DatagramReceived(UDP_DATAGRAM* datagram, void* dataPointers)
+{
+	PPS_COUNTERS* counters = (PPS_COUNTERS*)dataPointers;
+	counters->datagrams++;
+	if (datagram->timestamp.softwareNs != 0)
+		counters->batches++;
+	free(datagram);
+}
+
+void Timestamp_BatchReceived(UDP_DATAGRAM_BATCH* batch, void* dataPointers)
+{
+	PPS_COUNTERS* counters = (PPS_COUNTERS*)dataPointers;
+	counters->datagrams += batch->count;
+	for (unsigned int i = 0; i < batch->count; i++)
+	{
+		if (batch->entries[i].timestamp.softwareNs != 0)
+			counters->batches++;
+	}
+}
+
+// Delay from the kernel receive timestamp to the receive callback while one sender floods the receiver.
+// batchSize 0 delivers one UDP_DATAGRAM per callback. counters.batches counts the datagrams that carried a timestamp here
+bool RunReceiveDelay(unsigned int batchSize, int port)
+{
+	char portString[8];
+	sprintf(portString, "%d", port);
+
+	PPS_COUNTERS counters;
+	counters.datagrams = 0;
+	counters.batches = 0;
+
+	UdpSocket* receiver = new UdpSocket();
+	if (!receiver->setReceiveTimestamps(true))
+	{
+		std::cout << "Receive timestamps are not supported\n";
+		return false;
+	}
+	bool bound;
+	if (batchSize == 0)
+		bound = receiver->Bind((char*)"127.0.0.1", portString, Timestamp_DatagramReceived, &counters);
+	else
+		bound = receiver->setReceiveBatch(batchSize, PPS_PAYLOAD_SIZE) && receiver->Bind((char*)"127.0.0.1", portString, Timestamp_BatchReceived, &counters);
+	if (!bound)
+	{
+		std::cout << "Failed to bind port " << portString << "!\n";
+		return false;
+	}
+
+	volatile bool stop = false;
+	PPS_SENDER sender;
+	sender.port = port;
+	sender.stop = &stop;
+	HANDLE thread = CreateThread(0, 0, PpsSender_Thread, &sender, 0, 0);
+
+	// Only the steady state goes into the histogram
+	Sleep(1000);
+	RECEIVE_DELAY_STATS stats;
+	receiver->getReceiveDelayStats(&stats, true);
+	Sleep(TIMESTAMP_SECONDS * 1000);
+	receiver->getReceiveDelayStats(&stats);
+
+	stop = true;
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+	receiver->Close();
+
+	char mode[32];
+	if (batchSize == 0)
+		sprintf(mode, "per-datagram");
+	else
+		sprintf(mode, "batch of %u", batchSize);
+	printf("%-13s avg %8.1fus  p50 %8.1fus  p99 %8.1fus  p99.9 %8.1fus  max %8.1fus  (%llu samples, %llu without timestamp)\n", mode,
+		stats.averageUs, stats.p50Us, stats.p99Us, stats.p999Us, stats.maxUs, stats.count, stats.missing);
+
+	// Let the per-datagram worker threads finish before the counters go out of scope
+	Sleep(1000);
+	if (counters.batches != counters.datagrams)
+	{
+		std::cout << counters.datagrams - counters.batches << " of " << counters.datagrams << " datagrams were delivered without a timestamp\n";
+		return false;
+	}
+	return true;
+}
+
+int RunUdpReceiveDelayBenchmark()
+{
+	std::cout << "Kernel receive to callback delay, one sender of " << PPS_PAYLOAD_SIZE << " byte datagrams over loopback\n";
+	if (!RunReceiveDelay(0, TIMESTAMP_BASE_PORT))
+		return 1;
+	if (!RunReceiveDelay(UDP_RECV_BATCH_DEFAULT, TIMESTAMP_BASE_PORT + 1))
+		return 1;
+
+	return 0;
+}
\ No newline at end of file
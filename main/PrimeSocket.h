@@ -37,11 +37,23 @@
 #ifdef USE_CRITICAL_HEAP
 #include "Heap.h"
 #endif
+#include "SocketPolicy.h"
+#include "ReceiveDelayHistogram.h"
 #include "TcpSocket.h"
+#include "UdpPacketPool.h"
 #include "UdpSocket.h"
+#include "UdpShardedSocket.h"
+#include "UdpSessionTable.h"
+#include "UdpChannel.h"
+#include "UdpPacer.h"
 #include "RawSocket.h"
 #ifdef PRIMESOCKET_USE_SSL // SslSocket is optional, requires OpenSSL library
+#include "SslSessionCache.h"
+#include "SslContext.h"
+#include "SslHandshakePool.h"
+#include "SslEngine.h"
 #include "SslSocket.h"
+#include "SslWriteScheduler.h"
 #endif
 
 #ifdef _WIN32
@@ -0,0 +1,122 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#include "PrimeSocket.h"
+
+ReceiveDelayHistogram::ReceiveDelayHistogram()
+{
+	Reset();
+}
+
+ULONGLONG ReceiveDelayHistogram::NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int ReceiveDelayHistogram::BucketOf(ULONGLONG delayNs)
+{
+	// Below RECEIVE_DELAY_SUB_BUCKETS every value has its own bucket, above that each power of two is split
+	// by the two bits after the highest set bit
+	if (delayNs < RECEIVE_DELAY_SUB_BUCKETS)
+		return (int)delayNs;
+
+	int highestBit = 63;
+	while (!(delayNs >> highestBit))
+		highestBit--;
+	return (highestBit - 1) * RECEIVE_DELAY_SUB_BUCKETS + (int)((delayNs >> (highestBit - 2)) & (RECEIVE_DELAY_SUB_BUCKETS - 1));
+}
+
+ULONGLONG ReceiveDelayHistogram::BucketUpperNs(int bucket)
+{
+	if (bucket < RECEIVE_DELAY_SUB_BUCKETS)
+		return bucket + 1;
+
+	int highestBit = bucket / RECEIVE_DELAY_SUB_BUCKETS + 1;
+	ULONGLONG subBucket = bucket % RECEIVE_DELAY_SUB_BUCKETS;
+	return (RECEIVE_DELAY_SUB_BUCKETS + subBucket + 1) << (highestBit - 2);
+}
+
+void ReceiveDelayHistogram::Record(RECEIVE_TIMESTAMP* timestamp)
+{
+	Record(timestamp, NowNs());
+}
+
+void ReceiveDelayHistogram::Record(RECEIVE_TIMESTAMP* timestamp, ULONGLONG nowNs)
+{
+	if (!timestamp->softwareNs)
+	{
+		_missing++;
+		return;
+	}
+
+	// A clock step can put the timestamp in the future, count it as no delay
+	ULONGLONG delay = nowNs > timestamp->softwareNs ? nowNs - timestamp->softwareNs : 0;
+	_buckets[BucketOf(delay)]++;
+	_count++;
+	_totalNs += delay;
+
+	unsigned long long max = _maxNs;
+	while (delay > max && !_maxNs.compare_exchange_weak(max, delay))
+		;
+}
+
+void ReceiveDelayHistogram::getStats(RECEIVE_DELAY_STATS* stats)
+{
+	ZeroMemory(stats, sizeof(RECEIVE_DELAY_STATS));
+	stats->count = _count;
+	stats->missing = _missing;
+	stats->maxUs = _maxNs / 1000.0;
+	if (!stats->count)
+		return;
+	stats->averageUs = _totalNs / 1000.0 / stats->count;
+
+	// Buckets are read one by one while others record, the percentiles are close but not a snapshot
+	double* percentiles[3] = { &stats->p50Us, &stats->p99Us, &stats->p999Us };
+	double fractions[3] = { 0.5, 0.99, 0.999 };
+	unsigned long long seen = 0;
+	int next = 0;
+	for (int i = 0; i < RECEIVE_DELAY_BUCKETS && next < 3; i++)
+	{
+		seen += _buckets[i];
+		while (next < 3 && seen >= fractions[next] * stats->count)
+			*percentiles[next++] = BucketUpperNs(i) / 1000.0;
+	}
+
+	// The top bucket's upper bound can be past the largest delay seen
+	for (int i = 0; i < 3; i++)
+	{
+		if (*percentiles[i] > stats->maxUs)
+			*percentiles[i] = stats->maxUs;
+	}
+}
+
+void ReceiveDelayHistogram::Reset()
+{
+	for (int i = 0; i < RECEIVE_DELAY_BUCKETS; i++)
+		_buckets[i] = 0;
+	_count = 0;
+	_missing = 0;
+	_totalNs = 0;
+	_maxNs = 0;
+}
\ No newline at end of file
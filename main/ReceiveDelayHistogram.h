@@ -0,0 +1,65 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#define RECEIVE_DELAY_SUB_BUCKETS 4 // Per power of two, every bucket is at most 25% wide
+#define RECEIVE_DELAY_BUCKETS (64 * RECEIVE_DELAY_SUB_BUCKETS)
+
+// Percentiles are the upper bound of the bucket they fall in
+typedef struct
+{
+	unsigned long long count;
+	unsigned long long missing; // Deliveries without a software timestamp
+	double averageUs;
+	double p50Us;
+	double p99Us;
+	double p999Us;
+	double maxUs;
+}RECEIVE_DELAY_STATS;
+
+// Delay from the kernel receive timestamp to the start of the receive callback, recorded by sockets with
+// receive timestamps enabled. Lock free, any number of read loop and callback threads can record at once
+class ReceiveDelayHistogram
+{
+public:
+	PRIMESOCKET_API ReceiveDelayHistogram();
+
+	// Same clock as RECEIVE_TIMESTAMP::softwareNs (CLOCK_REALTIME)
+	PRIMESOCKET_API static ULONGLONG NowNs();
+	PRIMESOCKET_API void Record(RECEIVE_TIMESTAMP* timestamp);
+	// nowNs lets a batch share one clock read
+	PRIMESOCKET_API void Record(RECEIVE_TIMESTAMP* timestamp, ULONGLONG nowNs);
+	PRIMESOCKET_API void getStats(RECEIVE_DELAY_STATS* stats);
+	PRIMESOCKET_API void Reset();
+
+private:
+	static int BucketOf(ULONGLONG delayNs);
+	static ULONGLONG BucketUpperNs(int bucket);
+
+	std::atomic<unsigned long long> _buckets[RECEIVE_DELAY_BUCKETS];
+	std::atomic<unsigned long long> _count;
+	std::atomic<unsigned long long> _missing;
+	std::atomic<unsigned long long> _totalNs;
+	std::atomic<unsigned long long> _maxNs;
+};
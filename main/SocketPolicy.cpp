@@ -0,0 +1,482 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#include "PrimeSocket.h"
+
+#define SEND_ALL_MAX_CHUNK (1 << 30) // send takes an int length
+
+static THREADING_CONFIG _threadingConfig = { 0, 0, false, false };
+#ifndef _WIN32
+#define NUMA_BUFFER_HEADER 64 // Keeps the mapping length in front of the buffer, munmap needs it
+#endif
+
+static HANDLE CreatePinnedThread(LPTHREAD_START_ROUTINE routine, LPVOID param, ULONGLONG cpuMask)
+{
+	if (cpuMask == 0)
+		return CreateThread(0, 0, routine, param, 0, 0);
+
+	// Start suspended so the thread never runs a single instruction outside its CPU set
+	HANDLE hThread = CreateThread(0, 0, routine, param, CREATE_SUSPENDED, 0);
+	if (hThread)
+	{
+		SetThreadAffinityMask(hThread, (DWORD_PTR)cpuMask);
+		ResumeThread(hThread);
+	}
+	return hThread;
+}
+
+static int PollReadable(SOCKET sock, long microseconds)
+{
+	// poll rather than select, FD_SET is undefined for descriptors above FD_SETSIZE on Linux
+	pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	int result = SocketPolicy::PollSockets(&pfd, 1, (int)((microseconds + 999) / 1000));
+	if (result == SOCKET_ERROR)
+		return -1;
+	return result > 0 ? 1 : 0;
+}
+
+bool SocketPolicy::setNonBlocking(SOCKET sock, bool enable)
+{
+#ifdef _WIN32
+	u_long mode = enable ? 1 : 0;
+	return ioctlsocket(sock, FIONBIO, &mode) != SOCKET_ERROR;
+#else
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags == -1)
+		return false;
+
+	flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return fcntl(sock, F_SETFL, flags) != -1;
+#endif
+}
+
+bool SocketPolicy::ApplyBusyPoll(SOCKET sock, BUSY_POLL_POLICY* policy)
+{
+	if (!policy || !sock || sock == INVALID_SOCKET)
+		return false;
+
+	if (!setNonBlocking(sock, policy->enabled))
+		return false;
+
+#ifdef SO_BUSY_POLL
+	// Failing here is not fatal, SO_BUSY_POLL needs CAP_NET_ADMIN to raise above the sysctl value
+	int busyPoll = policy->enabled ? (int)policy->spinMicroseconds : 0;
+	setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (char*)&busyPoll, sizeof(int));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+	int preferBusyPoll = policy->enabled ? 1 : 0;
+	setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char*)&preferBusyPoll, sizeof(int));
+#endif
+
+	return true;
+}
+
+int SocketPolicy::WaitReadable(SOCKET sock, BUSY_POLL_POLICY* policy)
+{
+	std::chrono::steady_clock::time_point spinStart = std::chrono::steady_clock::now();
+	std::chrono::microseconds spinBudget(policy->spinMicroseconds);
+
+	while (true)
+	{
+		int result = PollReadable(sock, 0);
+		if (result != 0)
+			return result;
+
+		if (std::chrono::steady_clock::now() - spinStart >= spinBudget)
+			break;
+#ifdef _WIN32
+		YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	// Spin budget exhausted, park the thread until data arrives or the park timeout elapses
+	return PollReadable(sock, policy->parkMicroseconds);
+}
+
+bool SocketPolicy::EnableReceiveTimestamps(SOCKET sock, bool enable, bool hardware)
+{
+#ifdef SO_TIMESTAMPING
+	int flags = 0;
+	if (enable)
+	{
+		flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+		if (hardware)
+			flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, (char*)&flags, sizeof(int)) != SOCKET_ERROR)
+		return true;
+	if (hardware)
+		return false;
+
+	// Older kernels, software timestamps only
+	int value = enable ? 1 : 0;
+	return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, (char*)&value, sizeof(int)) != SOCKET_ERROR;
+#else
+	return false;
+#endif
+}
+
+bool SocketPolicy::ReceiveTimestampsEnabled(SOCKET sock)
+{
+#ifdef SO_TIMESTAMPING
+	int flags = 0;
+	socklen_t len = sizeof(int);
+	if (getsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, (char*)&flags, &len) != SOCKET_ERROR && (flags & (SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE)))
+		return true;
+
+	int value = 0;
+	len = sizeof(int);
+	return getsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, (char*)&value, &len) != SOCKET_ERROR && value;
+#else
+	return false;
+#endif
+}
+
+int SocketPolicy::ReceiveWithTimestamp(SOCKET sock, char* buf, int len, sockaddr* from, int* fromLen, RECEIVE_TIMESTAMP* timestamp)
+{
+	ZeroMemory(timestamp, sizeof(RECEIVE_TIMESTAMP));
+#ifdef SO_TIMESTAMPING
+	iovec vector;
+	vector.iov_base = buf;
+	vector.iov_len = len;
+
+	char control[RECEIVE_TIMESTAMP_CONTROL_SIZE];
+	msghdr message;
+	ZeroMemory(&message, sizeof(msghdr));
+	message.msg_name = from;
+	message.msg_namelen = from ? *fromLen : 0;
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	int result = recvmsg(sock, &message, 0);
+	if (result >= 0)
+	{
+		if (from)
+			*fromLen = message.msg_namelen;
+		ReadReceiveTimestamp(&message, timestamp);
+	}
+	return result;
+#else
+	return from ? recvfrom(sock, buf, len, 0, from, fromLen) : recv(sock, buf, len, 0);
+#endif
+}
+
+#ifdef SO_TIMESTAMPING
+void SocketPolicy::ReadReceiveTimestamp(msghdr* message, RECEIVE_TIMESTAMP* timestamp)
+{
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg; cmsg = CMSG_NXTHDR(message, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SCM_TIMESTAMPING)
+		{
+			// Software stamp first, the raw hardware one third, the middle one is deprecated
+			timespec stamps[3];
+			memcpy(stamps, CMSG_DATA(cmsg), sizeof(stamps));
+			timestamp->softwareNs = stamps[0].tv_sec * 1000000000ULL + stamps[0].tv_nsec;
+			timestamp->hardwareNs = stamps[2].tv_sec * 1000000000ULL + stamps[2].tv_nsec;
+		}
+		else if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			timespec stamp;
+			memcpy(&stamp, CMSG_DATA(cmsg), sizeof(timespec));
+			timestamp->softwareNs = stamp.tv_sec * 1000000000ULL + stamp.tv_nsec;
+		}
+	}
+}
+#endif
+
+bool SocketPolicy::LastErrorWouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EWOULDBLOCK || errno == EAGAIN;
+#endif
+}
+
+int SocketPolicy::PollSockets(pollfd* fds, ULONG count, int timeoutMs)
+{
+#ifdef _WIN32
+	return WSAPoll(fds, count, timeoutMs);
+#else
+	return poll(fds, count, timeoutMs);
+#endif
+}
+
+bool SocketPolicy::SendAll(SOCKET sock, const char* data, size_t len)
+{
+	size_t sent = 0;
+	while (sent < len)
+	{
+		int chunk = len - sent > SEND_ALL_MAX_CHUNK ? SEND_ALL_MAX_CHUNK : (int)(len - sent);
+		int result = send(sock, data + sent, chunk, 0);
+		if (result == SOCKET_ERROR)
+		{
+#ifndef _WIN32
+			if (errno == EINTR)
+				continue;
+#endif
+			if (!LastErrorWouldBlock())
+				return false;
+
+			// Non-blocking socket with a full send buffer, a failed connection wakes the poll as well and send reports it
+			pollfd pfd;
+			pfd.fd = sock;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			PollSockets(&pfd, 1, -1);
+			continue;
+		}
+
+		sent += result;
+	}
+
+	return true;
+}
+
+SOCKET SocketPolicy::CreateWakeSocket(sockaddr_in* address)
+{
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	// Bound to an ephemeral loopback port, the address is read back through getsockname
+	ZeroMemory(address, sizeof(sockaddr_in));
+	address->sin_family = AF_INET;
+	address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addressLen = sizeof(sockaddr_in);
+	if (bind(sock, (sockaddr*)address, sizeof(sockaddr_in)) == SOCKET_ERROR ||
+		getsockname(sock, (sockaddr*)address, &addressLen) == SOCKET_ERROR ||
+		!setNonBlocking(sock, true))
+	{
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+
+	return sock;
+}
+
+void SocketPolicy::SignalWakeSocket(SOCKET sock, sockaddr_in* address)
+{
+	if (sock != INVALID_SOCKET)
+		sendto(sock, "", 1, 0, (sockaddr*)address, sizeof(sockaddr_in));
+}
+
+void SocketPolicy::DrainWakeSocket(SOCKET sock)
+{
+	char drain[16];
+	while (recv(sock, drain, sizeof(drain), 0) > 0);
+}
+
+bool SocketPolicy::getTuningProfile(TUNING_PROFILE profile, SOCKET_TUNING* tuning)
+{
+	if (!tuning)
+		return false;
+
+	ZeroMemory(tuning, sizeof(SOCKET_TUNING));
+	tuning->profile = profile;
+	switch (profile)
+	{
+	case ProfileLowLatency:
+		// Small segments go out immediately, dead peers are detected within seconds
+		tuning->noDelay = TRUE;
+		tuning->quickAck = TRUE;
+		tuning->fastOpen = 256;
+		tuning->userTimeoutMs = 5000;
+		tuning->keepAliveIdleSeconds = 10;
+		tuning->keepAliveIntervalSeconds = 2;
+		tuning->keepAliveCount = 3;
+		tuning->priority = 6;
+		return true;
+	case ProfileBulkThroughput:
+		// Large fixed buffers keep a long fat pipe full, Nagle coalesces the small writes
+		tuning->sendBufferSize = 4 * 1024 * 1024;
+		tuning->recvBufferSize = 4 * 1024 * 1024;
+		tuning->userTimeoutMs = 30000;
+		tuning->keepAliveIdleSeconds = 60;
+		tuning->keepAliveIntervalSeconds = 10;
+		tuning->keepAliveCount = 5;
+		return true;
+	case ProfileManyIdle:
+		// Small buffers keep the kernel memory per connection low, accept waits for the first request
+		tuning->noDelay = TRUE;
+		tuning->deferAcceptSeconds = 5;
+		tuning->sendBufferSize = 16 * 1024;
+		tuning->recvBufferSize = 16 * 1024;
+		tuning->userTimeoutMs = 60000;
+		tuning->keepAliveIdleSeconds = 300;
+		tuning->keepAliveIntervalSeconds = 30;
+		tuning->keepAliveCount = 4;
+		return true;
+	case ProfileNone:
+	default:
+		break;
+	}
+
+	return false;
+}
+
+const char* SocketPolicy::getTuningProfileName(TUNING_PROFILE profile)
+{
+	switch (profile)
+	{
+	case ProfileLowLatency:
+		return "low-latency";
+	case ProfileBulkThroughput:
+		return "bulk-throughput";
+	case ProfileManyIdle:
+		return "many-idle";
+	case ProfileNone:
+	default:
+		break;
+	}
+
+	return "none";
+}
+
+void SocketPolicy::setThreadingConfig(THREADING_CONFIG* config)
+{
+	if (config)
+		_threadingConfig = *config;
+}
+
+THREADING_CONFIG SocketPolicy::getThreadingConfig()
+{
+	return _threadingConfig;
+}
+
+HANDLE SocketPolicy::CreateIoThread(LPTHREAD_START_ROUTINE routine, LPVOID param)
+{
+	return CreatePinnedThread(routine, param, _threadingConfig.ioCpuMask);
+}
+
+HANDLE SocketPolicy::CreateWorkerThread(LPTHREAD_START_ROUTINE routine, LPVOID param)
+{
+	return CreatePinnedThread(routine, param, _threadingConfig.workerCpuMask);
+}
+
+bool SocketPolicy::PinCurrentThread(ULONGLONG cpuMask)
+{
+	if (cpuMask == 0)
+		return false;
+#ifdef _WIN32
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)cpuMask) != 0;
+#else
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	for (int cpu = 0; cpu < 64; cpu++)
+	{
+		if (cpuMask & (1ULL << cpu))
+			CPU_SET(cpu, &cpuSet);
+	}
+	return sched_setaffinity(0, sizeof(cpu_set_t), &cpuSet) == 0;
+#endif
+}
+
+bool SocketPolicy::SteerToIncomingCpu(SOCKET sock)
+{
+	if (!_threadingConfig.steerIncomingCpu)
+		return false;
+#ifdef SO_INCOMING_CPU
+	int cpu = -1;
+	socklen_t len = sizeof(int);
+	if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, (char*)&cpu, &len) == SOCKET_ERROR || cpu < 0 || cpu >= 64)
+		return false;
+
+	// Stay inside the configured I/O CPU set, the steering is a hint and not an override
+	ULONGLONG cpuMask = 1ULL << cpu;
+	if (_threadingConfig.ioCpuMask != 0 && (_threadingConfig.ioCpuMask & cpuMask) == 0)
+		return false;
+
+	return PinCurrentThread(cpuMask);
+#else
+	return false;
+#endif
+}
+
+char* SocketPolicy::AllocReadBuffer(size_t size, int* allocType)
+{
+	// Pages of their own bound to the node of the read loop. Buffers are freed on callback threads, memory from a
+	// shared allocator would be reused on whatever node the next caller runs
+	if (_threadingConfig.numaLocalBuffers)
+	{
+#ifdef _WIN32
+		UCHAR node = 0;
+		if (GetNumaProcessorNode((UCHAR)GetCurrentProcessorNumber(), &node) && node < MAX_NUMA_NODES)
+		{
+			char* buffer = (char*)VirtualAllocExNuma(GetCurrentProcess(), 0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+			if (buffer)
+			{
+				*allocType = ALLOCATION_NUMA_NODE_BASE + node;
+				return buffer;
+			}
+		}
+#elif defined(SYS_mbind) && defined(SYS_getcpu)
+		unsigned int cpu = 0, node = 0;
+		if (syscall(SYS_getcpu, &cpu, &node, 0) == 0 && node < MAX_NUMA_NODES)
+		{
+			size_t length = size + NUMA_BUFFER_HEADER;
+			char* mapping = (char*)mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mapping != MAP_FAILED)
+			{
+				// Preferred rather than bound, a full node falls back to another one instead of failing the read.
+				// The pages are zero and get placed on the node when first touched, by whichever thread
+				unsigned long nodeMask = 1UL << node;
+				syscall(SYS_mbind, mapping, length, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask) * 8 + 1, 0);
+				*(size_t*)mapping = length;
+				*allocType = ALLOCATION_NUMA_NODE_BASE + node;
+				return mapping + NUMA_BUFFER_HEADER;
+			}
+		}
+#endif
+	}
+
+	*allocType = ALLOCATION_MALLOC;
+	return (char*)calloc(1, size);
+}
+
+void SocketPolicy::FreeReadBuffer(char* buffer, int allocType)
+{
+	if (allocType >= ALLOCATION_NUMA_NODE_BASE && allocType < ALLOCATION_NUMA_NODE_BASE + MAX_NUMA_NODES)
+	{
+#ifdef _WIN32
+		VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+		char* mapping = buffer - NUMA_BUFFER_HEADER;
+		munmap(mapping, *(size_t*)mapping);
+#endif
+		return;
+	}
+	free(buffer);
+}
\ No newline at end of file
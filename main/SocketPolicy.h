@@ -0,0 +1,134 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#define BUSY_POLL_DEFAULT_SPIN_US 50
+#define BUSY_POLL_DEFAULT_PARK_US 1000
+
+// Low-latency mode: the read loop spins on a non-blocking socket for spinMicroseconds before parking
+// in select() for parkMicroseconds, callbacks are invoked on the read loop thread instead of a new thread
+typedef struct
+{
+	bool enabled;
+	DWORD spinMicroseconds;
+	DWORD parkMicroseconds;
+}BUSY_POLL_POLICY;
+
+// Thread placement, applies to every thread created by the library after setThreadingConfig is called
+typedef struct
+{
+	ULONGLONG ioCpuMask; // CPUs the accept and read loops may run on, 0 leaves them unpinned
+	ULONGLONG workerCpuMask; // CPUs the callback threads may run on, 0 leaves them unpinned
+	bool numaLocalBuffers; // Read buffers are placed on the NUMA node of the read loop thread, one page mapping per buffer so it suits large buffers
+	bool steerIncomingCpu; // Pin each connection read loop to the CPU that processed its packets (SO_INCOMING_CPU, Linux only)
+}THREADING_CONFIG;
+
+enum TUNING_PROFILE : int
+{
+	ProfileNone = 0,
+	ProfileLowLatency = 1,
+	ProfileBulkThroughput = 2,
+	ProfileManyIdle = 3
+};
+
+#define TUNING_ROLE_LISTENER 1
+#define TUNING_ROLE_CLIENT 2
+#define TUNING_ROLE_ACCEPTED 3
+
+// Socket options set by a tuning profile, a value of 0 leaves the kernel default in place
+typedef struct
+{
+	TUNING_PROFILE profile;
+	DWORD noDelay;
+	DWORD quickAck;
+	DWORD deferAcceptSeconds; // Listener only
+	DWORD fastOpen; // Pending TFO queue length on listeners, 1 to send data in the SYN on clients
+	DWORD sendBufferSize;
+	DWORD recvBufferSize;
+	DWORD userTimeoutMs;
+	DWORD keepAliveIdleSeconds; // Keep-alive is only enabled when this is set
+	DWORD keepAliveIntervalSeconds;
+	DWORD keepAliveCount;
+	DWORD priority;
+}SOCKET_TUNING;
+
+// Kernel receive time of a datagram or TCP read, a field is 0 when that timestamp is not available
+typedef struct
+{
+	ULONGLONG softwareNs; // CLOCK_REALTIME nanoseconds since the epoch
+	ULONGLONG hardwareNs; // NIC clock, only when the device stamps received packets (enabled with SIOCSHWTSTAMP)
+}RECEIVE_TIMESTAMP;
+
+#define RECEIVE_TIMESTAMP_CONTROL_SIZE 128 // Control message room for SCM_TIMESTAMPING
+
+#define ALLOCATION_NUMA_NODE_BASE 0x100
+#define MAX_NUMA_NODES 64
+
+class SocketPolicy
+{
+public:
+	PRIMESOCKET_API static bool setNonBlocking(SOCKET sock, bool enable);
+	// Switches the socket to non-blocking mode and asks the kernel to busy poll the device queue (SO_BUSY_POLL, Linux only)
+	PRIMESOCKET_API static bool ApplyBusyPoll(SOCKET sock, BUSY_POLL_POLICY* policy);
+	// Spin then park until the socket is readable. Returns 1 if readable, 0 if the park timed out and -1 on socket error
+	PRIMESOCKET_API static int WaitReadable(SOCKET sock, BUSY_POLL_POLICY* policy);
+	PRIMESOCKET_API static bool LastErrorWouldBlock();
+	// poll on Linux, WSAPoll on Windows, no FD_SETSIZE limit unlike select
+	PRIMESOCKET_API static int PollSockets(pollfd* fds, ULONG count, int timeoutMs);
+	// send until all of data is written, waits for the socket to become writable when it is non-blocking and full
+	PRIMESOCKET_API static bool SendAll(SOCKET sock, const char* data, size_t len);
+	// Non-blocking loopback datagram socket a poll loop includes so other threads can wake it up, returns INVALID_SOCKET on failure
+	PRIMESOCKET_API static SOCKET CreateWakeSocket(sockaddr_in* address);
+	PRIMESOCKET_API static void SignalWakeSocket(SOCKET sock, sockaddr_in* address);
+	PRIMESOCKET_API static void DrainWakeSocket(SOCKET sock);
+
+	// SO_TIMESTAMPING software receive timestamps, plus the raw hardware ones when asked, falls back to SO_TIMESTAMPNS.
+	// Linux only, Winsock recv has no receive timestamps
+	PRIMESOCKET_API static bool EnableReceiveTimestamps(SOCKET sock, bool enable, bool hardware);
+	PRIMESOCKET_API static bool ReceiveTimestampsEnabled(SOCKET sock);
+	// recvfrom that also returns the receive timestamp, from may be 0 for a stream socket
+	PRIMESOCKET_API static int ReceiveWithTimestamp(SOCKET sock, char* buf, int len, sockaddr* from, int* fromLen, RECEIVE_TIMESTAMP* timestamp);
+#ifdef SO_TIMESTAMPING
+	// Timestamp control messages of a received message, the timestamp is left zeroed without them
+	PRIMESOCKET_API static void ReadReceiveTimestamp(msghdr* message, RECEIVE_TIMESTAMP* timestamp);
+#endif
+
+	// Predefined option values of a profile, returns false for ProfileNone or an unknown profile
+	PRIMESOCKET_API static bool getTuningProfile(TUNING_PROFILE profile, SOCKET_TUNING* tuning);
+	PRIMESOCKET_API static const char* getTuningProfileName(TUNING_PROFILE profile);
+
+	PRIMESOCKET_API static void setThreadingConfig(THREADING_CONFIG* config);
+	PRIMESOCKET_API static THREADING_CONFIG getThreadingConfig();
+	// Thread creation used by the socket classes, the new thread is pinned to the configured CPU set
+	PRIMESOCKET_API static HANDLE CreateIoThread(LPTHREAD_START_ROUTINE routine, LPVOID param);
+	PRIMESOCKET_API static HANDLE CreateWorkerThread(LPTHREAD_START_ROUTINE routine, LPVOID param);
+	PRIMESOCKET_API static bool PinCurrentThread(ULONGLONG cpuMask);
+	// Re-pin the calling read loop to the CPU that received the packets of this connection. The kernel only knows that
+	// CPU once packets arrived, call it after the first receive
+	PRIMESOCKET_API static bool SteerToIncomingCpu(SOCKET sock);
+
+	// Read buffers handed to data callbacks, allocType tells FreeReadBuffer where the buffer came from
+	PRIMESOCKET_API static char* AllocReadBuffer(size_t size, int* allocType);
+	PRIMESOCKET_API static void FreeReadBuffer(char* buffer, int allocType);
+};
\ No newline at end of file
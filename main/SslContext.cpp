@@ -0,0 +1,324 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#define PRIMESOCKET_USE_SSL
+#include "PrimeSocket.h"
+
+static std::once_flag _openSslInitOnce;
+static bool _openSslInitialized = false;
+
+bool SslContext::InitializeOpenSSL()
+{
+	std::call_once(_openSslInitOnce, []()
+	{
+		_openSslInitialized = SSL_library_init() == 1;
+		OpenSSL_add_all_algorithms();
+		SSL_load_error_strings();
+	});
+
+	return _openSslInitialized;
+}
+
+// Every OpenSSL allocation is prefixed with its size so frees can be accounted for
+#define MEMORY_ACCOUNTING_HEADER 16
+static std::atomic<long long> _openSslAllocatedBytes(0);
+static bool _memoryAccounting = false;
+
+static void* CountingMalloc(size_t size, const char* file, int line)
+{
+	char* block = (char*)malloc(size + MEMORY_ACCOUNTING_HEADER);
+	if (!block)
+		return 0;
+
+	*(size_t*)block = size;
+	_openSslAllocatedBytes += size;
+	return block + MEMORY_ACCOUNTING_HEADER;
+}
+
+static void CountingFree(void* ptr, const char* file, int line)
+{
+	if (!ptr)
+		return;
+
+	char* block = (char*)ptr - MEMORY_ACCOUNTING_HEADER;
+	_openSslAllocatedBytes -= *(size_t*)block;
+	free(block);
+}
+
+static void* CountingRealloc(void* ptr, size_t size, const char* file, int line)
+{
+	if (!ptr)
+		return CountingMalloc(size, file, line);
+	if (size == 0)
+	{
+		CountingFree(ptr, file, line);
+		return 0;
+	}
+
+	char* block = (char*)ptr - MEMORY_ACCOUNTING_HEADER;
+	size_t oldSize = *(size_t*)block;
+	char* grown = (char*)realloc(block, size + MEMORY_ACCOUNTING_HEADER);
+	if (!grown)
+		return 0;
+
+	*(size_t*)grown = size;
+	_openSslAllocatedBytes += (long long)size - (long long)oldSize;
+	return grown + MEMORY_ACCOUNTING_HEADER;
+}
+
+bool SslContext::EnableMemoryAccounting()
+{
+	// OpenSSL refuses new allocator functions once it allocated anything
+	if (!_memoryAccounting)
+		_memoryAccounting = CRYPTO_set_mem_functions(CountingMalloc, CountingRealloc, CountingFree) == 1;
+	return _memoryAccounting;
+}
+
+long long SslContext::getAllocatedBytes()
+{
+	return _memoryAccounting ? _openSslAllocatedBytes.load() : -1;
+}
+
+SslContext* SslContext::CreateServer()
+{
+	if (!InitializeOpenSSL())
+		return 0;
+
+	SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL)
+	{
+		ERR_print_errors_fp(stderr);
+		return 0;
+	}
+
+	return new SslContext(ctx, true);
+}
+
+SslContext* SslContext::CreateClient()
+{
+	if (!InitializeOpenSSL())
+		return 0;
+
+	SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL)
+	{
+		ERR_print_errors_fp(stderr);
+		return 0;
+	}
+
+	SslClientSessionStore::Global()->Attach(ctx);
+	return new SslContext(ctx, false);
+}
+
+SslContext::SslContext(SSL_CTX* ctx, bool isServer)
+{
+	_ctx = ctx;
+	_isServer = isServer;
+	_hasCertificate = false;
+	_sessionCache = 0;
+	_refCount = 1;
+	_verifyPolicy = "none";
+	UpdateSessionPolicy();
+}
+
+SslContext::~SslContext()
+{
+	// Accepted connections may still hold the context, it deletes the session cache once they are gone as well
+	SSL_CTX_free(_ctx);
+}
+
+int SslContext::setCertificate(char* CertFile, char* KeyFile)
+{
+	if (!CertFile || !KeyFile)
+		return SSLSOCKET_INVALID_CALL;
+
+	if (SSL_CTX_use_certificate_file(_ctx, CertFile, SSL_FILETYPE_PEM) <= 0)
+	{
+		ERR_print_errors_fp(stderr);
+		return SSLSOCKET_INVALID_CERT;
+	}
+
+	if (SSL_CTX_use_PrivateKey_file(_ctx, KeyFile, SSL_FILETYPE_PEM) <= 0)
+	{
+		ERR_print_errors_fp(stderr);
+		return SSLSOCKET_INVALID_CERT;
+	}
+	/* verify private key */
+	if (!SSL_CTX_check_private_key(_ctx))
+	{
+		fprintf(stderr, "Private key does not match the public certificate\n");
+		return SSLSOCKET_CERT_PRV_PUB_MISMATCH;
+	}
+
+	_hasCertificate = true;
+	UpdateSessionPolicy();
+	return SSLSOCKET_SUCCESS;
+}
+
+int SslContext::setCertificate(X509* cert, EVP_PKEY* key)
+{
+	if (!cert || !key)
+		return SSLSOCKET_INVALID_CALL;
+
+	if (SSL_CTX_use_certificate(_ctx, cert) <= 0 || SSL_CTX_use_PrivateKey(_ctx, key) <= 0)
+	{
+		ERR_print_errors_fp(stderr);
+		return SSLSOCKET_INVALID_CERT;
+	}
+	if (!SSL_CTX_check_private_key(_ctx))
+		return SSLSOCKET_CERT_PRV_PUB_MISMATCH;
+
+	_hasCertificate = true;
+	UpdateSessionPolicy();
+	return SSLSOCKET_SUCCESS;
+}
+
+bool SslContext::setCipherPolicy(const char* cipherList, const char* cipherSuites, int minProtocolVersion)
+{
+	if (cipherList && SSL_CTX_set_cipher_list(_ctx, cipherList) != 1)
+		return false;
+	if (cipherSuites && SSL_CTX_set_ciphersuites(_ctx, cipherSuites) != 1)
+		return false;
+	if (SSL_CTX_set_min_proto_version(_ctx, minProtocolVersion) != 1)
+		return false;
+
+	_cipherPolicy = std::string(cipherList ? cipherList : "") + "/" + (cipherSuites ? cipherSuites : "") + "/" + std::to_string(minProtocolVersion);
+	UpdateSessionPolicy();
+	return true;
+}
+
+bool SslContext::setVerification(bool verifyPeer, const char* caFile)
+{
+	if (verifyPeer)
+	{
+		int loaded = caFile ? SSL_CTX_load_verify_locations(_ctx, caFile, 0) : SSL_CTX_set_default_verify_paths(_ctx);
+		if (loaded != 1)
+		{
+			ERR_print_errors_fp(stderr);
+			return false;
+		}
+	}
+
+	int mode = verifyPeer ? SSL_VERIFY_PEER : SSL_VERIFY_NONE;
+	if (verifyPeer && _isServer)
+		mode |= SSL_VERIFY_FAIL_IF_NO_PEER_CERT;
+	SSL_CTX_set_verify(_ctx, mode, 0);
+
+	// Trust anchors load on top of each other, so every file loaded is part of the policy
+	if (!verifyPeer)
+		_verifyPolicy = "none";
+	else
+	{
+		if (_verifyPolicy == "none")
+			_verifyPolicy = "peer";
+		_verifyPolicy += std::string("+") + (caFile ? caFile : "default");
+	}
+	UpdateSessionPolicy();
+	return true;
+}
+
+void SslContext::UpdateSessionPolicy()
+{
+	// The client certificate by its digest, a session resumed under it authenticates as that certificate
+	if (_hasCertificate && SSL_CTX_get0_certificate(_ctx))
+	{
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digestLen = 0;
+		char hex[EVP_MAX_MD_SIZE * 2 + 1];
+		hex[0] = 0;
+		if (X509_digest(SSL_CTX_get0_certificate(_ctx), EVP_sha256(), digest, &digestLen) == 1)
+		{
+			for (unsigned int i = 0; i < digestLen; i++)
+				sprintf(hex + i * 2, "%02x", digest[i]);
+		}
+		_certificatePolicy = hex;
+	}
+
+	_sessionPolicy = "verify=" + _verifyPolicy + ";ciphers=" + _cipherPolicy + ";cert=" + _certificatePolicy;
+}
+
+bool SslContext::setKernelTls(bool enable)
+{
+	if (enable)
+		SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+	else
+		SSL_CTX_clear_options(_ctx, SSL_OP_ENABLE_KTLS);
+	return true;
+}
+
+int SslContext::enableSessionResumption(size_t cacheSize, DWORD ticketKeyLifetime)
+{
+	if (!_isServer || _sessionCache)
+		return SSLSOCKET_INVALID_CALL;
+
+	_sessionCache = new SslSessionCache(cacheSize, ticketKeyLifetime);
+	if (!_sessionCache->Attach(_ctx))
+	{
+		delete _sessionCache;
+		_sessionCache = 0;
+		return SSLSOCKET_SSL_INIT_ERROR;
+	}
+
+	return SSLSOCKET_SUCCESS;
+}
+
+bool SslContext::getSessionCacheStats(SSL_SESSION_CACHE_STATS* stats)
+{
+	if (!_sessionCache || !stats)
+		return false;
+
+	_sessionCache->getStats(stats);
+	return true;
+}
+
+const char* SslContext::getSessionPolicy()
+{
+	return _sessionPolicy.c_str();
+}
+
+bool SslContext::isServer()
+{
+	return _isServer;
+}
+
+bool SslContext::hasCertificate()
+{
+	return _hasCertificate;
+}
+
+SSL_CTX* SslContext::getNativeContext()
+{
+	return _ctx;
+}
+
+void SslContext::AddRef()
+{
+	_refCount++;
+}
+
+void SslContext::Release()
+{
+	if (--_refCount == 0)
+		delete this;
+}
\ No newline at end of file
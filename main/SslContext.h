@@ -0,0 +1,79 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#ifdef PRIMESOCKET_USE_SSL
+#include <openssl/ssl.h>
+
+// TLS configuration built once (certificate, key, cipher policy, verification, resumption) and shared by
+// reference between any number of listening and client SslSocket instances
+class SslContext
+{
+public:
+	// One-time process wide OpenSSL initialization, safe to call from any thread any number of times
+	PRIMESOCKET_API static bool InitializeOpenSSL();
+	// Count the heap memory OpenSSL holds, must be called before anything else uses OpenSSL (returns false otherwise)
+	PRIMESOCKET_API static bool EnableMemoryAccounting();
+	PRIMESOCKET_API static long long getAllocatedBytes();
+
+	// The returned context holds one reference, call Release when done with it
+	PRIMESOCKET_API static SslContext* CreateServer();
+	PRIMESOCKET_API static SslContext* CreateClient();
+
+	// Returns one of the SSLSOCKET_ result codes
+	PRIMESOCKET_API int setCertificate(char* CertFile, char* KeyFile);
+	PRIMESOCKET_API int setCertificate(X509* cert, EVP_PKEY* key);
+	// cipherList applies to TLS 1.2 and below, cipherSuites to TLS 1.3, either can be 0 to keep the OpenSSL default
+	PRIMESOCKET_API bool setCipherPolicy(const char* cipherList, const char* cipherSuites, int minProtocolVersion = TLS1_2_VERSION);
+	// Verify the peer certificate against caFile (or the default trust store when 0), client connections also check it
+	// was issued for the host name or address they connect to
+	PRIMESOCKET_API bool setVerification(bool verifyPeer, const char* caFile = 0);
+	PRIMESOCKET_API bool setKernelTls(bool enable);
+	// Server contexts only, see SslSessionCache
+	PRIMESOCKET_API int enableSessionResumption(size_t cacheSize = SSL_SESSION_CACHE_DEFAULT_SIZE, DWORD ticketKeyLifetime = SSL_TICKET_KEY_DEFAULT_LIFETIME);
+	PRIMESOCKET_API bool getSessionCacheStats(SSL_SESSION_CACHE_STATS* stats);
+
+	PRIMESOCKET_API bool isServer();
+	PRIMESOCKET_API bool hasCertificate();
+	PRIMESOCKET_API SSL_CTX* getNativeContext();
+	// Verification, cipher policy and client certificate as set through this class, client sessions are only resumed
+	// by contexts with the same policy. Changes made on the native context directly are not reflected
+	PRIMESOCKET_API const char* getSessionPolicy();
+
+	PRIMESOCKET_API void AddRef();
+	PRIMESOCKET_API void Release();
+
+private:
+	SslContext(SSL_CTX* ctx, bool isServer);
+	~SslContext();
+	void UpdateSessionPolicy();
+
+	SSL_CTX* _ctx;
+	bool _isServer, _hasCertificate;
+	SslSessionCache* _sessionCache; // Owned by _ctx
+	std::string _verifyPolicy, _cipherPolicy, _certificatePolicy;
+	std::string _sessionPolicy; // Rebuilt by the setters, contexts are configured before they are shared
+	std::atomic<long> _refCount;
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,183 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#define PRIMESOCKET_USE_SSL
+#include "PrimeSocket.h"
+
+SslEngine::SslEngine(SslContext* context)
+{
+	_context = context;
+	_ssl = 0;
+	_inBio = 0;
+	_outBio = 0;
+	_handshakeDone = false;
+	_failed = true;
+	if (!context)
+		return;
+
+	context->AddRef();
+	_ssl = SSL_new(context->getNativeContext());
+	_inBio = BIO_new(BIO_s_mem());
+	_outBio = BIO_new(BIO_s_mem());
+	if (!_ssl || !_inBio || !_outBio)
+	{
+		BIO_free(_inBio);
+		BIO_free(_outBio);
+		_inBio = 0;
+		_outBio = 0;
+		return;
+	}
+
+	// An empty input BIO means "wait for more data", not end of stream
+	BIO_set_mem_eof_return(_inBio, -1);
+	SSL_set_bio(_ssl, _inBio, _outBio);
+	if (context->isServer())
+		SSL_set_accept_state(_ssl);
+	else
+		SSL_set_connect_state(_ssl);
+	_failed = false;
+}
+
+SslEngine::~SslEngine()
+{
+	// SSL_free frees the BIOs attached to it
+	if (_ssl)
+		SSL_free(_ssl);
+	if (_context)
+		_context->Release();
+}
+
+bool SslEngine::setServerName(const char* serverName)
+{
+	if (_failed || _context->isServer() || _handshakeDone || !serverName)
+		return false;
+
+	SSL_set_tlsext_host_name(_ssl, serverName);
+	return SSL_set1_host(_ssl, serverName) == 1;
+}
+
+bool SslEngine::FeedCiphertext(const void* data, size_t dataSize)
+{
+	if (_failed || !data)
+		return false;
+
+	return dataSize == 0 || BIO_write(_inBio, data, (int)dataSize) == (int)dataSize;
+}
+
+size_t SslEngine::getPendingCiphertext()
+{
+	if (!_outBio)
+		return 0;
+
+	return BIO_ctrl_pending(_outBio);
+}
+
+size_t SslEngine::ReadCiphertext(void* buffer, size_t bufferSize)
+{
+	if (!_outBio || !buffer || bufferSize == 0 || BIO_ctrl_pending(_outBio) == 0)
+		return 0;
+
+	int len = BIO_read(_outBio, buffer, (int)bufferSize);
+	return len > 0 ? len : 0;
+}
+
+int SslEngine::Handshake()
+{
+	if (_failed)
+		return SSLENGINE_ERROR;
+	if (_handshakeDone)
+		return SSLENGINE_DONE;
+
+	int ret = SSL_do_handshake(_ssl);
+	if (ret == 1)
+	{
+		_handshakeDone = true;
+		return SSLENGINE_DONE;
+	}
+
+	int error = SSL_get_error(_ssl, ret);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+		return SSLENGINE_WANT_IO;
+
+	// The alert for the peer stays in the pending ciphertext
+	_failed = true;
+	return SSLENGINE_ERROR;
+}
+
+bool SslEngine::isHandshakeDone()
+{
+	return _handshakeDone;
+}
+
+bool SslEngine::Encrypt(const void* data, size_t dataSize)
+{
+	if (_failed || !_handshakeDone || !data)
+		return false;
+
+	// The memory BIO grows as needed, so a write never stops halfway
+	size_t written = 0;
+	while (written < dataSize)
+	{
+		int ret = SSL_write(_ssl, (const char*)data + written, (int)(dataSize - written));
+		if (ret <= 0)
+		{
+			_failed = true;
+			return false;
+		}
+		written += ret;
+	}
+
+	return true;
+}
+
+int SslEngine::Decrypt(void* buffer, size_t bufferSize)
+{
+	if (_failed || !_handshakeDone || !buffer || bufferSize == 0)
+		return -1;
+
+	int ret = SSL_read(_ssl, buffer, (int)bufferSize);
+	if (ret > 0)
+		return ret;
+
+	int error = SSL_get_error(_ssl, ret);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+		return 0;
+
+	if (error != SSL_ERROR_ZERO_RETURN)
+		_failed = true;
+	return -1;
+}
+
+bool SslEngine::Shutdown()
+{
+	if (!_ssl || !_handshakeDone)
+		return false;
+
+	return SSL_shutdown(_ssl) >= 0;
+}
+
+SSL* SslEngine::getNativeHandle()
+{
+	return _ssl;
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#ifdef PRIMESOCKET_USE_SSL
+#include <openssl/ssl.h>
+
+#define SSLENGINE_DONE 1
+#define SSLENGINE_WANT_IO 0 // Feed more ciphertext (and send what ReadCiphertext returns) then call again
+#define SSLENGINE_ERROR -1
+
+// TLS connection state over a pair of memory BIOs, not tied to any socket or thread. The caller moves ciphertext
+// between the engine and its transport: FeedCiphertext with what arrived, ReadCiphertext for what has to be sent.
+// Any call can produce ciphertext (handshake flights, session tickets, alerts), drain it after each one
+class SslEngine
+{
+public:
+	// Server or client side follows the context, the engine holds a reference to it
+	PRIMESOCKET_API SslEngine(SslContext* context);
+	PRIMESOCKET_API ~SslEngine();
+
+	// Client only, SNI and the name the certificate is verified against when the context verifies peers
+	PRIMESOCKET_API bool setServerName(const char* serverName);
+
+	PRIMESOCKET_API bool FeedCiphertext(const void* data, size_t dataSize);
+	PRIMESOCKET_API size_t getPendingCiphertext();
+	// Returns the number of bytes copied into buffer
+	PRIMESOCKET_API size_t ReadCiphertext(void* buffer, size_t bufferSize);
+
+	// Returns one of the SSLENGINE_ codes
+	PRIMESOCKET_API int Handshake();
+	PRIMESOCKET_API bool isHandshakeDone();
+
+	// Appends the encrypted records to the pending ciphertext, several calls batch into one ReadCiphertext
+	PRIMESOCKET_API bool Encrypt(const void* data, size_t dataSize);
+	// Returns the number of plaintext bytes, 0 when more ciphertext is needed and -1 when the peer closed or on error
+	PRIMESOCKET_API int Decrypt(void* buffer, size_t bufferSize);
+	// Queues a close_notify alert
+	PRIMESOCKET_API bool Shutdown();
+
+	PRIMESOCKET_API SSL* getNativeHandle();
+
+private:
+	SslContext* _context;
+	SSL* _ssl;
+	BIO* _inBio; // Ciphertext from the peer, read by OpenSSL
+	BIO* _outBio; // Ciphertext for the peer, written by OpenSSL
+	bool _handshakeDone, _failed;
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,354 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#define PRIMESOCKET_USE_SSL
+#include "PrimeSocket.h"
+
+SslHandshakePool::SslHandshakePool(SSLHANDSHAKE_DONE_CALLBACK doneCallback, void* context, int workerCount, DWORD deadlineMs, int cryptoWorkers)
+{
+	if (workerCount <= 0)
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		workerCount = (int)info.dwNumberOfProcessors;
+#else
+		workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (workerCount < 1)
+		workerCount = 1;
+	if (workerCount > SSL_HANDSHAKE_MAX_WORKERS)
+		workerCount = SSL_HANDSHAKE_MAX_WORKERS;
+	if (cryptoWorkers < 0)
+		cryptoWorkers = 0;
+	if (cryptoWorkers > SSL_HANDSHAKE_MAX_WORKERS)
+		cryptoWorkers = SSL_HANDSHAKE_MAX_WORKERS;
+
+	_doneCallback = doneCallback;
+	_context = context;
+	_deadlineMs = deadlineMs;
+	_workerCount = workerCount;
+	_nextWorker = 0;
+	_running = true;
+	_started = 0;
+	_completed = 0;
+	_failed = 0;
+	_timedOut = 0;
+	_cryptoSteps = 0;
+	_shed = 0;
+	_pending = 0;
+
+	_workers = new HANDSHAKE_WORKER[workerCount];
+	for (int i = 0; i < workerCount; i++)
+	{
+		HANDSHAKE_WORKER* worker = &_workers[i];
+		worker->pool = this;
+		worker->thread = 0;
+
+		// Without a wake socket new connections are picked up on the next poll interval
+		worker->wakeSocket = SocketPolicy::CreateWakeSocket(&worker->wakeAddress);
+		worker->thread = SocketPolicy::CreateWorkerThread(Worker_ThreadCall, worker);
+	}
+
+	_cryptoWorkerCount = cryptoWorkers;
+	_cryptoThreads = 0;
+	if (cryptoWorkers > 0)
+	{
+		_cryptoThreads = new HANDLE[cryptoWorkers];
+		for (int i = 0; i < cryptoWorkers; i++)
+			_cryptoThreads[i] = SocketPolicy::CreateWorkerThread(CryptoWorker_ThreadCall, this);
+	}
+}
+
+SslHandshakePool::~SslHandshakePool()
+{
+	{
+		// Under the lock, a crypto worker between checking _running and waiting would miss the notify otherwise
+		std::lock_guard<std::mutex> guard(_cryptoLock);
+		_running = false;
+	}
+
+	// Crypto workers hand connections back to the poll workers, so they stop first. Poll workers may still queue
+	// crypto steps until they stop, the queue is freed once both are gone
+	_cryptoReady.notify_all();
+	for (int i = 0; i < _cryptoWorkerCount; i++)
+	{
+		if (_cryptoThreads[i])
+		{
+			WaitForSingleObject(_cryptoThreads[i], INFINITE);
+			CloseHandle(_cryptoThreads[i]);
+		}
+	}
+	if (_cryptoThreads)
+		delete[] _cryptoThreads;
+
+	for (int i = 0; i < _workerCount; i++)
+	{
+		HANDSHAKE_WORKER* worker = &_workers[i];
+		SocketPolicy::SignalWakeSocket(worker->wakeSocket, &worker->wakeAddress);
+		if (worker->thread)
+		{
+			WaitForSingleObject(worker->thread, INFINITE);
+			CloseHandle(worker->thread);
+		}
+		if (worker->wakeSocket != INVALID_SOCKET)
+			closesocket(worker->wakeSocket);
+
+		// Connections submitted after the worker stopped
+		for (std::list<PENDING_HANDSHAKE>::iterator it = worker->incoming.begin(); it != worker->incoming.end(); ++it)
+			Drop(&*it);
+	}
+
+	for (std::list<PENDING_HANDSHAKE>::iterator it = _cryptoQueue.begin(); it != _cryptoQueue.end(); ++it)
+		Drop(&*it);
+	delete[] _workers;
+}
+
+bool SslHandshakePool::Submit(SSL* ssl, SOCKET socket, sockaddr_in* address)
+{
+	if (!_running || !ssl || socket == INVALID_SOCKET)
+		return false;
+
+	if (!SocketPolicy::setNonBlocking(socket, true))
+		return false;
+
+	PENDING_HANDSHAKE handshake;
+	handshake.ssl = ssl;
+	handshake.socket = socket;
+	handshake.address = *address;
+	handshake.deadline = GetTickCount64() + _deadlineMs;
+	handshake.events = 0;
+	handshake.worker = _nextWorker++ % _workerCount;
+	SSL_set_accept_state(ssl);
+
+	HANDSHAKE_WORKER* worker = &_workers[handshake.worker];
+	{
+		std::lock_guard<std::mutex> guard(worker->lock);
+		worker->incoming.push_back(handshake);
+	}
+	_started++;
+	_pending++;
+
+	SocketPolicy::SignalWakeSocket(worker->wakeSocket, &worker->wakeAddress);
+	return true;
+}
+
+int SslHandshakePool::getWorkerCount()
+{
+	return _workerCount;
+}
+
+void SslHandshakePool::getStats(SSL_HANDSHAKE_STATS* stats)
+{
+	if (!stats)
+		return;
+
+	stats->started = _started;
+	stats->completed = _completed;
+	stats->failed = _failed;
+	stats->timedOut = _timedOut;
+	stats->cryptoSteps = _cryptoSteps;
+	stats->shed = _shed;
+	stats->pending = _pending;
+}
+
+DWORD SslHandshakePool::WorkerLoop(HANDSHAKE_WORKER* worker)
+{
+	std::list<PENDING_HANDSHAKE> active;
+	pollfd* fds = 0;
+	size_t fdsCapacity = 0, polled = 0;
+
+	while (_running)
+	{
+		{
+			std::lock_guard<std::mutex> guard(worker->lock);
+			active.splice(active.end(), worker->incoming);
+		}
+
+		// Advance every connection that is ready (new ones are tried right away, the ClientHello is usually there),
+		// drop the ones past their deadline and work out how long poll may sleep. Connections returned by
+		// the crypto workers come after the ones polled last time and get polled on this pass
+		ULONGLONG now = GetTickCount64();
+		ULONGLONG nextDeadline = now + SSL_HANDSHAKE_POLL_INTERVAL_MS;
+		size_t fdIndex = 1;
+		for (std::list<PENDING_HANDSHAKE>::iterator it = active.begin(); it != active.end();)
+		{
+			bool ready = it->events == 0 || (fdIndex < polled && fds[fdIndex].fd == it->socket && fds[fdIndex].revents != 0);
+			if (it->events != 0)
+				fdIndex++;
+
+			if (ready && _cryptoWorkerCount > 0)
+			{
+				// When the crypto workers are that far behind, the connection would miss its deadline waiting anyway
+				bool queued = false;
+				{
+					std::lock_guard<std::mutex> guard(_cryptoLock);
+					if (_cryptoQueue.size() < SSL_HANDSHAKE_MAX_CRYPTO_QUEUE)
+					{
+						_cryptoQueue.push_back(*it);
+						queued = true;
+					}
+				}
+				if (queued)
+					_cryptoReady.notify_one();
+				else
+				{
+					_shed++;
+					Drop(&*it);
+				}
+				it = active.erase(it);
+				continue;
+			}
+			if ((ready && Advance(&*it)) || (!ready && now >= it->deadline))
+			{
+				if (!ready)
+				{
+					_timedOut++;
+					Drop(&*it);
+				}
+				it = active.erase(it);
+				continue;
+			}
+			if (it->deadline < nextDeadline)
+				nextDeadline = it->deadline;
+			++it;
+		}
+
+		if (active.size() + 1 > fdsCapacity)
+		{
+			size_t capacity = fdsCapacity ? fdsCapacity * 2 : 64;
+			while (capacity < active.size() + 1)
+				capacity *= 2;
+			pollfd* grown = (pollfd*)realloc(fds, capacity * sizeof(pollfd));
+			if (!grown)
+			{
+				polled = 0;
+				Sleep(1);
+				continue;
+			}
+			fds = grown;
+			fdsCapacity = capacity;
+		}
+
+		fds[0].fd = worker->wakeSocket;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		size_t count = 1;
+		for (std::list<PENDING_HANDSHAKE>::iterator it = active.begin(); it != active.end(); ++it)
+		{
+			fds[count].fd = it->socket;
+			fds[count].events = it->events;
+			fds[count].revents = 0;
+			count++;
+		}
+
+		int timeout = nextDeadline > now ? (int)(nextDeadline - now) : 0;
+		polled = count;
+		if (worker->wakeSocket == INVALID_SOCKET)
+			SocketPolicy::PollSockets(fds + 1, (ULONG)(count - 1), timeout > 10 ? 10 : timeout);
+		else if (SocketPolicy::PollSockets(fds, (ULONG)count, timeout) > 0 && fds[0].revents != 0)
+			SocketPolicy::DrainWakeSocket(worker->wakeSocket);
+	}
+
+	for (std::list<PENDING_HANDSHAKE>::iterator it = active.begin(); it != active.end(); ++it)
+		Drop(&*it);
+	free(fds);
+	return 0;
+}
+
+DWORD SslHandshakePool::CryptoLoop()
+{
+	while (true)
+	{
+		PENDING_HANDSHAKE handshake;
+		{
+			std::unique_lock<std::mutex> guard(_cryptoLock);
+			_cryptoReady.wait(guard, [this]() { return !_running || !_cryptoQueue.empty(); });
+			if (!_running)
+				break;
+
+			handshake = _cryptoQueue.front();
+			_cryptoQueue.pop_front();
+		}
+
+		// The deadline is not checked while a connection waits in the queue
+		if (GetTickCount64() >= handshake.deadline)
+		{
+			_timedOut++;
+			Drop(&handshake);
+			continue;
+		}
+
+		_cryptoSteps++;
+		if (!Advance(&handshake))
+			ReturnToWorker(&handshake);
+	}
+
+	return 0;
+}
+
+void SslHandshakePool::ReturnToWorker(PENDING_HANDSHAKE* handshake)
+{
+	HANDSHAKE_WORKER* worker = &_workers[handshake->worker];
+	{
+		std::lock_guard<std::mutex> guard(worker->lock);
+		worker->incoming.push_back(*handshake);
+	}
+	SocketPolicy::SignalWakeSocket(worker->wakeSocket, &worker->wakeAddress);
+}
+
+bool SslHandshakePool::Advance(PENDING_HANDSHAKE* handshake)
+{
+	int ret = SSL_do_handshake(handshake->ssl);
+	if (ret == 1)
+	{
+		SocketPolicy::setNonBlocking(handshake->socket, false);
+		_completed++;
+		_pending--;
+		_doneCallback(handshake->ssl, handshake->socket, &handshake->address, _context);
+		return true;
+	}
+
+	switch (SSL_get_error(handshake->ssl, ret))
+	{
+	case SSL_ERROR_WANT_READ:
+		handshake->events = POLLIN;
+		return false;
+	case SSL_ERROR_WANT_WRITE:
+		handshake->events = POLLOUT;
+		return false;
+	default:
+		_failed++;
+		Drop(handshake);
+		return true;
+	}
+}
+
+void SslHandshakePool::Drop(PENDING_HANDSHAKE* handshake)
+{
+	SSL_free(handshake->ssl);
+	closesocket(handshake->socket);
+	_pending--;
+}
\ No newline at end of file
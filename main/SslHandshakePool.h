@@ -0,0 +1,120 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#ifdef PRIMESOCKET_USE_SSL
+#include <openssl/ssl.h>
+
+#define SSL_HANDSHAKE_DEFAULT_DEADLINE_MS 10000
+#define SSL_HANDSHAKE_POLL_INTERVAL_MS 100
+#define SSL_HANDSHAKE_MAX_WORKERS 64
+#define SSL_HANDSHAKE_MAX_CRYPTO_QUEUE 1024 // Connections waiting for a crypto worker, ready ones beyond it are shed
+
+typedef struct
+{
+	unsigned long long started;
+	unsigned long long completed;
+	unsigned long long failed;
+	unsigned long long timedOut; // Handshakes dropped because they didn't complete before the deadline
+	unsigned long long cryptoSteps; // Handshake steps run on the crypto workers
+	unsigned long long shed; // Handshakes dropped because the crypto queue was full
+	size_t pending;
+}SSL_HANDSHAKE_STATS;
+
+// Called on a handshake worker once SSL_accept completed, the socket is switched back to blocking mode
+typedef void(*SSLHANDSHAKE_DONE_CALLBACK)(SSL* ssl, SOCKET socket, sockaddr_in* address, void* context);
+
+// Drives server handshakes as non-blocking state machines on a fixed set of worker threads so a slow
+// or malicious client can't hold up the accept loop, each worker multiplexes its connections with poll.
+// With crypto workers the poll workers only wait for readiness, the handshake steps (which do the key exchange
+// and the certificate signature) run on the crypto workers, so a signing burst never delays polling
+class SslHandshakePool
+{
+public:
+	// workerCount 0 starts one worker per processor, cryptoWorkers 0 runs the handshake steps on the poll workers
+	PRIMESOCKET_API SslHandshakePool(SSLHANDSHAKE_DONE_CALLBACK doneCallback, void* context, int workerCount = 0, DWORD deadlineMs = SSL_HANDSHAKE_DEFAULT_DEADLINE_MS, int cryptoWorkers = 0);
+	PRIMESOCKET_API ~SslHandshakePool();
+
+	// Takes ownership of ssl and socket, both are freed if the handshake fails or misses the deadline
+	PRIMESOCKET_API bool Submit(SSL* ssl, SOCKET socket, sockaddr_in* address);
+	PRIMESOCKET_API int getWorkerCount();
+	PRIMESOCKET_API void getStats(SSL_HANDSHAKE_STATS* stats);
+
+private:
+	typedef struct
+	{
+		SSL* ssl;
+		SOCKET socket;
+		sockaddr_in address;
+		ULONGLONG deadline;
+		short events; // Readiness the handshake is waiting for, 0 until the first attempt
+		int worker; // Poll worker the connection returns to after a crypto step
+	}PENDING_HANDSHAKE;
+
+	typedef struct
+	{
+		SslHandshakePool* pool;
+		HANDLE thread;
+		SOCKET wakeSocket; // Loopback datagram socket Submit writes to so poll returns for new connections
+		sockaddr_in wakeAddress;
+		std::mutex lock;
+		std::list<PENDING_HANDSHAKE> incoming;
+	}HANDSHAKE_WORKER;
+
+	static DWORD WINAPI Worker_ThreadCall(LPVOID param)
+	{
+		HANDSHAKE_WORKER* worker = (HANDSHAKE_WORKER*)param;
+		return worker->pool->WorkerLoop(worker);
+	}
+	DWORD WorkerLoop(HANDSHAKE_WORKER* worker);
+
+	static DWORD WINAPI CryptoWorker_ThreadCall(LPVOID param)
+	{
+		SslHandshakePool* _instance = (SslHandshakePool*)param;
+		return _instance->CryptoLoop();
+	}
+	DWORD CryptoLoop();
+	void ReturnToWorker(PENDING_HANDSHAKE* handshake);
+	// Returns true when the handshake is finished, successfully or not
+	bool Advance(PENDING_HANDSHAKE* handshake);
+	void Drop(PENDING_HANDSHAKE* handshake);
+
+	SSLHANDSHAKE_DONE_CALLBACK _doneCallback;
+	void* _context;
+	DWORD _deadlineMs;
+	HANDSHAKE_WORKER* _workers;
+	int _workerCount;
+	std::atomic<unsigned int> _nextWorker;
+	std::atomic<bool> _running;
+
+	HANDLE* _cryptoThreads;
+	int _cryptoWorkerCount;
+	std::mutex _cryptoLock;
+	std::condition_variable _cryptoReady;
+	std::list<PENDING_HANDSHAKE> _cryptoQueue;
+
+	std::atomic<unsigned long long> _started, _completed, _failed, _timedOut, _cryptoSteps, _shed;
+	std::atomic<size_t> _pending;
+};
+#endif
\ No newline at end of file
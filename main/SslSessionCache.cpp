@@ -0,0 +1,496 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#define PRIMESOCKET_USE_SSL
+#include "PrimeSocket.h"
+#include <openssl/core_names.h>
+
+static int _cacheExIndex = -1;
+static std::once_flag _cacheExIndexOnce;
+
+SslSessionCache::SslSessionCache(size_t maxSessions, DWORD ticketKeyLifetime)
+{
+	_shardCapacity = maxSessions / SSL_SESSION_CACHE_SHARDS;
+	if (_shardCapacity == 0)
+		_shardCapacity = 1;
+
+	_ticketKeyLifetime = ticketKeyLifetime;
+	_ticketKeyCount = NewTicketKey(&_ticketKeys[0]) ? 1 : 0;
+	_cacheHits = 0;
+	_cacheMisses = 0;
+	_cacheEvictions = 0;
+	_ticketHits = 0;
+	_ticketMisses = 0;
+	_ticketKeyRotations = 0;
+}
+
+SslSessionCache::~SslSessionCache()
+{
+	for (int i = 0; i < SSL_SESSION_CACHE_SHARDS; i++)
+	{
+		for (std::list<CACHE_ENTRY>::iterator it = _shards[i].lru.begin(); it != _shards[i].lru.end(); it++)
+			SSL_SESSION_free(it->session);
+	}
+
+	OPENSSL_cleanse(_ticketKeys, sizeof(_ticketKeys));
+}
+
+bool SslSessionCache::Attach(SSL_CTX* ctx)
+{
+	if (!ctx || _ticketKeyCount == 0)
+		return false;
+
+	std::call_once(_cacheExIndexOnce, []() { _cacheExIndex = SSL_CTX_get_ex_new_index(0, 0, 0, 0, FreeCache_Callback); });
+	if (_cacheExIndex < 0 || !SSL_CTX_set_ex_data(ctx, _cacheExIndex, this))
+		return false;
+
+	// The internal cache has a single lock, bypass it and let the sharded cache do the lookups
+	static const unsigned char sessionIdContext[] = "PrimeSocket";
+	SSL_CTX_set_session_id_context(ctx, sessionIdContext, sizeof(sessionIdContext) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx, NewSession_Callback);
+	SSL_CTX_sess_set_get_cb(ctx, GetSession_Callback);
+	SSL_CTX_sess_set_remove_cb(ctx, RemoveSession_Callback);
+
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TicketKey_Callback);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, TicketKey_Callback);
+#endif
+
+	return true;
+}
+
+void SslSessionCache::getStats(SSL_SESSION_CACHE_STATS* stats)
+{
+	if (!stats)
+		return;
+
+	stats->cacheHits = _cacheHits;
+	stats->cacheMisses = _cacheMisses;
+	stats->cacheEvictions = _cacheEvictions;
+	stats->ticketHits = _ticketHits;
+	stats->ticketMisses = _ticketMisses;
+	stats->ticketKeyRotations = _ticketKeyRotations;
+	stats->cachedSessions = 0;
+	for (int i = 0; i < SSL_SESSION_CACHE_SHARDS; i++)
+	{
+		std::lock_guard<std::mutex> guard(_shards[i].lock);
+		stats->cachedSessions += _shards[i].index.size();
+	}
+}
+
+SslSessionCache::CACHE_SHARD* SslSessionCache::ShardFor(const unsigned char* id, unsigned int idLen)
+{
+	// FNV-1a, session ids are random so any cheap hash spreads them evenly
+	unsigned int hash = 2166136261u;
+	for (unsigned int i = 0; i < idLen; i++)
+		hash = (hash ^ id[i]) * 16777619u;
+
+	return &_shards[hash % SSL_SESSION_CACHE_SHARDS];
+}
+
+void SslSessionCache::Insert(SSL_SESSION* session)
+{
+	unsigned int idLen = 0;
+	const unsigned char* id = SSL_SESSION_get_id(session, &idLen);
+	CACHE_SHARD* shard = ShardFor(id, idLen);
+	std::string key((const char*)id, idLen);
+
+	SSL_SESSION* evicted = 0;
+	{
+		std::lock_guard<std::mutex> guard(shard->lock);
+		std::unordered_map<std::string, std::list<CACHE_ENTRY>::iterator>::iterator existing = shard->index.find(key);
+		if (existing != shard->index.end())
+		{
+			SSL_SESSION_free(existing->second->session);
+			shard->lru.erase(existing->second);
+			shard->index.erase(existing);
+		}
+
+		CACHE_ENTRY entry;
+		entry.id = key;
+		entry.session = session;
+		shard->lru.push_front(entry);
+		shard->index[key] = shard->lru.begin();
+
+		if (shard->index.size() > _shardCapacity)
+		{
+			evicted = shard->lru.back().session;
+			shard->index.erase(shard->lru.back().id);
+			shard->lru.pop_back();
+		}
+	}
+
+	if (evicted)
+	{
+		SSL_SESSION_free(evicted);
+		_cacheEvictions++;
+	}
+}
+
+SSL_SESSION* SslSessionCache::Lookup(const unsigned char* id, int idLen)
+{
+	CACHE_SHARD* shard = ShardFor(id, idLen);
+	std::string key((const char*)id, idLen);
+
+	std::lock_guard<std::mutex> guard(shard->lock);
+	std::unordered_map<std::string, std::list<CACHE_ENTRY>::iterator>::iterator found = shard->index.find(key);
+	if (found == shard->index.end())
+		return 0;
+
+	shard->lru.splice(shard->lru.begin(), shard->lru, found->second);
+	// Take the reference under the lock, another thread may evict the entry right after we return
+	SSL_SESSION_up_ref(found->second->session);
+	return found->second->session;
+}
+
+void SslSessionCache::Remove(SSL_SESSION* session)
+{
+	unsigned int idLen = 0;
+	const unsigned char* id = SSL_SESSION_get_id(session, &idLen);
+	CACHE_SHARD* shard = ShardFor(id, idLen);
+	std::string key((const char*)id, idLen);
+
+	SSL_SESSION* removed = 0;
+	{
+		std::lock_guard<std::mutex> guard(shard->lock);
+		std::unordered_map<std::string, std::list<CACHE_ENTRY>::iterator>::iterator found = shard->index.find(key);
+		if (found == shard->index.end())
+			return;
+
+		removed = found->second->session;
+		shard->lru.erase(found->second);
+		shard->index.erase(found);
+	}
+
+	SSL_SESSION_free(removed);
+}
+
+bool SslSessionCache::NewTicketKey(TICKET_KEY* key)
+{
+	if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+		RAND_bytes(key->aesKey, sizeof(key->aesKey)) != 1 ||
+		RAND_bytes(key->hmacKey, sizeof(key->hmacKey)) != 1)
+		return false;
+
+	key->created = time(0);
+	return true;
+}
+
+// Called with _ticketLock held, rotates the issuing key once it reached its lifetime
+SslSessionCache::TICKET_KEY* SslSessionCache::CurrentTicketKey()
+{
+	if (time(0) - _ticketKeys[0].created >= (time_t)_ticketKeyLifetime)
+	{
+		TICKET_KEY key;
+		if (NewTicketKey(&key))
+		{
+			for (int i = SSL_TICKET_KEY_COUNT - 1; i > 0; i--)
+				_ticketKeys[i] = _ticketKeys[i - 1];
+			_ticketKeys[0] = key;
+			if (_ticketKeyCount < SSL_TICKET_KEY_COUNT)
+				_ticketKeyCount++;
+			_ticketKeyRotations++;
+		}
+		OPENSSL_cleanse(&key, sizeof(TICKET_KEY));
+	}
+
+	return &_ticketKeys[0];
+}
+
+// Called with _ticketLock held
+SslSessionCache::TICKET_KEY* SslSessionCache::FindTicketKey(const unsigned char* name, bool* isCurrent)
+{
+	time_t now = time(0);
+	for (int i = 0; i < _ticketKeyCount; i++)
+	{
+		if (memcmp(_ticketKeys[i].name, name, sizeof(_ticketKeys[i].name)) != 0)
+			continue;
+
+		// A retired key keeps decrypting for one more lifetime after it stopped issuing tickets. Keys only rotate
+		// when tickets are issued, so the age bounds every key, the issuing one included, to twice the lifetime
+		if (i > 0 && now - _ticketKeys[i - 1].created >= (time_t)_ticketKeyLifetime)
+			return 0;
+		if (now - _ticketKeys[i].created >= 2 * (time_t)_ticketKeyLifetime)
+			return 0;
+
+		// A key past its lifetime asks for a fresh ticket, issuing it rotates the key
+		*isCurrent = i == 0 && now - _ticketKeys[i].created < (time_t)_ticketKeyLifetime;
+		return &_ticketKeys[i];
+	}
+
+	return 0;
+}
+
+SslSessionCache* SslSessionCache::FromContext(SSL_CTX* ctx)
+{
+	return (SslSessionCache*)SSL_CTX_get_ex_data(ctx, _cacheExIndex);
+}
+
+void SslSessionCache::FreeCache_Callback(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp)
+{
+	// SSL_CTX_free flushes the sessions through the remove callback before it frees the ex_data
+	if (ptr)
+		delete (SslSessionCache*)ptr;
+}
+
+int SslSessionCache::NewSession_Callback(SSL* ssl, SSL_SESSION* session)
+{
+	SslSessionCache* cache = FromContext(SSL_get_SSL_CTX(ssl));
+	if (!cache)
+		return 0;
+
+	// Returning 1 hands our reference of the session over to the cache
+	cache->Insert(session);
+	return 1;
+}
+
+SSL_SESSION* SslSessionCache::GetSession_Callback(SSL* ssl, const unsigned char* id, int idLen, int* copy)
+{
+	*copy = 0;
+	SslSessionCache* cache = FromContext(SSL_get_SSL_CTX(ssl));
+	if (!cache)
+		return 0;
+
+	SSL_SESSION* session = cache->Lookup(id, idLen);
+	if (session)
+		cache->_cacheHits++;
+	else
+		cache->_cacheMisses++;
+
+	return session;
+}
+
+void SslSessionCache::RemoveSession_Callback(SSL_CTX* ctx, SSL_SESSION* session)
+{
+	SslSessionCache* cache = FromContext(ctx);
+	if (cache)
+		cache->Remove(session);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int SslSessionCache::TicketKey_Callback(SSL* ssl, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* cipherCtx, EVP_MAC_CTX* macCtx, int enc)
+#else
+int SslSessionCache::TicketKey_Callback(SSL* ssl, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* cipherCtx, HMAC_CTX* macCtx, int enc)
+#endif
+{
+	SslSessionCache* cache = FromContext(SSL_get_SSL_CTX(ssl));
+	if (!cache)
+		return -1;
+
+	std::lock_guard<std::mutex> guard(cache->_ticketLock);
+	TICKET_KEY* key = 0;
+	bool isCurrent = true;
+	if (enc)
+	{
+		key = cache->CurrentTicketKey();
+		memcpy(keyName, key->name, sizeof(key->name));
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return -1;
+		if (EVP_EncryptInit_ex(cipherCtx, EVP_aes_256_cbc(), 0, key->aesKey, iv) != 1)
+			return -1;
+	}
+	else
+	{
+		key = cache->FindTicketKey(keyName, &isCurrent);
+		if (!key)
+		{
+			cache->_ticketMisses++;
+			return 0;
+		}
+		if (EVP_DecryptInit_ex(cipherCtx, EVP_aes_256_cbc(), 0, key->aesKey, iv) != 1)
+			return -1;
+		cache->_ticketHits++;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmacKey, sizeof(key->hmacKey));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(macCtx, params) != 1)
+		return -1;
+#else
+	if (HMAC_Init_ex(macCtx, key->hmacKey, sizeof(key->hmacKey), EVP_sha256(), 0) != 1)
+		return -1;
+#endif
+
+	// 2 asks OpenSSL to issue a fresh ticket under the current key
+	return isCurrent ? 1 : 2;
+}
+
+SslClientSessionStore* SslClientSessionStore::Global()
+{
+	static SslClientSessionStore store;
+	return &store;
+}
+
+SslClientSessionStore::SslClientSessionStore()
+{
+	_keyExIndex = SSL_get_ex_new_index(0, 0, 0, 0, FreeKey_Callback);
+	_offered = 0;
+	_resumed = 0;
+	_stored = 0;
+}
+
+bool SslClientSessionStore::Attach(SSL_CTX* ctx)
+{
+	if (!ctx || _keyExIndex < 0)
+		return false;
+
+	// Sessions are kept in this store only, the per context internal store would be thrown away with the context
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, NewSession_Callback);
+	return true;
+}
+
+bool SslClientSessionStore::Prepare(SSL* ssl, const char* host, const char* port, const char* serverName, const char* policy)
+{
+	std::string key = std::string(host) + ":" + port + "/" + (serverName ? serverName : "") + "#" + (policy ? policy : "");
+	char* keyCopy = (char*)malloc(key.size() + 1);
+	if (!keyCopy)
+		return false;
+	memcpy(keyCopy, key.c_str(), key.size() + 1);
+	SSL_set_ex_data(ssl, _keyExIndex, keyCopy);
+
+	SSL_SESSION* session = Take(key);
+	if (!session)
+		return false;
+
+	bool offered = SSL_set_session(ssl, session) == 1;
+	SSL_SESSION_free(session);
+	if (offered)
+		_offered++;
+	return offered;
+}
+
+void SslClientSessionStore::HandshakeDone(SSL* ssl)
+{
+	if (SSL_session_reused(ssl))
+		_resumed++;
+}
+
+void SslClientSessionStore::Clear()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	for (std::list<STORE_ENTRY>::iterator it = _lru.begin(); it != _lru.end(); it++)
+		SSL_SESSION_free(it->session);
+	_lru.clear();
+	_index.clear();
+}
+
+void SslClientSessionStore::getStats(SSL_CLIENT_SESSION_STATS* stats)
+{
+	if (!stats)
+		return;
+
+	stats->offered = _offered;
+	stats->resumed = _resumed;
+	stats->stored = _stored;
+	std::lock_guard<std::mutex> guard(_lock);
+	stats->storedSessions = _index.size();
+}
+
+void SslClientSessionStore::Store(const std::string& key, SSL_SESSION* session)
+{
+	SSL_SESSION* replaced = 0;
+	SSL_SESSION* evicted = 0;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		std::unordered_map<std::string, std::list<STORE_ENTRY>::iterator>::iterator existing = _index.find(key);
+		if (existing != _index.end())
+		{
+			replaced = existing->second->session;
+			_lru.erase(existing->second);
+			_index.erase(existing);
+		}
+
+		STORE_ENTRY entry;
+		entry.key = key;
+		entry.session = session;
+		_lru.push_front(entry);
+		_index[key] = _lru.begin();
+
+		if (_index.size() > SSL_CLIENT_SESSION_STORE_SIZE)
+		{
+			evicted = _lru.back().session;
+			_index.erase(_lru.back().key);
+			_lru.pop_back();
+		}
+	}
+
+	if (replaced)
+		SSL_SESSION_free(replaced);
+	if (evicted)
+		SSL_SESSION_free(evicted);
+	_stored++;
+}
+
+SSL_SESSION* SslClientSessionStore::Take(const std::string& key)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	std::unordered_map<std::string, std::list<STORE_ENTRY>::iterator>::iterator found = _index.find(key);
+	if (found == _index.end())
+		return 0;
+
+	SSL_SESSION* session = found->second->session;
+	if (!SSL_SESSION_is_resumable(session))
+	{
+		SSL_SESSION_free(session);
+		_lru.erase(found->second);
+		_index.erase(found);
+		return 0;
+	}
+
+	// TLS 1.3 tickets are single use, the server sends fresh ones after every resumption
+	if (SSL_SESSION_get_protocol_version(session) >= TLS1_3_VERSION)
+	{
+		_lru.erase(found->second);
+		_index.erase(found);
+		return session;
+	}
+
+	SSL_SESSION_up_ref(session);
+	return session;
+}
+
+int SslClientSessionStore::NewSession_Callback(SSL* ssl, SSL_SESSION* session)
+{
+	SslClientSessionStore* store = Global();
+	const char* key = (const char*)SSL_get_ex_data(ssl, store->_keyExIndex);
+	if (!key)
+		return 0;
+
+	// Returning 1 hands our reference of the session over to the store
+	store->Store(key, session);
+	return 1;
+}
+
+void SslClientSessionStore::FreeKey_Callback(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp)
+{
+	if (ptr)
+		free(ptr);
+}
\ No newline at end of file
@@ -0,0 +1,160 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#ifdef PRIMESOCKET_USE_SSL
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+
+#define SSL_SESSION_CACHE_SHARDS 16
+#define SSL_SESSION_CACHE_DEFAULT_SIZE 20480
+#define SSL_TICKET_KEY_DEFAULT_LIFETIME 3600 // Seconds a ticket key issues tickets, it is accepted for twice as long
+#define SSL_TICKET_KEY_COUNT 3
+
+typedef struct
+{
+	unsigned long long cacheHits;
+	unsigned long long cacheMisses;
+	unsigned long long cacheEvictions;
+	unsigned long long ticketHits;
+	unsigned long long ticketMisses; // Tickets from an unknown or expired key, the client falls back to a full handshake
+	unsigned long long ticketKeyRotations;
+	size_t cachedSessions;
+}SSL_SESSION_CACHE_STATS;
+
+// Server side resumption state: a sharded LRU session cache plus the stateless session ticket keys
+class SslSessionCache
+{
+public:
+	PRIMESOCKET_API SslSessionCache(size_t maxSessions = SSL_SESSION_CACHE_DEFAULT_SIZE, DWORD ticketKeyLifetime = SSL_TICKET_KEY_DEFAULT_LIFETIME);
+	PRIMESOCKET_API ~SslSessionCache();
+
+	// Install the cache and ticket callbacks on a server context. On success the context owns the cache and deletes
+	// it when the last reference to the context is gone, after accepted connections and the flush of its sessions
+	PRIMESOCKET_API bool Attach(SSL_CTX* ctx);
+	PRIMESOCKET_API void getStats(SSL_SESSION_CACHE_STATS* stats);
+
+private:
+	typedef struct
+	{
+		std::string id;
+		SSL_SESSION* session;
+	}CACHE_ENTRY;
+
+	typedef struct
+	{
+		std::mutex lock;
+		std::list<CACHE_ENTRY> lru; // Most recently used first
+		std::unordered_map<std::string, std::list<CACHE_ENTRY>::iterator> index;
+	}CACHE_SHARD;
+
+	typedef struct
+	{
+		unsigned char name[16];
+		unsigned char aesKey[32];
+		unsigned char hmacKey[32];
+		time_t created;
+	}TICKET_KEY;
+
+	CACHE_SHARD* ShardFor(const unsigned char* id, unsigned int idLen);
+	void Insert(SSL_SESSION* session);
+	SSL_SESSION* Lookup(const unsigned char* id, int idLen);
+	void Remove(SSL_SESSION* session);
+	bool NewTicketKey(TICKET_KEY* key);
+	TICKET_KEY* CurrentTicketKey();
+	TICKET_KEY* FindTicketKey(const unsigned char* name, bool* isCurrent);
+
+	static SslSessionCache* FromContext(SSL_CTX* ctx);
+	static void FreeCache_Callback(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+	static int NewSession_Callback(SSL* ssl, SSL_SESSION* session);
+	static SSL_SESSION* GetSession_Callback(SSL* ssl, const unsigned char* id, int idLen, int* copy);
+	static void RemoveSession_Callback(SSL_CTX* ctx, SSL_SESSION* session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static int TicketKey_Callback(SSL* ssl, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* cipherCtx, EVP_MAC_CTX* macCtx, int enc);
+#else
+	static int TicketKey_Callback(SSL* ssl, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* cipherCtx, HMAC_CTX* macCtx, int enc);
+#endif
+
+	CACHE_SHARD _shards[SSL_SESSION_CACHE_SHARDS];
+	size_t _shardCapacity;
+
+	std::mutex _ticketLock;
+	TICKET_KEY _ticketKeys[SSL_TICKET_KEY_COUNT]; // [0] issues new tickets, the rest only decrypt
+	int _ticketKeyCount;
+	DWORD _ticketKeyLifetime;
+
+	std::atomic<unsigned long long> _cacheHits, _cacheMisses, _cacheEvictions;
+	std::atomic<unsigned long long> _ticketHits, _ticketMisses, _ticketKeyRotations;
+};
+
+#define SSL_CLIENT_SESSION_STORE_SIZE 1024
+
+typedef struct
+{
+	unsigned long long offered; // Connects that offered a stored session
+	unsigned long long resumed; // Connects the server accepted the offered session for
+	unsigned long long stored;
+	size_t storedSessions;
+}SSL_CLIENT_SESSION_STATS;
+
+// Process wide client session store keyed by "host:port/sni" and the policy of the client context, used by
+// SslSocket::Connect to resume sessions. A resumed session skips certificate verification, so it is only offered
+// to contexts that would have verified (and negotiated) it the same way
+class SslClientSessionStore
+{
+public:
+	PRIMESOCKET_API static SslClientSessionStore* Global();
+
+	// Install the new session callback on a client context, sessions arrive after the handshake in TLS 1.3
+	PRIMESOCKET_API bool Attach(SSL_CTX* ctx);
+	// Tag the connection with its store key and offer the stored session, returns true if a session was offered.
+	// policy is SslContext::getSessionPolicy of the context the connection was created from
+	PRIMESOCKET_API bool Prepare(SSL* ssl, const char* host, const char* port, const char* serverName, const char* policy);
+	// Call once the handshake completed to account for the resumption result
+	PRIMESOCKET_API void HandshakeDone(SSL* ssl);
+	PRIMESOCKET_API void Clear();
+	PRIMESOCKET_API void getStats(SSL_CLIENT_SESSION_STATS* stats);
+
+private:
+	typedef struct
+	{
+		std::string key;
+		SSL_SESSION* session;
+	}STORE_ENTRY;
+
+	SslClientSessionStore();
+	void Store(const std::string& key, SSL_SESSION* session);
+	SSL_SESSION* Take(const std::string& key);
+
+	static int NewSession_Callback(SSL* ssl, SSL_SESSION* session);
+	static void FreeKey_Callback(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+
+	std::mutex _lock;
+	std::list<STORE_ENTRY> _lru; // Most recently stored first
+	std::unordered_map<std::string, std::list<STORE_ENTRY>::iterator> _index;
+	int _keyExIndex;
+
+	std::atomic<unsigned long long> _offered, _resumed, _stored;
+};
+#endif
\ No newline at end of file
@@ -27,15 +27,42 @@
 
 bool InitializeSSL()
 {
-	if (!SSL_library_init())
-		return false;
-	return true;
+	return SslContext::InitializeOpenSSL();
+}
+
+void SslSocket::InitializeMembers()
+{
+	_context = 0;
+	ctx = 0;
+	ssl = 0;
+	_ktls = false;
+	_lowMemory = false;
+	_sessionReuse = true;
+	_earlyData = 0;
+	_earlyDataLen = 0;
+	_earlyDataAccepted = false;
+	_handshakePool = 0;
+	_handshakeWorkers = 0;
+	_cryptoWorkers = 0;
+	_handshakeDeadline = SSL_HANDSHAKE_DEFAULT_DEADLINE_MS;
+	_dataPointers = 0;
+	_writeQueue = 0;
+	_writeQueueHead = 0;
+	_writeQueueLen = 0;
+	_writeQueueCapacity = 0;
+	_retryLen = 0;
+	_corked = false;
+	_writeScheduled = false;
+	_writeFailed = false;
+	_readFailed = false;
+	_bytesSinceIdle = 0;
+	_lastWriteTick = 0;
 }
 
 SslSocket::SslSocket()
 {
-    OpenSSL_add_all_algorithms();
-    SSL_load_error_strings();
+	SslContext::InitializeOpenSSL();
+	InitializeMembers();
 	_sslInit = false;
 	_init = false;
 	_sslSocketClean = false;
@@ -46,28 +73,51 @@ SslSocket::SslSocket()
 	_port = 99999;
 }
 
+SslSocket::SslSocket(SslContext* context)
+{
+	SslContext::InitializeOpenSSL();
+	InitializeMembers();
+	_sslInit = false;
+	_init = false;
+	_sslSocketClean = false;
+	_readBufSize = 65536;
+	_ai_family = AF_INET;
+	_ai_socktype = SOCK_STREAM;
+	_ai_protocol = IPPROTO_TCP;
+	_port = 99999;
+
+	if (context)
+	{
+		context->AddRef();
+		_context = context;
+		ctx = context->getNativeContext();
+		_sslInit = true;
+	}
+}
+
 SslSocket::SslSocket(SSL* clSsl, int clientPort, SSLDATA_RECEIVED_CALLBACK dataRecvCallback, SSLCONNECTION_CLOSED_CALLBACK connClosedCallback, int readBufferSize)
 {
 	if (*(int*)clSsl + 0 == 0 || !clientPort || !dataRecvCallback || !connClosedCallback)
 		return;
 
-	if (_readBufSize != readBufferSize)
-	{
-		if(readBufferSize >= 10 && readBufferSize <= 65536)
-			_readBufSize = readBufferSize;
-	}
+	// Out of range sizes keep the default
+	_readBufSize = 65536;
+	if (readBufferSize >= 10 && readBufferSize <= 65536)
+		_readBufSize = readBufferSize;
 
+	InitializeMembers();
 	_isServer = false;
 	_init = true;
 	_socketClosed = false;
 
 	ssl = clSsl;
 	_port = clientPort;
+	InitializeIo();
 	_dataReceivedCallback = dataRecvCallback;
 	_connClosedCallback = connClosedCallback;
 
 	callbackType = 0;
-	_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+	_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 }
 
 SslSocket::SslSocket(SSL* clSsl, int clientPort, SSLDATA_RECEIVED_MEMBER_CALLBACK dataRecvCallback, SSLCONNECTION_CLOSED_MEMBER_CALLBACK connectionClosedCallback, void* dataPointers, int readBufferSize)
@@ -75,64 +125,55 @@ SslSocket::SslSocket(SSL* clSsl, int clientPort, SSLDATA_RECEIVED_MEMBER_CALLBAC
 	if (*(int*)clSsl + 0 == 0 || !clientPort || !dataRecvCallback || !connectionClosedCallback || !dataPointers)
 		return;
 
-	if (_readBufSize != readBufferSize)
-	{
-		if (readBufferSize >= 10 && readBufferSize <= 65536)
-			_readBufSize = readBufferSize;
-	}
+	// Out of range sizes keep the default
+	_readBufSize = 65536;
+	if (readBufferSize >= 10 && readBufferSize <= 65536)
+		_readBufSize = readBufferSize;
 
+	InitializeMembers();
 	_isServer = false;
 	_init = true;
 	_socketClosed = false;
 
 	ssl = clSsl;
 	_port = clientPort;
+	InitializeIo();
 	_dataReceivedMemberCallback = dataRecvCallback;
 	_connClosedMemberCallback = connectionClosedCallback;
 
 	callbackType = 1;
 	_dataPointers = dataPointers;
-	_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+	_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 }
 
 int SslSocket::setServerCertificate(char* CertFile, char* KeyFile)
 {
-	if (_init)
+	if (_init || _sslInit)
 		return SSLSOCKET_INVALID_CALL;
-	else
-	{
-		if (!_sslInit)
-		{
-			if (!InitializeServerSSL())
-				return SSLSOCKET_SSL_INIT_ERROR;
-			_sslInit = true;
-		}
-		else
-		{
-			return SSLSOCKET_INVALID_CALL;
-		}
-	}
 
+	if (!InitializeServerSSL())
+		return SSLSOCKET_SSL_INIT_ERROR;
 
-	if (SSL_CTX_use_certificate_file(ctx, CertFile, SSL_FILETYPE_PEM) <= 0)
-	{
-		ERR_print_errors_fp(stderr);
-		return SSLSOCKET_INVALID_CERT;
-	}
+	int result = _context->setCertificate(CertFile, KeyFile);
+	if (result == SSLSOCKET_SUCCESS)
+		_sslInit = true;
+	return result;
+}
 
-	if (SSL_CTX_use_PrivateKey_file(ctx, KeyFile, SSL_FILETYPE_PEM) <= 0)
-	{
-		ERR_print_errors_fp(stderr);
-		return SSLSOCKET_INVALID_CERT;
-	}
-	/* verify private key */
-	if (!SSL_CTX_check_private_key(ctx))
-	{
-		fprintf(stderr, "Private key does not match the public certificate\n");
-		return SSLSOCKET_CERT_PRV_PUB_MISMATCH;
-	}
+int SslSocket::enableSessionResumption(size_t cacheSize, DWORD ticketKeyLifetime)
+{
+	if (_init || !_sslInit)
+		return SSLSOCKET_INVALID_CALL;
 
-	return SSLSOCKET_SUCCESS;
+	return _context->enableSessionResumption(cacheSize, ticketKeyLifetime);
+}
+
+bool SslSocket::getSessionCacheStats(SSL_SESSION_CACHE_STATS* stats)
+{
+	if (!_context)
+		return false;
+
+	return _context->getSessionCacheStats(stats);
 }
 
 SSL_CERTIFICATE_DATA* SslSocket::getCertificateData(SSL* clSsl)
@@ -150,9 +191,30 @@ SSL_CERTIFICATE_DATA* SslSocket::getCertificateData(SSL* clSsl)
 	return 0;
 }
 
+bool SslSocket::setHandshakeWorkers(int workerCount, DWORD deadlineMs, int cryptoWorkers)
+{
+	if (_init || workerCount < 0 || workerCount > SSL_HANDSHAKE_MAX_WORKERS || deadlineMs == 0 ||
+		cryptoWorkers < 0 || cryptoWorkers > SSL_HANDSHAKE_MAX_WORKERS)
+		return false;
+
+	_handshakeWorkers = workerCount;
+	_cryptoWorkers = cryptoWorkers;
+	_handshakeDeadline = deadlineMs;
+	return true;
+}
+
+bool SslSocket::getHandshakeStats(SSL_HANDSHAKE_STATS* stats)
+{
+	if (!_handshakePool || !stats)
+		return false;
+
+	_handshakePool->getStats(stats);
+	return true;
+}
+
 int SslSocket::Connect(char* addr, char* port, SSLDATA_RECEIVED_CALLBACK dataRecvCallback, SSLCONNECTION_CLOSED_CALLBACK connectionClosedCallback)
 {
-	if (!addr || !port || !dataRecvCallback || !connectionClosedCallback || _init)
+	if (!addr || !port || !dataRecvCallback || !connectionClosedCallback || _init || (_context && _context->isServer()))
 		return SSLSOCKET_INVALID_CALL;
 
 	if (!InitializeClientSSL())
@@ -163,23 +225,23 @@ int SslSocket::Connect(char* addr, char* port, SSLDATA_RECEIVED_CALLBACK dataRec
 		return cResult;
 
 	_init = true;
-	_sslInit = true;
 	_isServer = false;
 	_socketClosed = false;
+	InitializeIo();
 
 	sscanf(port, "%d", &_port);
 	_dataReceivedCallback = dataRecvCallback;
 	_connClosedCallback = connectionClosedCallback;
 
 	callbackType = 0;
-	_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+	_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 
 	return SSLSOCKET_SUCCESS;
 }
 
 int SslSocket::Connect(char* addr, char* port, SSLDATA_RECEIVED_MEMBER_CALLBACK dataRecvCallback, SSLCONNECTION_CLOSED_MEMBER_CALLBACK connectionClosedCallback, void* dataPointers)
 {
-	if (!addr || !port || !dataRecvCallback || !connectionClosedCallback || !dataPointers || _init)
+	if (!addr || !port || !dataRecvCallback || !connectionClosedCallback || !dataPointers || _init || (_context && _context->isServer()))
 		return SSLSOCKET_INVALID_CALL;
 
 	if (!InitializeClientSSL())
@@ -190,9 +252,9 @@ int SslSocket::Connect(char* addr, char* port, SSLDATA_RECEIVED_MEMBER_CALLBACK
 		return cResult;
 
 	_init = true;
-	_sslInit = true;
 	_isServer = false;
 	_socketClosed = false;
+	InitializeIo();
 
 	sscanf(port, "%d", &_port);
 	_dataReceivedMemberCallback = dataRecvCallback;
@@ -200,17 +262,17 @@ int SslSocket::Connect(char* addr, char* port, SSLDATA_RECEIVED_MEMBER_CALLBACK
 
 	callbackType = 1;
 	_dataPointers = dataPointers;
-	_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+	_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 
 	return SSLSOCKET_SUCCESS;
 }
 
 int SslSocket::Listen(char* addr, char* port, SSLNEW_CONNECTION_CALLBACK newConnCallback)
 {
-	if (!addr || !port || !newConnCallback || _init)
+	if (!addr || !port || !newConnCallback || _init || (_context && !_context->isServer()))
 		return SSLSOCKET_INVALID_CALL;
 
-	if(!_sslInit)
+	if (!_sslInit || !_context->hasCertificate())
 		return SSLSOCKET_CERT_NOT_SET;
 
 	int lResult = PerformListen(addr, port);
@@ -220,20 +282,21 @@ int SslSocket::Listen(char* addr, char* port, SSLNEW_CONNECTION_CALLBACK newConn
 	_isServer = true;
 	_init = true;
 	sscanf(port, "%d", &_port);
+	_handshakePool = new SslHandshakePool(HandshakeDone_Callback, this, _handshakeWorkers, _handshakeDeadline, _cryptoWorkers);
 
 	_newConCallback = newConnCallback;
 	callbackType = 0;
-	_hAcceptLoop = CreateThread(0, 0, AcceptLoop_ThreadCall, this, 0, 0);
+	_hAcceptLoop = SocketPolicy::CreateIoThread(AcceptLoop_ThreadCall, this);
 
 	return SSLSOCKET_SUCCESS;
 }
 
 int SslSocket::Listen(char* addr, char* port, SSLNEW_CONNECTION_MEMBER_CALLBACK newConnCallback, void* dataPointers)
 {
-	if (!addr || !port || !newConnCallback || !dataPointers || _init)
+	if (!addr || !port || !newConnCallback || !dataPointers || _init || (_context && !_context->isServer()))
 		return SSLSOCKET_INVALID_CALL;
 
-	if (!_sslInit)
+	if (!_sslInit || !_context->hasCertificate())
 		return SSLSOCKET_CERT_NOT_SET;
 
 	int lResult = PerformListen(addr, port);
@@ -243,11 +306,12 @@ int SslSocket::Listen(char* addr, char* port, SSLNEW_CONNECTION_MEMBER_CALLBACK
 	_isServer = true;
 	_init = true;
 	sscanf(port, "%d", &_port);
+	_handshakePool = new SslHandshakePool(HandshakeDone_Callback, this, _handshakeWorkers, _handshakeDeadline, _cryptoWorkers);
 
 	_dataPointers = dataPointers;
 	_newConCallback = newConnCallback;
 	callbackType = 1;
-	_hAcceptLoop = CreateThread(0, 0, AcceptLoop_ThreadCall, this, 0, 0);
+	_hAcceptLoop = SocketPolicy::CreateIoThread(AcceptLoop_ThreadCall, this);
 
 	return SSLSOCKET_SUCCESS;
 }
@@ -309,70 +373,362 @@ bool SslSocket::setReadBufferSize(int size)
 	return true;
 }
 
-bool SslSocket::Write(void* data, size_t dataSize)
+bool SslSocket::setLowMemoryMode(bool enable)
 {
-	if (_isServer || _socketClosed || _sslSocketClean)
+	if (_init)
 		return false;
 
-	int ret = 0;
-	try
+	_lowMemory = enable;
+	return true;
+}
+
+bool SslSocket::Write(void* data, size_t dataSize, bool moreData)
+{
+	if (_isServer || _socketClosed || _sslSocketClean || !data || dataSize == 0)
+		return false;
+
+	bool schedule = false;
 	{
-		ret = SSL_write(ssl, data, dataSize);
-		if (SSL_get_error(ssl, ret) == SSL_ERROR_WANT_WRITE)
+		std::lock_guard<std::mutex> guard(_sslLock);
+		if (_writeFailed || _writeQueueLen + dataSize > SSLSOCKET_MAX_WRITE_QUEUE)
+			return false;
+
+		ULONGLONG now = GetTickCount64();
+		if (now - _lastWriteTick > SSLSOCKET_RECORD_IDLE_RESET_MS)
+			_bytesSinceIdle = 0;
+		_lastWriteTick = now;
+		_corked = moreData;
+
+		size_t written = 0;
+		if (_writeQueueLen == 0 && !moreData)
 		{
-			int code = 0;
-			while (code != SSL_ERROR_NONE)
+			// Nothing queued ahead of this data, encrypt straight from the caller's buffer and only queue what doesn't fit
+			int result = WriteRecords((const char*)data, dataSize, &written);
+			if (result < 0)
 			{
-				ret = SSL_write(ssl, data, dataSize);
-				code = SSL_get_error(ssl, ret);
+				_writeFailed = true;
+				return false;
 			}
 		}
-		else
+		if (written < dataSize && !AppendWriteQueue((const char*)data + written, dataSize - written))
+			return false;
+
+		// Once scheduled, the scheduler sends the queue in order as the socket drains
+		if (_writeQueueLen > 0 && !_writeScheduled)
+		{
+			int result = FlushWrites();
+			if (result < 0)
+				return false;
+			schedule = result == 0;
+			_writeScheduled = schedule;
+		}
+	}
+
+	if (schedule)
+		SslWriteScheduler::Global()->Schedule(this);
+	return true;
+}
+
+bool SslSocket::Flush(DWORD timeoutMs)
+{
+	if (_isServer || _socketClosed || _sslSocketClean)
+		return false;
+
+	ULONGLONG deadline = timeoutMs == INFINITE ? 0 : GetTickCount64() + timeoutMs;
+	while (true)
+	{
+		int result;
+		{
+			std::lock_guard<std::mutex> guard(_sslLock);
+			_corked = false;
+			result = FlushWrites();
+		}
+		if (result != 0)
+			return result > 0;
+
+		ULONGLONG now = GetTickCount64();
+		if (deadline && now >= deadline)
+			return false;
+		WaitWritable(deadline && deadline - now < SSL_WRITE_SCHEDULER_POLL_INTERVAL_MS ? (int)(deadline - now) : SSL_WRITE_SCHEDULER_POLL_INTERVAL_MS);
+	}
+}
+
+size_t SslSocket::getQueuedBytes()
+{
+	std::lock_guard<std::mutex> guard(_sslLock);
+	return _writeQueueLen;
+}
+
+bool SslSocket::setSessionReuse(bool enable)
+{
+	if (_init)
+		return false;
+
+	_sessionReuse = enable;
+	return true;
+}
+
+bool SslSocket::isSessionReused()
+{
+	if (!_init || _isServer || !ssl)
+		return false;
+
+	return SSL_session_reused(ssl) == 1;
+}
+
+bool SslSocket::setEarlyData(void* data, size_t dataSize)
+{
+	if (_init || !data || dataSize == 0)
+		return false;
+
+	_earlyData = data;
+	_earlyDataLen = dataSize;
+	return true;
+}
+
+bool SslSocket::isEarlyDataAccepted()
+{
+	return _earlyDataAccepted;
+}
+
+bool SslSocket::setKernelTls(bool enable)
+{
+	if (_init)
+		return false;
+
+	// Applied per connection, the context may be shared with sockets that don't want offload
+	_ktls = enable;
+	return true;
+}
+
+bool SslSocket::isKernelTlsActive(bool* sendOffloaded, bool* recvOffloaded)
+{
+	if (!_init || _isServer || !ssl)
+		return false;
+
+	bool send = BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+	bool recv = BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+	if (sendOffloaded)
+		*sendOffloaded = send;
+	if (recvOffloaded)
+		*recvOffloaded = recv;
+
+	return send || recv;
+}
+
+long long SslSocket::SendFile(int fileDescriptor, long long offset, size_t size)
+{
+	if (_isServer || _socketClosed || _sslSocketClean || fileDescriptor < 0)
+		return -1;
+
+#ifndef OPENSSL_NO_KTLS
+	// Zero user space copies, the kernel encrypts straight from the page cache. Queued writes go first to keep the order
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0 && Flush())
+	{
+		long long total = 0;
+		while ((size_t)total < size)
 		{
-			if (SSL_get_error(ssl, ret) == SSL_ERROR_NONE)
-				return true;
+			ossl_ssize_t sent;
+			int error = SSL_ERROR_NONE;
+			{
+				std::lock_guard<std::mutex> guard(_sslLock);
+				sent = SSL_sendfile(ssl, fileDescriptor, (off_t)(offset + total), size - total, 0);
+				if (sent <= 0)
+					error = SSL_get_error(ssl, (int)sent);
+			}
+			if (sent <= 0)
+			{
+				if (error == SSL_ERROR_WANT_WRITE)
+				{
+					WaitWritable(SSL_WRITE_SCHEDULER_POLL_INTERVAL_MS);
+					continue;
+				}
+				return total > 0 ? total : -1;
+			}
+			total += sent;
 		}
+		return total;
+	}
+#endif
+
+	// Fallback: the record layer is in user space, read the file in chunks and encrypt through SSL_write
+	char* buffer = (char*)malloc(SSLSOCKET_SENDFILE_CHUNK);
+	if (!buffer)
+		return -1;
+
+#ifdef _WIN32
+	// There is no pread, seek back afterwards so the caller's file position stays where it was as on Linux
+	__int64 position = _lseeki64(fileDescriptor, 0, SEEK_CUR);
+	if (position == -1)
+	{
+		free(buffer);
+		return -1;
 	}
-	catch (std::exception& e)
+#endif
+
+	long long total = 0;
+	while ((size_t)total < size)
 	{
-		printf("SslSocket Exception At Write(): %s\n", e.what());
+		size_t chunk = size - total < SSLSOCKET_SENDFILE_CHUNK ? size - total : SSLSOCKET_SENDFILE_CHUNK;
+#ifdef _WIN32
+		if (_lseeki64(fileDescriptor, offset + total, SEEK_SET) == -1)
+			break;
+		int readLen = _read(fileDescriptor, buffer, (unsigned int)chunk);
+#else
+		ssize_t readLen = pread(fileDescriptor, buffer, chunk, (off_t)(offset + total));
+#endif
+		if (readLen <= 0 || !Write(buffer, readLen))
+			break;
+		total += readLen;
+		// Keep at most one chunk queued instead of reading the whole file into the write queue
+		if (getQueuedBytes() > SSLSOCKET_SENDFILE_CHUNK && !Flush())
+			break;
 	}
 
-	return ret > 0 ? true : false;
+#ifdef _WIN32
+	_lseeki64(fileDescriptor, position, SEEK_SET);
+#endif
+	free(buffer);
+	return total > 0 ? total : -1;
 }
 
 void SslSocket::Cleanup()
 {
 	if (_sslSocketClean)
 		return;
-	CreateThread(0, 0, SslSocket_CleanupThread, this, 0, 0);
+	SocketPolicy::CreateWorkerThread(SslSocket_CleanupThread, this);
 }
 
 /* Private Members: Initialization And R/W Management */
 
-bool SslSocket::InitializeServerSSL()
+void SslSocket::InitializeIo()
+{
+	// Write retries may come from the queue instead of the caller's buffer
+	SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SocketPolicy::setNonBlocking(SSL_get_fd(ssl), true);
+}
+
+int SslSocket::WriteRecords(const char* data, size_t dataSize, size_t* written)
 {
-	method = (SSL_METHOD*)TLS_server_method();
-	ctx = SSL_CTX_new(method);
-	if (ctx == NULL)
+	*written = 0;
+	while (*written < dataSize)
 	{
-		ERR_print_errors_fp(stderr);
-		return false;
+		size_t recordSize = _bytesSinceIdle < SSLSOCKET_RECORD_BOOST_BYTES ? SSLSOCKET_RECORD_SIZE_SMALL : SSLSOCKET_RECORD_SIZE_LARGE;
+		size_t len = _retryLen ? _retryLen : (dataSize - *written < recordSize ? dataSize - *written : recordSize);
+		int ret = SSL_write(ssl, data + *written, (int)len);
+		if (ret <= 0)
+		{
+			int error = SSL_get_error(ssl, ret);
+			if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)
+			{
+				_retryLen = len;
+				return 0;
+			}
+			return -1;
+		}
+
+		_retryLen = 0;
+		*written += ret;
+		_bytesSinceIdle += ret;
 	}
 
+	return 1;
+}
+
+int SslSocket::FlushWrites()
+{
+	if (_writeFailed)
+		return -1;
+
+	// Held back data only goes out in full records
+	size_t flushable = _writeQueueLen;
+	if (_corked && !_retryLen)
+	{
+		size_t recordSize = _bytesSinceIdle < SSLSOCKET_RECORD_BOOST_BYTES ? SSLSOCKET_RECORD_SIZE_SMALL : SSLSOCKET_RECORD_SIZE_LARGE;
+		flushable -= flushable % recordSize;
+	}
+
+	size_t written = 0;
+	int result = WriteRecords(_writeQueue + _writeQueueHead, flushable, &written);
+	_writeQueueHead += written;
+	_writeQueueLen -= written;
+	if (_writeQueueLen == 0)
+		_writeQueueHead = 0;
+	if (result < 0)
+		_writeFailed = true;
+
+	return result;
+}
+
+bool SslSocket::AppendWriteQueue(const char* data, size_t dataSize)
+{
+	if (_writeQueueHead + _writeQueueLen + dataSize > _writeQueueCapacity)
+	{
+		// Reuse the space in front of the queue before growing it, a pending retry tolerates the move
+		if (_writeQueueHead > 0)
+		{
+			memmove(_writeQueue, _writeQueue + _writeQueueHead, _writeQueueLen);
+			_writeQueueHead = 0;
+		}
+		if (_writeQueueLen + dataSize > _writeQueueCapacity)
+		{
+			size_t capacity = _writeQueueCapacity ? _writeQueueCapacity : SSLSOCKET_RECORD_SIZE_LARGE;
+			while (capacity < _writeQueueLen + dataSize)
+				capacity *= 2;
+			char* grown = (char*)realloc(_writeQueue, capacity);
+			if (!grown)
+				return false;
+			_writeQueue = grown;
+			_writeQueueCapacity = capacity;
+		}
+	}
+
+	// memmove: the queue isn't a Heap::DbgMalloc block, so it must bypass the checked memcpy
+	memmove(_writeQueue + _writeQueueHead + _writeQueueLen, data, dataSize);
+	_writeQueueLen += dataSize;
+	return true;
+}
+
+bool SslSocket::ResumeWrites()
+{
+	std::lock_guard<std::mutex> guard(_sslLock);
+	if (FlushWrites() == 0)
+		return false;
+
+	_writeScheduled = false;
+	return true;
+}
+
+void SslSocket::WaitWritable(int timeoutMs)
+{
+	pollfd pfd;
+	pfd.fd = SSL_get_fd(ssl);
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	SocketPolicy::PollSockets(&pfd, 1, timeoutMs);
+}
+
+bool SslSocket::InitializeServerSSL()
+{
+	if (!_context)
+		_context = SslContext::CreateServer();
+	if (!_context || !_context->isServer())
+		return false;
+
+	ctx = _context->getNativeContext();
 	return true;
 }
 
 bool SslSocket::InitializeClientSSL()
 {
-	method = (SSL_METHOD*)TLS_client_method();
-	ctx = SSL_CTX_new(method);
-	if (ctx == NULL)
-	{
-		ERR_print_errors_fp(stderr);
+	// The session store is attached to every client context, sessions are only looked up and stored when _sessionReuse is set
+	if (!_context)
+		_context = SslContext::CreateClient();
+	if (!_context || _context->isServer())
 		return false;
-	}
 
+	ctx = _context->getNativeContext();
+	_sslInit = true;
 	return true;
 }
 
@@ -401,13 +757,54 @@ int SslSocket::PerformConnect(char* addr, char* port)
 
 	ssl = SSL_new(ctx);
 	SSL_set_fd(ssl, _sock);
+	if (_ktls)
+		SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+	if (_lowMemory)
+		SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+
+	// SNI for host names, it is also part of the session store key. The certificate has to match the host name or the
+	// address, otherwise a verifying context would accept a trusted certificate issued for any name
+	char* serverName = 0;
+	unsigned char addrBuffer[16];
+	if (inet_pton(AF_INET, addr, addrBuffer) != 1 && inet_pton(AF_INET6, addr, addrBuffer) != 1)
+	{
+		SSL_set_tlsext_host_name(ssl, addr);
+		SSL_set1_host(ssl, addr);
+		serverName = addr;
+	}
+	else
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), addr);
+	if (_sessionReuse)
+		SslClientSessionStore::Global()->Prepare(ssl, addr, port, serverName, _context->getSessionPolicy());
+
+	bool earlyDataSent = false;
+	if (_earlyData && SSL_get_session(ssl) && SSL_SESSION_get_max_early_data(SSL_get_session(ssl)) >= _earlyDataLen)
+	{
+		size_t written = 0;
+		earlyDataSent = SSL_write_early_data(ssl, _earlyData, _earlyDataLen, &written) == 1 && written == _earlyDataLen;
+	}
+
 	int ret = SSL_connect(ssl);
 	if (ret <= 0)
 	{
+		_earlyData = 0;
 		ret = SSL_get_error(ssl, ret);
 		return ret;
 	}
 
+	if (_sessionReuse)
+		SslClientSessionStore::Global()->HandshakeDone(ssl);
+
+	if (_earlyData)
+	{
+		// OpenSSL doesn't replay rejected early data, send it again as normal application data
+		_earlyDataAccepted = earlyDataSent && SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED;
+		bool written = _earlyDataAccepted || SSL_write(ssl, _earlyData, (int)_earlyDataLen) > 0;
+		_earlyData = 0;
+		if (!written)
+			return SSLSOCKET_SSL_CONNECT_FAILED;
+	}
+
 	return SSLSOCKET_SUCCESS;
 }
 
@@ -451,10 +848,35 @@ DWORD SslSocket::SslSocketCleanup()
 		TerminateThread(_hAcceptLoop, 0);
 	if (_hReadLoop != INVALID_HANDLE_VALUE && _hReadLoop)
 		TerminateThread(_hReadLoop, 0);
+	// Closes the connections still in the handshake
+	if (_handshakePool)
+	{
+		delete _handshakePool;
+		_handshakePool = 0;
+	}
 
+	// Only sockets that ever queued data can be known to the scheduler
+	if (_writeQueue)
+	{
+		SslWriteScheduler::Global()->Cancel(this);
+		free(_writeQueue);
+		_writeQueue = 0;
+	}
 	if (ssl)
+	{
+		// SSL_free removes the session from the cache unless the connection was shut down, which would end
+		// session id resumption together with the connection. After a fatal error OpenSSL has removed it already
+		// and a shutdown is not allowed
+		if (!_readFailed && !_writeFailed)
+			SSL_shutdown(ssl);
 		SSL_free(ssl);
-	SSL_CTX_free(ctx);
+	}
+	// Accepted sockets don't hold a context reference, their SSL keeps the listener's context alive
+	if (_context)
+	{
+		_context->Release();
+		_context = 0;
+	}
 	if(_isServer)
 		closesocket(_sock);
 
@@ -468,73 +890,112 @@ DWORD SslSocket::AcceptLoop()
 {
 	while (!_socketClosed)
 	{
-		sockaddr_in* clientAddr = (sockaddr_in*)malloc(sizeof sockaddr_in);
-		ZeroMemory(clientAddr, sizeof sockaddr_in);
+		sockaddr_in clientAddr;
+		ZeroMemory(&clientAddr, sizeof(sockaddr_in));
 		int len = sizeof(sockaddr_in);
-		SOCKET client = accept(_sock, (sockaddr*)clientAddr, &len);
-		if (client != SOCKET_ERROR)
-		{
-			SSLCLIENT_CONNECTION_DATA* ccd = (SSLCLIENT_CONNECTION_DATA*)malloc(sizeof SSLCLIENT_CONNECTION_DATA);
-			ZeroMemory(ccd, sizeof SSLCLIENT_CONNECTION_DATA);
+		SOCKET client = accept(_sock, (sockaddr*)&clientAddr, &len);
+		if (client == SOCKET_ERROR)
+			continue;
 
-			ccd->clSsl = SSL_new(ctx);
-			SSL_set_fd(ccd->clSsl, client);
-			if (SSL_accept(ccd->clSsl) <= 0) // TODO: Timeout for SSL_accept
-			{
-				SSL_free(ccd->clSsl);
-				closesocket(client); // TODO: ssl error callback
-			}
-			else
-			{
-				ccd->socket = client;
-				inet_ntop(clientAddr->sin_family, &clientAddr->sin_addr, ccd->ipAddress, 46);
-				ccd->clPort = htons((u_short)clientAddr->sin_port);
-				ccd->listenPort = _port;
-				ccd->instance = _dataPointers ? _dataPointers : 0;
-
-				Heap::DbgHeapCheck(ccd, sizeof SSLCLIENT_CONNECTION_DATA);
-				if (callbackType == 0)
-					CreateThread(0, 0, (LPTHREAD_START_ROUTINE)_newConCallback, ccd, 0, 0);
-				else
-					CreateThread(0, 0, (LPTHREAD_START_ROUTINE)_newConMemberCallback, ccd, 0, 0);
-			}
+		// The handshake runs on the pool, this thread only accepts
+		SSL* clSsl = SSL_new(ctx);
+		if (!clSsl)
+		{
+			closesocket(client);
+			continue;
+		}
+		SSL_set_fd(clSsl, client);
+		if (_ktls)
+			SSL_set_options(clSsl, SSL_OP_ENABLE_KTLS);
+		if (_lowMemory)
+			SSL_set_mode(clSsl, SSL_MODE_RELEASE_BUFFERS);
+		if (!_handshakePool->Submit(clSsl, client, &clientAddr))
+		{
+			SSL_free(clSsl);
+			closesocket(client); // TODO: ssl error callback
 		}
-		Heap::DbgHeapCheck(clientAddr, sizeof sockaddr_in);
-		free(clientAddr);
 	}
 
 	return 0;
 }
 
+void SslSocket::DispatchConnection(SSL* clSsl, SOCKET client, sockaddr_in* clientAddr)
+{
+	SSLCLIENT_CONNECTION_DATA* ccd = (SSLCLIENT_CONNECTION_DATA*)malloc(sizeof SSLCLIENT_CONNECTION_DATA);
+	ZeroMemory(ccd, sizeof SSLCLIENT_CONNECTION_DATA);
+
+	ccd->clSsl = clSsl;
+	ccd->socket = client;
+	inet_ntop(clientAddr->sin_family, &clientAddr->sin_addr, ccd->ipAddress, 46);
+	ccd->clPort = htons((u_short)clientAddr->sin_port);
+	ccd->listenPort = _port;
+	ccd->instance = _dataPointers ? _dataPointers : 0;
+
+	Heap::DbgHeapCheck(ccd, sizeof SSLCLIENT_CONNECTION_DATA);
+	if (callbackType == 0)
+		SocketPolicy::CreateWorkerThread((LPTHREAD_START_ROUTINE)_newConCallback, ccd);
+	else
+		SocketPolicy::CreateWorkerThread((LPTHREAD_START_ROUTINE)_newConMemberCallback, ccd);
+}
+
 DWORD SslSocket::ReadLoop()
 {
+	bool steered = false;
+
 	while (!_socketClosed)
 	{
-		char* buffer = (char*)malloc(65536);
-		ZeroMemory(buffer, 65536);
+		if (!SSL_has_pending(ssl))
+		{
+			// Wait outside of _sslLock so writers can use the connection, idle connections also hold no read buffer.
+			// A closed or failed socket wakes the poll as well and SSL_read reports it
+			pollfd pfd;
+			pfd.fd = SSL_get_fd(ssl);
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			SocketPolicy::PollSockets(&pfd, 1, -1);
+		}
+
+		int buffAllocType = 0;
+		char* buffer = SocketPolicy::AllocReadBuffer(_readBufSize, &buffAllocType);
 		if (!buffer)
 		{
 			perror("Heap allocation failed!\n");
 			continue;
 		}
-		int len = SSL_read(ssl, buffer, 65536);
+		int len, error = SSL_ERROR_NONE;
+		{
+			std::lock_guard<std::mutex> guard(_sslLock);
+			len = SSL_read(ssl, buffer, _readBufSize);
+			if (len <= 0)
+				error = SSL_get_error(ssl, len);
+		}
 		if (len > 0)
 		{
+			// The incoming CPU is only known once data arrived
+			if (!steered)
+			{
+				SocketPolicy::SteerToIncomingCpu(SSL_get_fd(ssl));
+				steered = true;
+			}
+
 			DATA_RECEVIED_CALLBACK_DATA* drcd = (DATA_RECEVIED_CALLBACK_DATA*)malloc(sizeof DATA_RECEVIED_CALLBACK_DATA);
 			drcd->socket = this;
 			drcd->buff = buffer;
+			drcd->buffAllocType = buffAllocType;
 			drcd->len = len;
 			drcd->dataPointers = 0;
 			if (callbackType != 0)
 				drcd->dataPointers = _dataPointers;
 			Heap::DbgHeapCheck(drcd, sizeof DATA_RECEVIED_CALLBACK_DATA);
-			CreateThread(0, 0, CallbackDRCV_ThreadCall, drcd, 0, 0);
+			SocketPolicy::CreateWorkerThread(CallbackDRCV_ThreadCall, drcd);
 		}
 		else
 		{
-			int error = SSL_get_error(ssl, len);
-			if (error == SSL_ERROR_ZERO_RETURN || error == SSL_ERROR_SYSCALL)
+			SocketPolicy::FreeReadBuffer(buffer, buffAllocType);
+			// The record wasn't complete yet, anything else ends the connection
+			if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
 			{
+				_readFailed = error == SSL_ERROR_SSL || error == SSL_ERROR_SYSCALL;
 				CONNECTION_CLOSED_CALLBACK_DATA* ccd = (CONNECTION_CLOSED_CALLBACK_DATA*)malloc(sizeof CONNECTION_CLOSED_CALLBACK_DATA);
 				ccd->socket = this;
 				ccd->ip = getAddress();
@@ -543,7 +1004,7 @@ DWORD SslSocket::ReadLoop()
 				if(callbackType != 0)
 					ccd->dataPointers = _dataPointers;
 				Heap::DbgHeapCheck(ccd, sizeof CONNECTION_CLOSED_CALLBACK_DATA);
-				CreateThread(0, 0, CallbackCCLSD_ThreadCall, ccd, 0, 0);
+				SocketPolicy::CreateWorkerThread(CallbackCCLSD_ThreadCall, ccd);
 
 				_socketClosed = true;
 			}
@@ -42,6 +42,16 @@
 
 class SslSocket;
 
+#define SSLSOCKET_SENDFILE_CHUNK 65536
+
+// Dynamic record sizing: records fit one TCP segment at the start of a burst for time to first byte,
+// and grow to the TLS maximum once SSLSOCKET_RECORD_BOOST_BYTES were sent without an idle gap
+#define SSLSOCKET_RECORD_SIZE_SMALL 1360
+#define SSLSOCKET_RECORD_SIZE_LARGE 16384
+#define SSLSOCKET_RECORD_BOOST_BYTES (1024 * 1024)
+#define SSLSOCKET_RECORD_IDLE_RESET_MS 1000
+#define SSLSOCKET_MAX_WRITE_QUEUE (64 * 1024 * 1024)
+
 #define SSLSOCKET_SUCCESS 1
 #define SSLSOCKET_LISTEN_FAILED -1
 #define SSLSOCKET_CONNECT_FAILED -2
@@ -86,11 +96,22 @@ public:
 
 	/* Create the socket */
 	PRIMESOCKET_API SslSocket();
+	// Listen or Connect with a shared context, the socket holds a reference to it until Cleanup
+	PRIMESOCKET_API SslSocket(SslContext* context);
 	PRIMESOCKET_API SslSocket(SSL* clSsl, int clientPort, SSLDATA_RECEIVED_CALLBACK dataRecvCallback, SSLCONNECTION_CLOSED_CALLBACK connClosedCallback, int readBufferSize = 65536);
 	PRIMESOCKET_API SslSocket(SSL* clSsl, int clientPort, SSLDATA_RECEIVED_MEMBER_CALLBACK dataRecvCallback, SSLCONNECTION_CLOSED_MEMBER_CALLBACK connectionClosedCallback, void* dataPointers, int readBufferSize = 65536);
 
+	// Builds a context owned by this socket, use SslContext directly to share one certificate between listeners
 	PRIMESOCKET_API int setServerCertificate(char* CertFile, char* KeyFile);
+	// Server side session resumption (session cache and session tickets) on the socket context, call after setServerCertificate and before Listen
+	PRIMESOCKET_API int enableSessionResumption(size_t cacheSize = SSL_SESSION_CACHE_DEFAULT_SIZE, DWORD ticketKeyLifetime = SSL_TICKET_KEY_DEFAULT_LIFETIME);
+	PRIMESOCKET_API bool getSessionCacheStats(SSL_SESSION_CACHE_STATS* stats);
 	PRIMESOCKET_API static SSL_CERTIFICATE_DATA* getCertificateData(SSL* clSsl);
+	// Handshakes of accepted connections run on a pool of workerCount threads (0 = one per processor),
+	// connections that don't complete the handshake within deadlineMs are closed. With cryptoWorkers the
+	// handshake steps, including the private key signature, run on that many separate threads. Call before Listen
+	PRIMESOCKET_API bool setHandshakeWorkers(int workerCount, DWORD deadlineMs = SSL_HANDSHAKE_DEFAULT_DEADLINE_MS, int cryptoWorkers = 0);
+	PRIMESOCKET_API bool getHandshakeStats(SSL_HANDSHAKE_STATS* stats);
 	
 	// Connect to specified host and become a client
 	PRIMESOCKET_API int Connect(char* addr, char* port, SSLDATA_RECEIVED_CALLBACK dataRecvCallback, SSLCONNECTION_CLOSED_CALLBACK connectionClosedCallback);
@@ -106,18 +127,47 @@ public:
 	// Set the read buffer size, only data equal or less than this value will be readed from the socket (65536 is the default value)
 	PRIMESOCKET_API bool setReadBufferSize(int size = 65536);
 
-	PRIMESOCKET_API bool Write(void* data, size_t dataSize);
+	// Low-footprint mode for many mostly idle connections, call before Listen/Connect (accepted connections inherit it).
+	// OpenSSL releases its record buffers when they are empty (SSL_MODE_RELEASE_BUFFERS)
+	PRIMESOCKET_API bool setLowMemoryMode(bool enable);
+
+	// Never blocks: what the socket can't take right away is queued and sent by SslWriteScheduler once it is writable.
+	// moreData holds the data back until a full record is queued or a Write without it follows (like MSG_MORE).
+	// Returns false if the connection failed or the queue would exceed SSLSOCKET_MAX_WRITE_QUEUE
+	PRIMESOCKET_API bool Write(void* data, size_t dataSize, bool moreData = false);
+	// Send held back data and wait until the write queue is empty, returns false on error or timeout
+	PRIMESOCKET_API bool Flush(DWORD timeoutMs = INFINITE);
+	PRIMESOCKET_API size_t getQueuedBytes();
 	//PRIMESOCKET_API bool Write(SSL* clSsl, void* data, size_t dataSize);
 
+	// Client session resumption through the process wide SslClientSessionStore, enabled by default, call before Connect
+	PRIMESOCKET_API bool setSessionReuse(bool enable);
+	PRIMESOCKET_API bool isSessionReused();
+	// Idempotent data for the next Connect, sent as TLS 1.3 early data when the stored session allows it and
+	// written right after the handshake otherwise (or when the server rejects it). The buffer must stay valid until Connect returns
+	PRIMESOCKET_API bool setEarlyData(void* data, size_t dataSize);
+	PRIMESOCKET_API bool isEarlyDataAccepted();
+
+	// Kernel TLS offload for this socket and the connections it accepts, call before Listen/Connect. Once the handshake completes record encryption
+	// moves into the kernel when it supports the negotiated cipher, otherwise OpenSSL keeps doing it in user space
+	PRIMESOCKET_API bool setKernelTls(bool enable);
+	PRIMESOCKET_API bool isKernelTlsActive(bool* sendOffloaded, bool* recvOffloaded);
+	// Send size bytes of the file starting at offset, returns the number of bytes sent or -1 on error. The file position is left unchanged.
+	// Uses sendfile through kTLS when the send path is offloaded, otherwise the file is read and written in chunks
+	PRIMESOCKET_API long long SendFile(int fileDescriptor, long long offset, size_t size);
+
 	PRIMESOCKET_API void Cleanup();
 
 private:
+	friend class SslWriteScheduler;
+
 	typedef struct
 	{
 		SslSocket* socket;
 		char* buff;
 		size_t len;
 		void* dataPointers;
+		int buffAllocType;
 	}DATA_RECEVIED_CALLBACK_DATA;
 	typedef struct
 	{
@@ -128,7 +178,7 @@ private:
 	}CONNECTION_CLOSED_CALLBACK_DATA;
 
 
-	SSL_METHOD* method;
+	SslContext* _context;
 	SSL_CTX* ctx;
 	SSL* ssl;
 
@@ -143,10 +193,20 @@ private:
 	int callbackType;
 	void* _dataPointers;
 
+	void InitializeMembers();
 	bool InitializeServerSSL();
 	bool InitializeClientSSL();
 	int PerformConnect(char* addr, char* port);
 	int PerformListen(char* addr, char* port);
+	void InitializeIo();
+
+	// Write helpers, called with _sslLock held. Return 1 when done, 0 when the socket is full and -1 on error
+	int WriteRecords(const char* data, size_t dataSize, size_t* written);
+	int FlushWrites();
+	bool AppendWriteQueue(const char* data, size_t dataSize);
+	// Called by SslWriteScheduler once the socket is writable, returns true when it no longer needs to wait
+	bool ResumeWrites();
+	void WaitWritable(int timeoutMs);
 
 	static DWORD WINAPI SslSocket_CleanupThread(LPVOID param)
 	{
@@ -164,6 +224,12 @@ private:
 	}
 	DWORD AcceptLoop();
 
+	static void HandshakeDone_Callback(SSL* clSsl, SOCKET client, sockaddr_in* clientAddr, void* context)
+	{
+		((SslSocket*)context)->DispatchConnection(clSsl, client, clientAddr);
+	}
+	void DispatchConnection(SSL* clSsl, SOCKET client, sockaddr_in* clientAddr);
+
 	static DWORD WINAPI ReadLoop_ThreadCall(LPVOID param)
 	{
 		SslSocket* _instance = (SslSocket*)param;
@@ -180,7 +246,7 @@ private:
 			drcd->socket->_dataReceivedCallback(drcd->socket, drcd->buff, drcd->len);
 		else
 			drcd->socket->_dataReceivedMemberCallback(drcd->socket, drcd->buff, drcd->len, drcd->dataPointers);
-		free(drcd->buff);
+		SocketPolicy::FreeReadBuffer(drcd->buff, drcd->buffAllocType);
 		free(drcd);
 		return 0;
 	}
@@ -207,5 +273,23 @@ private:
 	int _readBufSize;
 
 	bool _mnRead;
+	bool _ktls;
+	bool _lowMemory;
+	bool _sessionReuse, _earlyDataAccepted;
+	void* _earlyData;
+	size_t _earlyDataLen;
+	SslHandshakePool* _handshakePool;
+	int _handshakeWorkers, _cryptoWorkers;
+	DWORD _handshakeDeadline;
+
+	// The read loop and writers share the SSL object, the socket is non-blocking so the lock is never held while waiting
+	std::mutex _sslLock;
+	char* _writeQueue;
+	size_t _writeQueueHead, _writeQueueLen, _writeQueueCapacity;
+	size_t _retryLen; // Length of the SSL_write that ran into a full socket, OpenSSL requires the retry to repeat it
+	bool _corked, _writeScheduled, _writeFailed;
+	bool _readFailed; // SSL_read failed with a fatal error, the connection must not be shut down cleanly
+	unsigned long long _bytesSinceIdle;
+	ULONGLONG _lastWriteTick;
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,116 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#define PRIMESOCKET_USE_SSL
+#include "PrimeSocket.h"
+
+SslWriteScheduler* SslWriteScheduler::Global()
+{
+	static SslWriteScheduler* scheduler = new SslWriteScheduler();
+	return scheduler;
+}
+
+SslWriteScheduler::SslWriteScheduler()
+{
+	_wakeSocket = SocketPolicy::CreateWakeSocket(&_wakeAddress);
+	_thread = SocketPolicy::CreateIoThread(Scheduler_ThreadCall, this);
+}
+
+void SslWriteScheduler::Schedule(SslSocket* socket)
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_sockets[socket] = SSL_get_fd(socket->ssl);
+	}
+	SocketPolicy::SignalWakeSocket(_wakeSocket, &_wakeAddress);
+}
+
+void SslWriteScheduler::Cancel(SslSocket* socket)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_sockets.erase(socket);
+}
+
+DWORD SslWriteScheduler::SchedulerLoop()
+{
+	SslSocket** sockets = 0;
+	pollfd* fds = 0;
+	size_t capacity = 0;
+
+	while (true)
+	{
+		size_t count = 1;
+		{
+			std::lock_guard<std::mutex> guard(_lock);
+			if (_sockets.size() + 1 > capacity)
+			{
+				size_t grownCapacity = capacity ? capacity : 64;
+				while (grownCapacity < _sockets.size() + 1)
+					grownCapacity *= 2;
+				SslSocket** grownSockets = (SslSocket**)realloc(sockets, grownCapacity * sizeof(SslSocket*));
+				if (grownSockets)
+					sockets = grownSockets;
+				pollfd* grownFds = (pollfd*)realloc(fds, grownCapacity * sizeof(pollfd));
+				if (grownFds)
+					fds = grownFds;
+				if (grownSockets && grownFds)
+					capacity = grownCapacity;
+			}
+
+			for (std::unordered_map<SslSocket*, SOCKET>::iterator it = _sockets.begin(); it != _sockets.end() && count < capacity; ++it)
+			{
+				sockets[count] = it->first;
+				fds[count].fd = it->second;
+				fds[count].events = POLLOUT;
+				fds[count].revents = 0;
+				count++;
+			}
+		}
+		if (!fds)
+		{
+			Sleep(SSL_WRITE_SCHEDULER_POLL_INTERVAL_MS);
+			continue;
+		}
+
+		fds[0].fd = _wakeSocket;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		if (_wakeSocket == INVALID_SOCKET)
+			SocketPolicy::PollSockets(fds + 1, (ULONG)(count - 1), SSL_WRITE_SCHEDULER_POLL_INTERVAL_MS);
+		else if (SocketPolicy::PollSockets(fds, (ULONG)count, SSL_WRITE_SCHEDULER_POLL_INTERVAL_MS) > 0 && fds[0].revents != 0)
+			SocketPolicy::DrainWakeSocket(_wakeSocket);
+
+		std::lock_guard<std::mutex> guard(_lock);
+		for (size_t i = 1; i < count; i++)
+		{
+			// Skip sockets cancelled while the lock was released
+			if (fds[i].revents == 0 || _sockets.find(sockets[i]) == _sockets.end())
+				continue;
+			if (sockets[i]->ResumeWrites())
+				_sockets.erase(sockets[i]);
+		}
+	}
+
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,56 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#ifdef PRIMESOCKET_USE_SSL
+#define SSL_WRITE_SCHEDULER_POLL_INTERVAL_MS 100
+
+// One process wide thread that resumes queued SslSocket writes once their socket becomes writable,
+// a slow reader then costs a poll entry instead of a spinning writer
+class SslWriteScheduler
+{
+public:
+	PRIMESOCKET_API static SslWriteScheduler* Global();
+
+	PRIMESOCKET_API void Schedule(SslSocket* socket);
+	// Once Cancel returns the scheduler no longer touches the socket
+	PRIMESOCKET_API void Cancel(SslSocket* socket);
+
+private:
+	SslWriteScheduler();
+
+	static DWORD WINAPI Scheduler_ThreadCall(LPVOID param)
+	{
+		SslWriteScheduler* _instance = (SslWriteScheduler*)param;
+		return _instance->SchedulerLoop();
+	}
+	DWORD SchedulerLoop();
+
+	std::mutex _lock;
+	std::unordered_map<SslSocket*, SOCKET> _sockets;
+	HANDLE _thread;
+	SOCKET _wakeSocket;
+	sockaddr_in _wakeAddress;
+};
+#endif
\ No newline at end of file
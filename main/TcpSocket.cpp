@@ -40,6 +40,22 @@ char* Safe_Alloc(int size, int* allocType = 0)
 	return buffer;
 }
 
+void TcpSocket::InitializeMembers()
+{
+	ZeroMemory(&_busyPoll, sizeof(BUSY_POLL_POLICY));
+	_busyPollVersion = 1;
+	ZeroMemory(&_tuning, sizeof(SOCKET_TUNING));
+	ZeroMemory(&_zcStats, sizeof(ZEROCOPY_STATS));
+	_zeroCopy = false;
+	_zcThreshold = ZEROCOPY_DEFAULT_THRESHOLD;
+	_zcRing = 0;
+	_zcHead = 0;
+	_zcCount = 0;
+	_zcNextSequence = 0;
+	_receiveTimestamps = false;
+	_hardwareTimestamps = false;
+}
+
 TcpSocket::TcpSocket()
 {
 	classValid = true;
@@ -50,6 +66,7 @@ TcpSocket::TcpSocket()
 	_ai_socktype = SOCK_STREAM;
 	_ai_protocol = IPPROTO_TCP;
 	_readBufSize = 65536;
+	InitializeMembers();
 
 	_hAcceptLoop = INVALID_HANDLE_VALUE;
 	_hReadLoop = INVALID_HANDLE_VALUE;
@@ -68,6 +85,7 @@ TcpSocket::TcpSocket(SOCKET client, int clientPort, DATA_RECEIVED_CALLBACK dataR
 	_ai_socktype = SOCK_STREAM;
 	_ai_protocol = IPPROTO_TCP;
 	_readBufSize = readBufferSize;
+	InitializeMembers();
 
 	_sock = client;
 	_port = clientPort;
@@ -75,7 +93,7 @@ TcpSocket::TcpSocket(SOCKET client, int clientPort, DATA_RECEIVED_CALLBACK dataR
 	_connClosedCallback = connClosedCallback;
 
 	callbackType = 0;
-	_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+	_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 }
 
 TcpSocket::TcpSocket(SOCKET client, int clientPort, DATA_RECEIVED_MEMBER_CALLBACK dataRecvCallback, CONNECTION_CLOSED_MEMBER_CALLBACK connectionClosedCallback, void* dataPointers, int readBufferSize)
@@ -91,6 +109,7 @@ TcpSocket::TcpSocket(SOCKET client, int clientPort, DATA_RECEIVED_MEMBER_CALLBAC
 	_ai_socktype = SOCK_STREAM;
 	_ai_protocol = IPPROTO_TCP;
 	_readBufSize = readBufferSize;
+	InitializeMembers();
 
 	_sock = client;
 	_port = clientPort;
@@ -99,7 +118,7 @@ TcpSocket::TcpSocket(SOCKET client, int clientPort, DATA_RECEIVED_MEMBER_CALLBAC
 
 	callbackType = 1;
 	_dataPointers = dataPointers;
-	_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+	_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 }
 
 bool TcpSocket::Connect(char* addr, char* port, DATA_RECEIVED_CALLBACK dataRecvCallback, CONNECTION_CLOSED_CALLBACK connectionClosedCallback)
@@ -128,6 +147,11 @@ bool TcpSocket::Connect(char* addr, char* port, DATA_RECEIVED_CALLBACK dataRecvC
 		return false;
 	}
 
+	if (_tuning.profile != ProfileNone)
+		ApplyTuning(_sock, &_tuning, TUNING_ROLE_CLIENT);
+	if (_receiveTimestamps)
+		SocketPolicy::EnableReceiveTimestamps(_sock, true, _hardwareTimestamps);
+
 	if (connect(_sock, result->ai_addr, result->ai_addrlen) == SOCKET_ERROR)
 		return false;
 
@@ -138,7 +162,7 @@ bool TcpSocket::Connect(char* addr, char* port, DATA_RECEIVED_CALLBACK dataRecvC
 	{
 		_dataReceivedCallback = dataRecvCallback;
 		_connClosedCallback = connectionClosedCallback;
-		_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+		_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 	}
 
 	return true;
@@ -170,6 +194,11 @@ bool TcpSocket::Connect(char* addr, char* port, DATA_RECEIVED_MEMBER_CALLBACK da
 		return false;
 	}
 
+	if (_tuning.profile != ProfileNone)
+		ApplyTuning(_sock, &_tuning, TUNING_ROLE_CLIENT);
+	if (_receiveTimestamps)
+		SocketPolicy::EnableReceiveTimestamps(_sock, true, _hardwareTimestamps);
+
 	if (connect(_sock, result->ai_addr, result->ai_addrlen) == SOCKET_ERROR)
 		return false;
 
@@ -183,7 +212,7 @@ bool TcpSocket::Connect(char* addr, char* port, DATA_RECEIVED_MEMBER_CALLBACK da
 	{
 		_dataReceivedMemberCallback = dataRecvCallback;
 		_connClosedMemberCallback = connectionClosedCallback;
-		_hReadLoop = CreateThread(0, 0, ReadLoop_ThreadCall, this, 0, 0);
+		_hReadLoop = SocketPolicy::CreateIoThread(ReadLoop_ThreadCall, this);
 	}
 
 	return true;
@@ -216,6 +245,11 @@ bool TcpSocket::Listen(char* addr, char* port, NEW_CONNECTION_CALLBACK newConnCa
 		return false;
     }
 
+	if (_tuning.profile != ProfileNone)
+		ApplyTuning(_sock, &_tuning, TUNING_ROLE_LISTENER);
+	if (_receiveTimestamps)
+		SocketPolicy::EnableReceiveTimestamps(_sock, true, _hardwareTimestamps);
+
     iResult = bind(_sock, result->ai_addr, (int)result->ai_addrlen);
     if (iResult == SOCKET_ERROR) {
 		return false;
@@ -230,7 +264,7 @@ bool TcpSocket::Listen(char* addr, char* port, NEW_CONNECTION_CALLBACK newConnCa
 	_init = true;
 	_newConCallback = newConnCallback;
 	sscanf(port, "%d", &_port);
-	_hAcceptLoop = CreateThread(0, 0, AcceptLoop_ThreadCall, this, 0, 0);
+	_hAcceptLoop = SocketPolicy::CreateIoThread(AcceptLoop_ThreadCall, this);
 }
 
 bool TcpSocket::Listen(char* addr, char* port, NEW_CONNECTION_MEMBER_CALLBACK newConnCallback, void* dataPointers)
@@ -260,6 +294,11 @@ bool TcpSocket::Listen(char* addr, char* port, NEW_CONNECTION_MEMBER_CALLBACK ne
 		return false;
 	}
 
+	if (_tuning.profile != ProfileNone)
+		ApplyTuning(_sock, &_tuning, TUNING_ROLE_LISTENER);
+	if (_receiveTimestamps)
+		SocketPolicy::EnableReceiveTimestamps(_sock, true, _hardwareTimestamps);
+
 	iResult = bind(_sock, result->ai_addr, (int)result->ai_addrlen);
 	if (iResult == SOCKET_ERROR) {
 		return false;
@@ -277,66 +316,305 @@ bool TcpSocket::Listen(char* addr, char* port, NEW_CONNECTION_MEMBER_CALLBACK ne
 	callbackType = 1;
 	_dataPointers = dataPointers;
 	sscanf(port, "%d", &_port);
-	_hAcceptLoop = CreateThread(0, 0, AcceptLoop_ThreadCall, this, 0, 0);
+	_hAcceptLoop = SocketPolicy::CreateIoThread(AcceptLoop_ThreadCall, this);
+}
+
+// Maps an option to its setsockopt level and name, false when the platform has no equivalent
+static bool TcpOptionLevelName(TcpSocket::SOCKETOPT opt, int* level, int* name)
+{
+	switch (opt)
+	{
+	case TcpSocket::NoDelay:
+		*level = IPPROTO_TCP;
+		*name = TCP_NODELAY;
+		return true;
+	case TcpSocket::KeepAlive:
+		*level = SOL_SOCKET;
+		*name = SO_KEEPALIVE;
+		return true;
+	case TcpSocket::RecvTimeout:
+		*level = SOL_SOCKET;
+		*name = SO_RCVTIMEO;
+		return true;
+	case TcpSocket::SendTimeout:
+		*level = SOL_SOCKET;
+		*name = SO_SNDTIMEO;
+		return true;
+	case TcpSocket::IpDontFragment:
+		*level = IPPROTO_IP;
+#ifdef IP_DONTFRAGMENT
+		*name = IP_DONTFRAGMENT;
+#else
+		*name = IP_MTU_DISCOVER;
+#endif
+		return true;
+	case TcpSocket::SendBufferSize:
+		*level = SOL_SOCKET;
+		*name = SO_SNDBUF;
+		return true;
+	case TcpSocket::RecvBufferSize:
+		*level = SOL_SOCKET;
+		*name = SO_RCVBUF;
+		return true;
+#ifdef TCP_QUICKACK
+	case TcpSocket::QuickAck:
+		*level = IPPROTO_TCP;
+		*name = TCP_QUICKACK;
+		return true;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+	case TcpSocket::DeferAccept:
+		*level = IPPROTO_TCP;
+		*name = TCP_DEFER_ACCEPT;
+		return true;
+#endif
+#ifdef TCP_FASTOPEN
+	case TcpSocket::FastOpen:
+		*level = IPPROTO_TCP;
+		*name = TCP_FASTOPEN;
+		return true;
+	case TcpSocket::FastOpenConnect:
+		*level = IPPROTO_TCP;
+#ifdef TCP_FASTOPEN_CONNECT
+		*name = TCP_FASTOPEN_CONNECT;
+#else
+		*name = TCP_FASTOPEN;
+#endif
+		return true;
+#endif
+#if defined(TCP_USER_TIMEOUT) || defined(TCP_MAXRT)
+	case TcpSocket::UserTimeout:
+		*level = IPPROTO_TCP;
+#ifdef TCP_USER_TIMEOUT
+		*name = TCP_USER_TIMEOUT;
+#else
+		*name = TCP_MAXRT;
+#endif
+		return true;
+#endif
+#if defined(TCP_KEEPIDLE) || defined(TCP_KEEPALIVE)
+	case TcpSocket::KeepAliveIdle:
+		*level = IPPROTO_TCP;
+#ifdef TCP_KEEPIDLE
+		*name = TCP_KEEPIDLE;
+#else
+		*name = TCP_KEEPALIVE;
+#endif
+		return true;
+#endif
+#ifdef TCP_KEEPINTVL
+	case TcpSocket::KeepAliveInterval:
+		*level = IPPROTO_TCP;
+		*name = TCP_KEEPINTVL;
+		return true;
+#endif
+#ifdef TCP_KEEPCNT
+	case TcpSocket::KeepAliveCount:
+		*level = IPPROTO_TCP;
+		*name = TCP_KEEPCNT;
+		return true;
+#endif
+#ifdef SO_PRIORITY
+	case TcpSocket::Priority:
+		*level = SOL_SOCKET;
+		*name = SO_PRIORITY;
+		return true;
+#endif
+	default:
+		break;
+	}
+
+	return false;
 }
 
 bool TcpSocket::setSocketOption(SOCKETOPT opt, DWORD value)
 {
-	if (opt == 0 || opt > 4)
+	return setSocketOption(_sock, opt, value);
+}
+
+bool TcpSocket::getSocketOption(SOCKETOPT opt, DWORD* value)
+{
+	return getSocketOption(_sock, opt, value);
+}
+
+bool TcpSocket::setSocketOption(SOCKET sock, SOCKETOPT opt, DWORD value)
+{
+	int level = 0, name = 0;
+	if (!TcpOptionLevelName(opt, &level, &name))
 		return false;
 
-	int result = 0;
 	switch (opt)
 	{
 	case NoDelay:
+	case KeepAlive:
+	case QuickAck:
+	case FastOpenConnect:
 		if (value != TRUE && value != FALSE)
 			return false;
+		break;
+#ifndef _WIN32
+	case RecvTimeout:
+	case SendTimeout:
+	{
+		// Milliseconds on Windows, a timeval everywhere else
+		timeval tv;
+		tv.tv_sec = value / 1000;
+		tv.tv_usec = (value % 1000) * 1000;
+		return setsockopt(sock, level, name, (char*)&tv, sizeof(timeval)) != SOCKET_ERROR;
+	}
+#endif
+#ifndef IP_DONTFRAGMENT
+	case IpDontFragment:
+		value = value ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+		break;
+#endif
+#if !defined(TCP_USER_TIMEOUT) && defined(TCP_MAXRT)
+	case UserTimeout:
+		value = (value + 999) / 1000; // TCP_MAXRT takes seconds
+		break;
+#endif
+	default:
+		break;
+	}
 
-		result = setsockopt(_sock, IPPROTO_TCP, TCP_NODELAY, (char*)&value, sizeof(DWORD));
-		if (result != SOCKET_ERROR)
-			return true;
-		else
-			return false;
+	return setsockopt(sock, level, name, (char*)&value, sizeof(DWORD)) != SOCKET_ERROR;
+}
 
-		break;
-	case KeepAlive:
-		if (value != TRUE && value != FALSE)
-			return false;
+bool TcpSocket::getSocketOption(SOCKET sock, SOCKETOPT opt, DWORD* value)
+{
+	int level = 0, name = 0;
+	if (!value || !TcpOptionLevelName(opt, &level, &name))
+		return false;
 
-		result = setsockopt(_sock, SOL_SOCKET, SO_KEEPALIVE, (char*)&value, sizeof(DWORD));
-		if (result != SOCKET_ERROR)
-			return true;
-		else
+#ifndef _WIN32
+	if (opt == RecvTimeout || opt == SendTimeout)
+	{
+		timeval tv;
+		socklen_t tvLen = sizeof(timeval);
+		if (getsockopt(sock, level, name, (char*)&tv, &tvLen) == SOCKET_ERROR)
 			return false;
 
-		break;
-	case RecvTimeout:
-		result = setsockopt(_sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&value, sizeof(DWORD));
-		if (result != SOCKET_ERROR)
-			return true;
-		else
-			return false;
+		*value = (DWORD)(tv.tv_sec * 1000 + tv.tv_usec / 1000);
+		return true;
+	}
+#endif
 
-		break;
-	case SendTimeout:
-		result = setsockopt(_sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&value, sizeof(DWORD));
-		if (result != SOCKET_ERROR)
-			return true;
-		else
-			return false;
+	DWORD result = 0;
+	socklen_t len = sizeof(DWORD);
+	if (getsockopt(sock, level, name, (char*)&result, &len) == SOCKET_ERROR)
+		return false;
 
-		break;
-	case IpDontFragment:
-		result = setsockopt(_sock, IPPROTO_IP, IP_DONTFRAGMENT, (char*)&value, sizeof(DWORD));
-		if (result != SOCKET_ERROR)
-			return true;
-		else
-			return false;
+#ifndef IP_DONTFRAGMENT
+	if (opt == IpDontFragment)
+		result = result == IP_PMTUDISC_DO ? TRUE : FALSE;
+#endif
+#if !defined(TCP_USER_TIMEOUT) && defined(TCP_MAXRT)
+	if (opt == UserTimeout)
+		result *= 1000;
+#endif
+	*value = result;
+	return true;
+}
 
-		break;
+// Options a profile sets are skipped when the platform doesn't have them, only real failures are reported
+bool TcpSocket::ApplyTuningOption(SOCKET sock, SOCKETOPT opt, DWORD value)
+{
+	int level = 0, name = 0;
+	if (!TcpOptionLevelName(opt, &level, &name))
+		return true;
+
+	return setSocketOption(sock, opt, value);
+}
+
+bool TcpSocket::ApplyTuning(SOCKET sock, SOCKET_TUNING* tuning, int role)
+{
+	bool result = true;
+
+	// Accepted sockets inherit the buffer sizes of the listener, set them before listen/connect so the window scale matches
+	if (role != TUNING_ROLE_ACCEPTED)
+	{
+		if (tuning->sendBufferSize)
+			result = ApplyTuningOption(sock, SendBufferSize, tuning->sendBufferSize) && result;
+		if (tuning->recvBufferSize)
+			result = ApplyTuningOption(sock, RecvBufferSize, tuning->recvBufferSize) && result;
 	}
 
-	return false;
+	if (role == TUNING_ROLE_LISTENER)
+	{
+		if (tuning->deferAcceptSeconds)
+			result = ApplyTuningOption(sock, DeferAccept, tuning->deferAcceptSeconds) && result;
+		if (tuning->fastOpen)
+			result = ApplyTuningOption(sock, FastOpen, tuning->fastOpen) && result;
+		return result;
+	}
+
+	if (role == TUNING_ROLE_CLIENT && tuning->fastOpen)
+		result = ApplyTuningOption(sock, FastOpenConnect, TRUE) && result;
+
+	result = ApplyTuningOption(sock, NoDelay, tuning->noDelay ? TRUE : FALSE) && result;
+	if (tuning->quickAck)
+		result = ApplyTuningOption(sock, QuickAck, TRUE) && result;
+	if (tuning->userTimeoutMs)
+		result = ApplyTuningOption(sock, UserTimeout, tuning->userTimeoutMs) && result;
+	if (tuning->keepAliveIdleSeconds)
+	{
+		result = ApplyTuningOption(sock, KeepAlive, TRUE) && result;
+		result = ApplyTuningOption(sock, KeepAliveIdle, tuning->keepAliveIdleSeconds) && result;
+		if (tuning->keepAliveIntervalSeconds)
+			result = ApplyTuningOption(sock, KeepAliveInterval, tuning->keepAliveIntervalSeconds) && result;
+		if (tuning->keepAliveCount)
+			result = ApplyTuningOption(sock, KeepAliveCount, tuning->keepAliveCount) && result;
+	}
+	if (tuning->priority)
+		result = ApplyTuningOption(sock, Priority, tuning->priority) && result;
+
+	return result;
+}
+
+bool TcpSocket::setTuningProfile(TUNING_PROFILE profile)
+{
+	SOCKET_TUNING tuning;
+	if (!SocketPolicy::getTuningProfile(profile, &tuning) && profile != ProfileNone)
+		return false;
+
+	_tuning = tuning;
+	if (!_init || profile == ProfileNone)
+		return true;
+
+	return ApplyTuning(_sock, &_tuning, _isServer ? TUNING_ROLE_LISTENER : TUNING_ROLE_ACCEPTED);
+}
+
+TUNING_PROFILE TcpSocket::getTuningProfile()
+{
+	return _tuning.profile;
+}
+
+bool TcpSocket::getSocketTuning(SOCKET_TUNING* tuning)
+{
+	if (!tuning || !_init)
+		return false;
+
+	ZeroMemory(tuning, sizeof(SOCKET_TUNING));
+	tuning->profile = _tuning.profile;
+
+	DWORD keepAlive = FALSE;
+	getSocketOption(NoDelay, &tuning->noDelay);
+	getSocketOption(QuickAck, &tuning->quickAck);
+	getSocketOption(DeferAccept, &tuning->deferAcceptSeconds);
+	getSocketOption(_isServer ? FastOpen : FastOpenConnect, &tuning->fastOpen);
+	getSocketOption(SendBufferSize, &tuning->sendBufferSize);
+	getSocketOption(RecvBufferSize, &tuning->recvBufferSize);
+	getSocketOption(UserTimeout, &tuning->userTimeoutMs);
+	getSocketOption(KeepAlive, &keepAlive);
+	if (keepAlive)
+	{
+		getSocketOption(KeepAliveIdle, &tuning->keepAliveIdleSeconds);
+		getSocketOption(KeepAliveInterval, &tuning->keepAliveIntervalSeconds);
+		getSocketOption(KeepAliveCount, &tuning->keepAliveCount);
+	}
+	getSocketOption(Priority, &tuning->priority);
+
+	return true;
 }
 
 char* TcpSocket::getAddress()
@@ -386,6 +664,35 @@ bool TcpSocket::setReadBufferSize(int size)
 	return true;
 }
 
+bool TcpSocket::setBusyPoll(bool enable, DWORD spinMicroseconds, DWORD parkMicroseconds)
+{
+	if (!_init || _isServer)
+		return false;
+
+	BUSY_POLL_POLICY policy;
+	policy.enabled = enable;
+	policy.spinMicroseconds = spinMicroseconds;
+	policy.parkMicroseconds = parkMicroseconds;
+
+	std::lock_guard<std::mutex> guard(_busyPollLock);
+	if (!SocketPolicy::ApplyBusyPoll(_sock, &policy))
+		return false;
+
+	_busyPoll = policy;
+	_busyPollVersion++;
+	return true;
+}
+
+void TcpSocket::SnapshotBusyPoll(BUSY_POLL_POLICY* policy, unsigned int* version)
+{
+	if (_busyPollVersion.load() == *version)
+		return;
+
+	std::lock_guard<std::mutex> guard(_busyPollLock);
+	*policy = _busyPoll;
+	*version = _busyPollVersion.load();
+}
+
 bool TcpSocket::isSocketClosed()
 {
 	return _csCalled;
@@ -396,7 +703,8 @@ bool TcpSocket::Write(void* data, size_t dataSize)
 	if (_isServer || data == NULL || dataSize <= 0)
 		return false;
 
-	return send(_sock, (const char*)data, dataSize, 0) == SOCKET_ERROR ? false : true;
+	// Busy poll makes the socket non-blocking, a single send could write part of the data
+	return SocketPolicy::SendAll(_sock, (const char*)data, dataSize);
 }
 
 bool TcpSocket::Write(SOCKET client, void* data, size_t dataSize)
@@ -404,7 +712,191 @@ bool TcpSocket::Write(SOCKET client, void* data, size_t dataSize)
 	if ((client == NULL || client == SOCKET_ERROR) || data == NULL || dataSize <= 0)
 		return false;
 
-	return send(client, (const char*)data, dataSize, 0) == SOCKET_ERROR ? false : true;
+	return SocketPolicy::SendAll(client, (const char*)data, dataSize);
+}
+
+bool TcpSocket::setZeroCopy(bool enable, size_t minWriteSize)
+{
+	if (!_init || _isServer)
+		return false;
+
+#ifdef SO_ZEROCOPY
+	int value = enable ? 1 : 0;
+	if (setsockopt(_sock, SOL_SOCKET, SO_ZEROCOPY, (char*)&value, sizeof(int)) == SOCKET_ERROR)
+		return false;
+
+	if (enable && !_zcRing)
+	{
+		_zcRing = (ZEROCOPY_PENDING_WRITE*)malloc(sizeof(ZEROCOPY_PENDING_WRITE) * ZEROCOPY_MAX_PENDING);
+		if (!_zcRing)
+			return false;
+	}
+
+	_zeroCopy = enable;
+	_zcThreshold = minWriteSize;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool TcpSocket::WriteZeroCopy(void* data, size_t dataSize, ZEROCOPY_COMPLETION_CALLBACK completionCallback, void* context)
+{
+	if (_isServer || data == NULL || dataSize <= 0 || completionCallback == NULL)
+		return false;
+
+#ifdef MSG_ZEROCOPY
+	if (_zeroCopy && dataSize >= _zcThreshold)
+	{
+		ReapZeroCopyCompletions(false);
+		while (_zcCount == ZEROCOPY_MAX_PENDING)
+			ReapZeroCopyCompletions(true);
+
+		size_t sent = 0;
+		DWORD firstSequence = _zcNextSequence;
+		while (sent < dataSize)
+		{
+			int result = send(_sock, (const char*)data + sent, dataSize - sent, MSG_ZEROCOPY);
+			if (result == SOCKET_ERROR)
+			{
+				// ENOBUFS means the pinned page limit (optmem_max) was hit, wait for the kernel to release some
+				if (errno == ENOBUFS && _zcCount > 0)
+				{
+					ReapZeroCopyCompletions(true);
+					continue;
+				}
+				if (errno == EINTR)
+					continue;
+				if (SocketPolicy::LastErrorWouldBlock())
+				{
+					// Busy poll made the socket non-blocking
+					pollfd pfd;
+					pfd.fd = _sock;
+					pfd.events = POLLOUT;
+					pfd.revents = 0;
+					SocketPolicy::PollSockets(&pfd, 1, -1);
+					continue;
+				}
+				break;
+			}
+
+			sent += result;
+			_zcNextSequence++;
+		}
+
+		if (sent == 0)
+		{
+			completionCallback(data, dataSize, context);
+			return false;
+		}
+
+		ZEROCOPY_PENDING_WRITE* pending = &_zcRing[(_zcHead + _zcCount) % ZEROCOPY_MAX_PENDING];
+		pending->data = data;
+		pending->len = dataSize;
+		pending->firstSequence = firstSequence;
+		pending->lastSequence = _zcNextSequence - 1;
+		pending->completedSends = 0;
+		pending->callback = completionCallback;
+		pending->context = context;
+		_zcCount++;
+		_zcStats.zeroCopyBytes += sent;
+		_zcStats.pendingWrites = _zcCount;
+
+		return sent == dataSize;
+	}
+#endif
+
+	// Copying path, the kernel has its own copy once send returns so the buffer is released immediately
+	bool result = Write(data, dataSize);
+	_zcStats.copiedBytes += dataSize;
+	completionCallback(data, dataSize, context);
+	return result;
+}
+
+bool TcpSocket::FlushZeroCopy(DWORD timeoutMs)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (_zcCount > 0)
+	{
+		if (std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(timeoutMs))
+			return false;
+		ReapZeroCopyCompletions(true);
+	}
+
+	return true;
+}
+
+bool TcpSocket::getZeroCopyStats(ZEROCOPY_STATS* stats)
+{
+	if (!stats)
+		return false;
+
+	*stats = _zcStats;
+	return true;
+}
+
+void TcpSocket::ReapZeroCopyCompletions(bool wait)
+{
+#ifdef MSG_ZEROCOPY
+	if (wait)
+	{
+		// Completions are queued on the socket error queue, which poll reports as POLLERR
+		pollfd pfd;
+		pfd.fd = _sock;
+		pfd.events = 0;
+		pfd.revents = 0;
+		poll(&pfd, 1, ZEROCOPY_POLL_INTERVAL_MS);
+	}
+
+	while (true)
+	{
+		char control[128];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msghdr));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(_sock, &msg, MSG_ERRQUEUE) == SOCKET_ERROR)
+			break;
+
+		for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+				!(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			sock_extended_err* serr = (sock_extended_err*)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			// [ee_info, ee_data] is the range of send calls that completed, each one is reported once but the ranges
+			// may come out of order (retransmits, teardown), so credit every pending buffer the range overlaps
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				_zcStats.kernelCopiedWrites += serr->ee_data - serr->ee_info + 1;
+			for (DWORD i = 0; i < _zcCount; i++)
+			{
+				ZEROCOPY_PENDING_WRITE* pending = &_zcRing[(_zcHead + i) % ZEROCOPY_MAX_PENDING];
+				DWORD first = (int)(serr->ee_info - pending->firstSequence) > 0 ? serr->ee_info : pending->firstSequence;
+				DWORD last = (int)(serr->ee_data - pending->lastSequence) < 0 ? serr->ee_data : pending->lastSequence;
+				if ((int)(last - first) >= 0)
+					pending->completedSends += last - first + 1;
+			}
+		}
+	}
+
+	// Release the buffers in write order, up to the first one the kernel may still read from
+	while (_zcCount > 0)
+	{
+		ZEROCOPY_PENDING_WRITE* pending = &_zcRing[_zcHead];
+		if (pending->completedSends != pending->lastSequence - pending->firstSequence + 1)
+			break;
+
+		_zcHead = (_zcHead + 1) % ZEROCOPY_MAX_PENDING;
+		_zcCount--;
+		pending->callback(pending->data, pending->len, pending->context);
+	}
+	_zcStats.pendingWrites = _zcCount;
+#endif
 }
 
 char* TcpSocket::Read(size_t len)
@@ -412,8 +904,20 @@ char* TcpSocket::Read(size_t len)
 	if (_isServer)
 		return 0;
 
-	char* buf = (char*)malloc(len);
-	ZeroMemory(buf, len);
+	BUSY_POLL_POLICY busyPoll;
+	unsigned int busyPollVersion = 0;
+	SnapshotBusyPoll(&busyPoll, &busyPollVersion);
+	if (busyPoll.enabled)
+	{
+		int ready = 0;
+		while (ready == 0)
+			ready = SocketPolicy::WaitReadable(_sock, &busyPoll);
+		if (ready < 0)
+			return (char*)-1;
+	}
+
+	char* buf = (char*)malloc(len + 1);
+	ZeroMemory(buf, len + 1);
 
 	int result = recv(_sock, buf, len, 0);
 	if (result == 0)
@@ -430,8 +934,8 @@ char* TcpSocket::Read(SOCKET client, size_t len)
 	if (client == NULL || client == SOCKET_ERROR)
 		return 0;
 
-	char* buf = (char*)malloc(len);
-	ZeroMemory(buf, len);
+	char* buf = (char*)malloc(len + 1);
+	ZeroMemory(buf, len + 1);
 
 	int result = recv(client, buf, len, 0);
 	if (result == 0)
@@ -443,6 +947,53 @@ char* TcpSocket::Read(SOCKET client, size_t len)
 	return buf;
 }
 
+// Timestamp of the chunk the data callback on this thread is handling
+static thread_local RECEIVE_TIMESTAMP* _callbackTimestamp = 0;
+
+bool TcpSocket::setReceiveTimestamps(bool enable, bool hardware)
+{
+#ifdef SO_TIMESTAMPING
+	// Before Connect or Listen the option is applied when the socket is created
+	if (_init && !SocketPolicy::EnableReceiveTimestamps(_sock, enable, hardware))
+		return false;
+
+	_receiveTimestamps = enable;
+	_hardwareTimestamps = hardware;
+	if (enable && !_receiveDelay)
+		_receiveDelay.reset(new ReceiveDelayHistogram());
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool TcpSocket::getReceiveDelayStats(RECEIVE_DELAY_STATS* stats, bool reset)
+{
+	if (!_receiveDelay)
+		return false;
+
+	_receiveDelay->getStats(stats);
+	if (reset)
+		_receiveDelay->Reset();
+	return true;
+}
+
+bool TcpSocket::getReceiveTimestamp(RECEIVE_TIMESTAMP* timestamp)
+{
+	if (!_callbackTimestamp)
+		return false;
+
+	*timestamp = *_callbackTimestamp;
+	return true;
+}
+
+void TcpSocket::SetCallbackTimestamp(RECEIVE_TIMESTAMP* timestamp)
+{
+	if (timestamp && _receiveDelay && _receiveTimestamps)
+		_receiveDelay->Record(timestamp);
+	_callbackTimestamp = timestamp;
+}
+
 DWORD TcpSocket::AcceptLoop()
 {
 	while (!_socketClosed)
@@ -461,11 +1012,16 @@ DWORD TcpSocket::AcceptLoop()
 			ccd->listenPort = _port;
 			ccd->clientSock = client;
 			ccd->dataPointers = _dataPointers ? _dataPointers : 0;
+			ccd->tuningProfile = _tuning.profile;
+			if (_tuning.profile != ProfileNone)
+				ApplyTuning(client, &_tuning, TUNING_ROLE_ACCEPTED);
+			if (_receiveTimestamps)
+				SocketPolicy::EnableReceiveTimestamps(client, true, _hardwareTimestamps);
 
 			if (callbackType == 0)
-				CreateThread(0, 0, (LPTHREAD_START_ROUTINE)_newConCallback, ccd, 0, 0);
+				SocketPolicy::CreateWorkerThread((LPTHREAD_START_ROUTINE)_newConCallback, ccd);
 			else
-				CreateThread(0, 0, (LPTHREAD_START_ROUTINE)_newConMemberCallback, ccd, 0, 0);
+				SocketPolicy::CreateWorkerThread((LPTHREAD_START_ROUTINE)_newConMemberCallback, ccd);
 		}
 		else
 		{
@@ -480,23 +1036,68 @@ DWORD TcpSocket::AcceptLoop()
 
 DWORD TcpSocket::ReadLoop()
 {
+	bool steered = false;
+	BUSY_POLL_POLICY busyPoll;
+	unsigned int busyPollVersion = 0;
+
+	// Accepted connections get timestamps from the listener
+	if (!_receiveTimestamps && SocketPolicy::ReceiveTimestampsEnabled(_sock))
+	{
+		_receiveTimestamps = true;
+		_receiveDelay.reset(new ReceiveDelayHistogram());
+	}
+
 	while (!_socketClosed)
 	{
-		char* buf = (char*)calloc(1, _readBufSize);
-		int len = recv(_sock, buf, _readBufSize, 0);
+		SnapshotBusyPoll(&busyPoll, &busyPollVersion);
+		if (busyPoll.enabled && SocketPolicy::WaitReadable(_sock, &busyPoll) == 0)
+			continue;
+
+		int buffAllocType = 0;
+		char* buf = SocketPolicy::AllocReadBuffer(_readBufSize, &buffAllocType);
+		RECEIVE_TIMESTAMP timestamp;
+		int len = 0;
+		if (_receiveTimestamps)
+			len = SocketPolicy::ReceiveWithTimestamp(_sock, buf, _readBufSize, 0, 0, &timestamp);
+		else
+			len = recv(_sock, buf, _readBufSize, 0);
 		if (len > 0)
 		{
+			// The incoming CPU is only known once data arrived
+			if (!steered)
+			{
+				SocketPolicy::SteerToIncomingCpu(_sock);
+				steered = true;
+			}
+
 			DATA_RECEVIED_CALLBACK_DATA* drcd = (DATA_RECEVIED_CALLBACK_DATA*)malloc(sizeof DATA_RECEVIED_CALLBACK_DATA);
 			drcd->socket = this;
+			if (_receiveTimestamps)
+				drcd->timestamp = timestamp;
+			else
+				ZeroMemory(&drcd->timestamp, sizeof(RECEIVE_TIMESTAMP));
 			drcd->buff = buf;
+			drcd->buffAllocType = buffAllocType;
 			drcd->len = len;
 			drcd->dataPointers = 0;
 			if (callbackType != 0)
 				drcd->dataPointers = _dataPointers;
-			CreateThread(0, 0, CallbackDRCV_ThreadCall, drcd, 0, 0);
+
+			// In busy poll mode the callback runs on this thread so the data stays on the core that received it
+			if (busyPoll.enabled)
+				CallbackDRCV_ThreadCall(drcd);
+			else
+				SocketPolicy::CreateWorkerThread(CallbackDRCV_ThreadCall, drcd);
 		}
 		else
 		{
+			// Also when busy poll was enabled after this pass took its copy, the socket is non-blocking already
+			if (len < 0 && SocketPolicy::LastErrorWouldBlock())
+			{
+				SocketPolicy::FreeReadBuffer(buf, buffAllocType);
+				continue;
+			}
+
 			if (len <= 0 /*&& (WSAGetLastError() == WSAENOTSOCK || WSAGetLastError() == WSAECONNRESET)*/)
 			{
 				CONNECTION_CLOSED_CALLBACK_DATA* ccd = (CONNECTION_CLOSED_CALLBACK_DATA*)malloc(sizeof CONNECTION_CLOSED_CALLBACK_DATA);
@@ -506,7 +1107,7 @@ DWORD TcpSocket::ReadLoop()
 				ccd->dataPointers = 0;
 				if (callbackType != 0)
 					ccd->dataPointers = _dataPointers;
-				CreateThread(0, 0, CallbackCCLSD_ThreadCall, ccd, 0, 0);
+				SocketPolicy::CreateWorkerThread(CallbackCCLSD_ThreadCall, ccd);
 
 				_socketClosed = true;
 			}
@@ -552,8 +1153,21 @@ void TcpSocket::Close()
 
 		if (!_csCalled)
 		{
+			// The kernel may still reference zero-copy buffers after close, give it a chance to release them
+			if (_zcCount > 0)
+				FlushZeroCopy(ZEROCOPY_CLOSE_TIMEOUT_MS);
 			closesocket(_sock);
 			_csCalled = true;
+
+			// Completions of a closed socket can't be read anymore, the callbacks still have to run exactly once
+			while (_zcCount > 0)
+			{
+				ZEROCOPY_PENDING_WRITE* pending = &_zcRing[_zcHead];
+				_zcHead = (_zcHead + 1) % ZEROCOPY_MAX_PENDING;
+				_zcCount--;
+				pending->callback(pending->data, pending->len, pending->context);
+			}
+			_zcStats.pendingWrites = 0;
 		}
 		else
 			return;
@@ -36,6 +36,7 @@ typedef struct
 	int listenPort;
 	SOCKET clientSock;
 	void* dataPointers;
+	TUNING_PROFILE tuningProfile; // Profile the listener applied to this connection
 }CLIENT_CONNECTION_DATA;
 
 typedef void(* NEW_CONNECTION_CALLBACK)(CLIENT_CONNECTION_DATA* client);
@@ -44,6 +45,21 @@ typedef void(* DATA_RECEIVED_CALLBACK)(TcpSocket* clientSocket, char* data, size
 typedef void(* DATA_RECEIVED_MEMBER_CALLBACK)(TcpSocket* clientSocket, char* data, size_t dataSize, void* classInstance);
 typedef void(* CONNECTION_CLOSED_CALLBACK)(char* address, int port);
 typedef void(* CONNECTION_CLOSED_MEMBER_CALLBACK)(char* address, int port, void* classInstance);
+typedef void(* ZEROCOPY_COMPLETION_CALLBACK)(void* data, size_t dataSize, void* context);
+
+// Writes smaller than this are copied, pinning pages only pays off for large buffers
+#define ZEROCOPY_DEFAULT_THRESHOLD 16384
+#define ZEROCOPY_MAX_PENDING 1024
+#define ZEROCOPY_POLL_INTERVAL_MS 10
+#define ZEROCOPY_CLOSE_TIMEOUT_MS 1000
+
+typedef struct
+{
+	ULONGLONG zeroCopyBytes; // Sent with MSG_ZEROCOPY
+	ULONGLONG copiedBytes; // Sent through the copying path (small writes or zero-copy unavailable)
+	ULONGLONG kernelCopiedWrites; // Zero-copy sends the kernel completed by copying anyway (loopback for example)
+	DWORD pendingWrites; // Buffers the kernel still references
+}ZEROCOPY_STATS;
 
 class TcpSocket
 {
@@ -51,13 +67,24 @@ public:
 
 	bool classValid;
 
-	enum SOCKETOPT : DWORD // TODO: More options
+	enum SOCKETOPT : DWORD
 	{
 		NoDelay = 1,
 		KeepAlive = 2,
 		RecvTimeout = 3,
 		SendTimeout = 4,
-		IpDontFragment = 5
+		IpDontFragment = 5,
+		QuickAck = 6, // Linux only, the kernel clears it again after it sends an ACK
+		DeferAccept = 7, // Linux only, seconds to wait for the first data before accept() returns
+		FastOpen = 8, // TFO queue length on a listener
+		FastOpenConnect = 9, // Send the first Write in the SYN on a client
+		SendBufferSize = 10,
+		RecvBufferSize = 11,
+		UserTimeout = 12, // Milliseconds unacknowledged data may stay in flight before the connection is dropped
+		KeepAliveIdle = 13, // Seconds
+		KeepAliveInterval = 14, // Seconds
+		KeepAliveCount = 15,
+		Priority = 16 // Linux only (SO_PRIORITY)
 	};
 
 	/* Create the socket */
@@ -74,16 +101,44 @@ public:
 
 	// Enable/Disable/Modify a socket option 
 	PRIMESOCKET_API bool setSocketOption(SOCKETOPT opt, DWORD value);
+	PRIMESOCKET_API bool getSocketOption(SOCKETOPT opt, DWORD* value);
+	// Apply a set of options in one go, call before Listen/Connect (accepted connections inherit the listener profile)
+	// or on a connected socket to apply it immediately
+	PRIMESOCKET_API bool setTuningProfile(TUNING_PROFILE profile);
+	PRIMESOCKET_API TUNING_PROFILE getTuningProfile();
+	// Read back the options currently set on the socket, tuning->profile is the profile this instance applied
+	PRIMESOCKET_API bool getSocketTuning(SOCKET_TUNING* tuning);
 	PRIMESOCKET_API char* getAddress();
 	PRIMESOCKET_API int getPort();
 	PRIMESOCKET_API SOCKET getSocketDescriptor();
 
 	// Set the read buffer size, only data equal or less than this value will be readed from the socket (65536 is the default value)
 	PRIMESOCKET_API bool setReadBufferSize(int size);
+	// Low-latency mode: spin on the socket instead of blocking in recv and run the data callback on the read loop thread.
+	// Connections only, listeners return false. For accepted connections call it on the TcpSocket created in the new
+	// connection callback, a read loop already waiting in recv picks the change up after its next receive
+	PRIMESOCKET_API bool setBusyPoll(bool enable, DWORD spinMicroseconds = BUSY_POLL_DEFAULT_SPIN_US, DWORD parkMicroseconds = BUSY_POLL_DEFAULT_PARK_US);
 	PRIMESOCKET_API bool isSocketClosed();
+	// Kernel receive timestamps for every read and the receive to callback delay in getReceiveDelayStats. hardware also
+	// asks for the NIC timestamp. Linux only. Set on a listener it applies to the accepted connections, and a TcpSocket
+	// created for an accepted connection picks it up by itself
+	PRIMESOCKET_API bool setReceiveTimestamps(bool enable, bool hardware = false);
+	PRIMESOCKET_API bool getReceiveDelayStats(RECEIVE_DELAY_STATS* stats, bool reset = false);
+	// Receive timestamp of the data passed to the data callback running on the calling thread, false outside a data callback
+	PRIMESOCKET_API static bool getReceiveTimestamp(RECEIVE_TIMESTAMP* timestamp);
 
 	PRIMESOCKET_API bool Write(void* data, size_t dataSize);
 	PRIMESOCKET_API bool Write(SOCKET client, void* data, size_t dataSize);
+	// Zero-copy transmit (Linux MSG_ZEROCOPY), returns false where the platform doesn't support it
+	PRIMESOCKET_API bool setZeroCopy(bool enable, size_t minWriteSize = ZEROCOPY_DEFAULT_THRESHOLD);
+	// The buffer belongs to the kernel until completionCallback is called, which happens exactly once per call.
+	// Writes below minWriteSize or without zero-copy enabled are copied and complete before this returns.
+	// Not thread safe, use one writer thread per socket
+	PRIMESOCKET_API bool WriteZeroCopy(void* data, size_t dataSize, ZEROCOPY_COMPLETION_CALLBACK completionCallback, void* context);
+	// Wait until the kernel released every zero-copy buffer, returns false on timeout. Close waits up to ZEROCOPY_CLOSE_TIMEOUT_MS
+	// and then calls the callbacks of the buffers still pending
+	PRIMESOCKET_API bool FlushZeroCopy(DWORD timeoutMs);
+	PRIMESOCKET_API bool getZeroCopyStats(ZEROCOPY_STATS* stats);
 	PRIMESOCKET_API char* Read(size_t len);
 	PRIMESOCKET_API char* Read(SOCKET client, size_t len);
 
@@ -94,6 +149,11 @@ public:
 protected:
 	void InitializeMembers();
 
+	static bool setSocketOption(SOCKET sock, SOCKETOPT opt, DWORD value);
+	static bool getSocketOption(SOCKET sock, SOCKETOPT opt, DWORD* value);
+	static bool ApplyTuningOption(SOCKET sock, SOCKETOPT opt, DWORD value);
+	static bool ApplyTuning(SOCKET sock, SOCKET_TUNING* tuning, int role);
+
 private:
 	typedef struct
 	{
@@ -103,8 +163,18 @@ private:
 		void* dataPointers;
 		int buffAllocType;
 		int allocType;
+		RECEIVE_TIMESTAMP timestamp;
 	}DATA_RECEVIED_CALLBACK_DATA;
 	typedef struct
+	{
+		void* data;
+		size_t len;
+		DWORD firstSequence, lastSequence; // Zero-copy counter values of the send calls that covered this buffer
+		DWORD completedSends; // Notifications may arrive out of order, the buffer is released once all of them did
+		ZEROCOPY_COMPLETION_CALLBACK callback;
+		void* context;
+	}ZEROCOPY_PENDING_WRITE;
+	typedef struct
 	{
 		TcpSocket* socket;
 		char* ip;
@@ -137,16 +207,24 @@ private:
 		return _instance->ReadLoop();
 	}
 	DWORD ReadLoop();
+	// Copies the busy poll policy when setBusyPoll changed it since the last copy
+	void SnapshotBusyPoll(BUSY_POLL_POLICY* policy, unsigned int* version);
+
+	void ReapZeroCopyCompletions(bool wait);
+	// Records the receive delay and makes the timestamp available to getReceiveTimestamp for the callback, 0 when it returned
+	void SetCallbackTimestamp(RECEIVE_TIMESTAMP* timestamp);
 
 	static DWORD WINAPI CallbackDRCV_ThreadCall(LPVOID param)
 	{
 		DATA_RECEVIED_CALLBACK_DATA* drcd = (DATA_RECEVIED_CALLBACK_DATA*)param;
+		drcd->socket->SetCallbackTimestamp(&drcd->timestamp);
 		if (drcd->dataPointers == 0)
 			drcd->socket->_dataReceivedCallback(drcd->socket, drcd->buff, drcd->len);
 		else
 			drcd->socket->_dataReceivedMemberCallback(drcd->socket, drcd->buff, drcd->len, drcd->dataPointers);
+		drcd->socket->SetCallbackTimestamp(0);
 
-		free(drcd->buff);
+		SocketPolicy::FreeReadBuffer(drcd->buff, drcd->buffAllocType);
 		free(drcd);
 		return 0;
 	}
@@ -172,4 +250,18 @@ private:
 	int _port;
 	int _ai_family, _ai_socktype, _ai_protocol;
 	int _readBufSize;
+	BUSY_POLL_POLICY _busyPoll; // Written under _busyPollLock while the read loop may be running, readers take a copy
+	std::mutex _busyPollLock;
+	std::atomic<unsigned int> _busyPollVersion;
+	SOCKET_TUNING _tuning;
+
+	bool _zeroCopy;
+	size_t _zcThreshold;
+	ZEROCOPY_PENDING_WRITE* _zcRing;
+	DWORD _zcHead, _zcCount;
+	DWORD _zcNextSequence;
+	ZEROCOPY_STATS _zcStats;
+
+	bool _receiveTimestamps, _hardwareTimestamps;
+	std::unique_ptr<ReceiveDelayHistogram> _receiveDelay; // Freed with the socket, callbacks may record until then
 };
\ No newline at end of file
@@ -0,0 +1,502 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#include "PrimeSocket.h"
+
+#define CHANNEL_PACKET_DATA 1
+#define CHANNEL_PACKET_ACK 2
+#define CHANNEL_FLAG_LAST_FRAGMENT 1
+
+// DATA: type, flags, stream, packet sequence, fragment sequence. ACK: type, range count, unused, cumulative ack, ranges
+#define CHANNEL_DATA_HEADER 20
+#define CHANNEL_ACK_HEADER 12
+#define CHANNEL_ACK_RANGE 16
+
+static void PutU64(char* p, unsigned long long value)
+{
+	unsigned int high = htonl((unsigned int)(value >> 32));
+	unsigned int low = htonl((unsigned int)value);
+	memcpy(p, &high, 4);
+	memcpy(p + 4, &low, 4);
+}
+
+static unsigned long long GetU64(const char* p)
+{
+	unsigned int high, low;
+	memcpy(&high, p, 4);
+	memcpy(&low, p + 4, 4);
+	return ((unsigned long long)ntohl(high) << 32) | ntohl(low);
+}
+
+UdpChannel::UdpChannel(UdpSocket* socket, UDP_ENDPOINT* peer, UDP_CHANNEL_MESSAGE_CALLBACK messageCallback, void* dataPointers)
+{
+	_socket = socket;
+	_peer = *peer;
+	_messageCallback = messageCallback;
+	_dataPointers = dataPointers;
+
+	_nextSeq = 0;
+	_lostCount = 0;
+	_queuedBytes = 0;
+	_cwnd = UDP_CHANNEL_INITIAL_CWND;
+	_ssthresh = 1e9;
+	_recoveryPoint = 0;
+	_srttUs = 0;
+	_rttvarUs = 0;
+	_rtoUs = UDP_CHANNEL_INITIAL_RTO_MS * 1000.0;
+	_recvNext = 0;
+
+	_simulate = false;
+	ZeroMemory(&_simulator, sizeof(UDP_LOSS_SIMULATOR));
+	_random = NowUs() | 1;
+
+	_messagesSent = 0;
+	_messagesDelivered = 0;
+	_packetsSent = 0;
+	_retransmissions = 0;
+	_timeouts = 0;
+	_fastRetransmits = 0;
+	_simulatedDrops = 0;
+
+	_running = true;
+	_hTimer = SocketPolicy::CreateIoThread(TimerLoop_ThreadCall, this);
+}
+
+UdpChannel::~UdpChannel()
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_running = false;
+	}
+	_wake.notify_all();
+	if (_hTimer)
+	{
+		WaitForSingleObject(_hTimer, INFINITE);
+		CloseHandle(_hTimer);
+	}
+}
+
+unsigned long long UdpChannel::NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool UdpChannel::Send(unsigned short stream, char* data, size_t len)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	if (_queuedBytes + len > UDP_CHANNEL_MAX_QUEUED)
+		return false;
+	if (_sendFragments.size() >= UDP_CHANNEL_MAX_STREAMS && _sendFragments.find(stream) == _sendFragments.end())
+		return false;
+
+	// The packet sequence is filled in when the congestion window lets the fragment go
+	size_t offset = 0;
+	do
+	{
+		size_t chunk = len - offset < UDP_CHANNEL_MAX_PAYLOAD ? len - offset : UDP_CHANNEL_MAX_PAYLOAD;
+		std::string packet(CHANNEL_DATA_HEADER + chunk, 0);
+		packet[0] = CHANNEL_PACKET_DATA;
+		packet[1] = offset + chunk == len ? CHANNEL_FLAG_LAST_FRAGMENT : 0;
+		unsigned short streamId = htons(stream);
+		memcpy(&packet[2], &streamId, 2);
+		PutU64(&packet[12], _sendFragments[stream]++);
+		if (chunk)
+			memcpy(&packet[CHANNEL_DATA_HEADER], data + offset, chunk);
+
+		_queue.push_back(packet);
+		_queuedBytes += chunk;
+		offset += chunk;
+	} while (offset < len);
+
+	_messagesSent++;
+	TrySend();
+	return true;
+}
+
+void UdpChannel::TrySend()
+{
+	unsigned long long now = NowUs();
+	bool sent = false;
+	std::list<SENT_PACKET>::iterator lost = _unacked.begin();
+	while (_unacked.size() - _lostCount < (size_t)_cwnd)
+	{
+		// Packets lost to a timeout go first, oldest first
+		if (_lostCount)
+		{
+			while (!lost->lost)
+				++lost;
+			lost->lost = false;
+			_lostCount--;
+			Retransmit(&*lost, now);
+			sent = true;
+			continue;
+		}
+		if (_queue.empty())
+			break;
+
+		SENT_PACKET packet;
+		packet.seq = _nextSeq++;
+		packet.sentUs = now;
+		packet.retransmitted = false;
+		packet.fastRetransmitted = false;
+		packet.lost = false;
+		packet.packet.swap(_queue.front());
+		_queue.pop_front();
+		_queuedBytes -= packet.packet.size() - CHANNEL_DATA_HEADER;
+
+		PutU64(&packet.packet[4], packet.seq);
+		Transmit(packet.packet, now);
+		_unacked.push_back(packet);
+		sent = true;
+	}
+
+	// New retransmission deadline for the timer
+	if (sent)
+		_wake.notify_one();
+}
+
+void UdpChannel::Transmit(const std::string& packet, unsigned long long now)
+{
+	_packetsSent++;
+	if (_simulate)
+	{
+		// xorshift64, good enough to pick the dropped packets
+		_random ^= _random << 13;
+		_random ^= _random >> 7;
+		_random ^= _random << 17;
+		if ((_random % 1000000) < _simulator.lossRate * 1000000)
+		{
+			_simulatedDrops++;
+			return;
+		}
+
+		if (_simulator.delayMs || _simulator.jitterMs)
+		{
+			DELAYED_PACKET delayed;
+			delayed.dueUs = now + _simulator.delayMs * 1000ULL + (_simulator.jitterMs ? (_random >> 20) % (_simulator.jitterMs * 1000ULL) : 0);
+			delayed.packet = packet;
+
+			std::list<DELAYED_PACKET>::iterator it = _delayed.end();
+			while (it != _delayed.begin() && std::prev(it)->dueUs > delayed.dueUs)
+				--it;
+			_delayed.insert(it, delayed);
+			_wake.notify_one();
+			return;
+		}
+	}
+
+	_socket->Write(&_peer, (char*)packet.data(), (int)packet.size());
+}
+
+void UdpChannel::Retransmit(SENT_PACKET* sent, unsigned long long now)
+{
+	sent->sentUs = now;
+	sent->retransmitted = true;
+	_retransmissions++;
+	Transmit(sent->packet, now);
+}
+
+void UdpChannel::Receive(char* data, size_t len)
+{
+	if (len == 0)
+		return;
+
+	std::list<DELIVERY> deliveries;
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		if (data[0] == CHANNEL_PACKET_DATA && len >= CHANNEL_DATA_HEADER)
+		{
+			OnData(data, len, &deliveries);
+			SendAck();
+		}
+		else if (data[0] == CHANNEL_PACKET_ACK && len >= CHANNEL_ACK_HEADER)
+			OnAck(data, len);
+	}
+
+	// Outside the lock, the callback may Send on this channel
+	for (std::list<DELIVERY>::iterator it = deliveries.begin(); it != deliveries.end(); ++it)
+		_messageCallback(this, it->stream, (char*)it->message.data(), it->message.size(), _dataPointers);
+}
+
+void UdpChannel::OnData(char* data, size_t len, std::list<DELIVERY>* deliveries)
+{
+	unsigned long long seq = GetU64(data + 4);
+	if (seq < _recvNext)
+		return; // Duplicate, the ACK we send anyway tells the peer to stop resending it
+
+	unsigned short streamId;
+	memcpy(&streamId, data + 2, 2);
+	streamId = ntohs(streamId);
+	unsigned long long fragment = GetU64(data + 12);
+
+	// Bound what a broken or hostile peer can make us hold. Checked before the packet counts as received, so
+	// a dropped packet is not acknowledged and a well behaved sender resends it
+	if (seq >= _recvNext + UDP_CHANNEL_RECV_WINDOW)
+		return;
+	std::unordered_map<unsigned short, RECV_STREAM>::iterator found = _recvStreams.find(streamId);
+	if (found == _recvStreams.end() && _recvStreams.size() >= UDP_CHANNEL_MAX_STREAMS)
+		return;
+	if (found != _recvStreams.end() && fragment >= found->second.next + UDP_CHANNEL_RECV_WINDOW)
+		return;
+
+	if (seq == _recvNext)
+	{
+		_recvNext++;
+		if (!_recvRanges.empty() && _recvRanges.front().first == _recvNext)
+		{
+			_recvNext = _recvRanges.front().second;
+			_recvRanges.pop_front();
+		}
+	}
+	else
+	{
+		// Insert into the sorted ranges, merging with the neighbours it touches
+		std::list<std::pair<unsigned long long, unsigned long long>>::iterator it = _recvRanges.begin();
+		while (it != _recvRanges.end() && it->second < seq)
+			++it;
+		if (it != _recvRanges.end() && it->first <= seq && seq < it->second)
+			return; // Duplicate
+		if (it != _recvRanges.end() && it->second == seq)
+		{
+			it->second++;
+			std::list<std::pair<unsigned long long, unsigned long long>>::iterator next = std::next(it);
+			if (next != _recvRanges.end() && next->first == it->second)
+			{
+				it->second = next->second;
+				_recvRanges.erase(next);
+			}
+		}
+		else if (it != _recvRanges.end() && it->first == seq + 1)
+			it->first = seq;
+		else
+			_recvRanges.insert(it, std::make_pair(seq, seq + 1));
+	}
+
+	RECV_STREAM* stream = &_recvStreams[streamId];
+	if (fragment < stream->next)
+		return;
+
+	std::string& pending = stream->pending[fragment];
+	pending.assign(1, data[1]);
+	pending.append(data + CHANNEL_DATA_HEADER, len - CHANNEL_DATA_HEADER);
+
+	// Hand over every message that is now complete and in order
+	std::unordered_map<unsigned long long, std::string>::iterator next;
+	while ((next = stream->pending.find(stream->next)) != stream->pending.end())
+	{
+		stream->message.append(next->second, 1, std::string::npos);
+		bool last = (next->second[0] & CHANNEL_FLAG_LAST_FRAGMENT) != 0;
+		stream->pending.erase(next);
+		stream->next++;
+
+		if (last)
+		{
+			DELIVERY delivery;
+			delivery.stream = streamId;
+			delivery.message.swap(stream->message);
+			deliveries->push_back(delivery);
+			_messagesDelivered++;
+		}
+	}
+}
+
+void UdpChannel::SendAck()
+{
+	size_t rangeCount = _recvRanges.size() < UDP_CHANNEL_MAX_SACK_RANGES ? _recvRanges.size() : UDP_CHANNEL_MAX_SACK_RANGES;
+	std::string packet(CHANNEL_ACK_HEADER + rangeCount * CHANNEL_ACK_RANGE, 0);
+	packet[0] = CHANNEL_PACKET_ACK;
+	packet[1] = (char)rangeCount;
+	PutU64(&packet[4], _recvNext);
+
+	std::list<std::pair<unsigned long long, unsigned long long>>::iterator it = _recvRanges.begin();
+	for (size_t i = 0; i < rangeCount; i++, ++it)
+	{
+		PutU64(&packet[CHANNEL_ACK_HEADER + i * CHANNEL_ACK_RANGE], it->first);
+		PutU64(&packet[CHANNEL_ACK_HEADER + i * CHANNEL_ACK_RANGE + 8], it->second);
+	}
+
+	Transmit(packet, NowUs());
+}
+
+void UdpChannel::OnAck(char* data, size_t len)
+{
+	unsigned long long now = NowUs();
+	unsigned long long cumulative = GetU64(data + 4);
+	size_t rangeCount = (unsigned char)data[1];
+	if (len < CHANNEL_ACK_HEADER + rangeCount * CHANNEL_ACK_RANGE)
+		return;
+
+	unsigned long long highestAcked = cumulative;
+	bool acked = false;
+	std::list<SENT_PACKET>::iterator it = _unacked.begin();
+	while (it != _unacked.end())
+	{
+		bool received = it->seq < cumulative;
+		for (size_t i = 0; i < rangeCount && !received; i++)
+		{
+			const char* range = data + CHANNEL_ACK_HEADER + i * CHANNEL_ACK_RANGE;
+			received = GetU64(range) <= it->seq && it->seq < GetU64(range + 8);
+		}
+		if (!received)
+		{
+			++it;
+			continue;
+		}
+
+		if (it->lost)
+			_lostCount--;
+		else if (!it->retransmitted)
+			UpdateRtt(now - it->sentUs);
+		if (it->seq + 1 > highestAcked)
+			highestAcked = it->seq + 1;
+
+		// Slow start below ssthresh, then one packet per window
+		if (_cwnd < _ssthresh)
+			_cwnd += 1;
+		else
+			_cwnd += 1 / _cwnd;
+		if (_cwnd > UDP_CHANNEL_MAX_CWND)
+			_cwnd = UDP_CHANNEL_MAX_CWND;
+
+		it = _unacked.erase(it);
+		acked = true;
+	}
+
+	// A packet is lost once enough packets sent after it were acknowledged and it is older than the RTT plus its
+	// variation, resend it without waiting for the timeout. The time check keeps reordering from triggering it
+	unsigned long long reorderUs = (unsigned long long)(_srttUs + 2 * _rttvarUs);
+	for (it = _unacked.begin(); it != _unacked.end() && it->seq + UDP_CHANNEL_DUP_THRESHOLD < highestAcked; ++it)
+	{
+		if (it->lost || it->fastRetransmitted || now - it->sentUs < reorderUs)
+			continue;
+
+		it->fastRetransmitted = true;
+		_fastRetransmits++;
+		if (it->seq >= _recoveryPoint)
+			OnLoss(false);
+		Retransmit(&*it, now);
+	}
+
+	if (acked)
+		TrySend();
+}
+
+void UdpChannel::UpdateRtt(unsigned long long sampleUs)
+{
+	double sample = (double)sampleUs;
+	if (_srttUs == 0)
+	{
+		_srttUs = sample;
+		_rttvarUs = sample / 2;
+	}
+	else
+	{
+		_rttvarUs = 0.75 * _rttvarUs + 0.25 * (_srttUs > sample ? _srttUs - sample : sample - _srttUs);
+		_srttUs = 0.875 * _srttUs + 0.125 * sample;
+	}
+
+	// A fresh sample also ends any timeout backoff
+	_rtoUs = _srttUs + 4 * _rttvarUs;
+	if (_rtoUs < UDP_CHANNEL_MIN_RTO_MS * 1000.0)
+		_rtoUs = UDP_CHANNEL_MIN_RTO_MS * 1000.0;
+	if (_rtoUs > UDP_CHANNEL_MAX_RTO_MS * 1000.0)
+		_rtoUs = UDP_CHANNEL_MAX_RTO_MS * 1000.0;
+}
+
+void UdpChannel::OnLoss(bool timeout)
+{
+	// One window reduction per loss event, the packets in flight when it was detected belong to it
+	_ssthresh = _cwnd / 2 < 2 ? 2 : _cwnd / 2;
+	_cwnd = timeout ? 1 : _ssthresh;
+	_recoveryPoint = _nextSeq;
+}
+
+DWORD UdpChannel::TimerLoop()
+{
+	std::unique_lock<std::mutex> guard(_lock);
+	while (_running)
+	{
+		unsigned long long now = NowUs();
+		while (!_delayed.empty() && _delayed.front().dueUs <= now)
+		{
+			_socket->Write(&_peer, (char*)_delayed.front().packet.data(), (int)_delayed.front().packet.size());
+			_delayed.pop_front();
+		}
+
+		// Retransmission timeout (RFC 6298 5.4 to 5.7): one backoff per timeout, resend the oldest packet and mark
+		// the rest of the flight lost. TrySend resends those as ACKs open the window again
+		unsigned long long oldestUs = 0;
+		for (std::list<SENT_PACKET>::iterator it = _unacked.begin(); it != _unacked.end(); ++it)
+		{
+			if (!it->lost && (oldestUs == 0 || it->sentUs < oldestUs))
+				oldestUs = it->sentUs;
+		}
+		if (oldestUs && oldestUs + (unsigned long long)_rtoUs <= now)
+		{
+			_timeouts++;
+			OnLoss(true);
+			_rtoUs = _rtoUs * 2 > UDP_CHANNEL_MAX_RTO_MS * 1000.0 ? UDP_CHANNEL_MAX_RTO_MS * 1000.0 : _rtoUs * 2;
+			for (std::list<SENT_PACKET>::iterator it = _unacked.begin(); it != _unacked.end(); ++it)
+				it->lost = true;
+			_lostCount = _unacked.size() - 1;
+			_unacked.front().lost = false;
+			Retransmit(&_unacked.front(), now);
+			oldestUs = now;
+		}
+
+		unsigned long long wakeUs = now + 100000;
+		if (!_delayed.empty() && _delayed.front().dueUs < wakeUs)
+			wakeUs = _delayed.front().dueUs;
+		if (oldestUs && oldestUs + (unsigned long long)_rtoUs < wakeUs)
+			wakeUs = oldestUs + (unsigned long long)_rtoUs;
+
+		_wake.wait_for(guard, std::chrono::microseconds(wakeUs > now ? wakeUs - now : 0));
+	}
+	return 0;
+}
+
+void UdpChannel::setLossSimulator(UDP_LOSS_SIMULATOR* simulator)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_simulate = simulator != 0;
+	if (simulator)
+		_simulator = *simulator;
+}
+
+void UdpChannel::getStats(UDP_CHANNEL_STATS* stats)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	stats->messagesSent = _messagesSent;
+	stats->messagesDelivered = _messagesDelivered;
+	stats->packetsSent = _packetsSent;
+	stats->retransmissions = _retransmissions;
+	stats->timeouts = _timeouts;
+	stats->fastRetransmits = _fastRetransmits;
+	stats->simulatedDrops = _simulatedDrops;
+	stats->srttMs = _srttUs / 1000;
+	stats->rtoMs = _rtoUs / 1000;
+	stats->cwnd = _cwnd;
+	stats->inFlight = _unacked.size() - _lostCount;
+	stats->queuedBytes = _queuedBytes;
+}
\ No newline at end of file
@@ -0,0 +1,175 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#define UDP_CHANNEL_MAX_PAYLOAD 1200 // Message bytes per packet, longer messages are sent as several fragments
+#define UDP_CHANNEL_MAX_QUEUED (16 * 1024 * 1024) // Bytes waiting for the congestion window before Send refuses messages
+#define UDP_CHANNEL_INITIAL_CWND 10 // Packets
+#define UDP_CHANNEL_MAX_CWND 256 // Packets, keeps one channel from overrunning the receive buffer of its peer
+#define UDP_CHANNEL_INITIAL_RTO_MS 100
+#define UDP_CHANNEL_MIN_RTO_MS 5
+#define UDP_CHANNEL_MAX_RTO_MS 2000
+#define UDP_CHANNEL_MAX_SACK_RANGES 32
+#define UDP_CHANNEL_DUP_THRESHOLD 3 // A packet is lost once this many later packets are acknowledged
+#define UDP_CHANNEL_RECV_WINDOW 4096 // Packets and fragments per stream accepted ahead of the next in order one, well above UDP_CHANNEL_MAX_CWND
+#define UDP_CHANNEL_MAX_STREAMS 1024 // Distinct stream ids per channel and direction
+
+class UdpChannel;
+
+typedef void(__stdcall* UDP_CHANNEL_MESSAGE_CALLBACK)(UdpChannel* channel, unsigned short stream, char* data, size_t len, void* dataPointers);
+
+// Drops and delays the packets a channel sends, to exercise loss recovery and reordering on loopback
+typedef struct
+{
+	double lossRate; // 0 to 1
+	DWORD delayMs;
+	DWORD jitterMs; // Random extra delay up to this, reorders packets
+}UDP_LOSS_SIMULATOR;
+
+typedef struct
+{
+	unsigned long long messagesSent;
+	unsigned long long messagesDelivered;
+	unsigned long long packetsSent;
+	unsigned long long retransmissions;
+	unsigned long long timeouts;
+	unsigned long long fastRetransmits;
+	unsigned long long simulatedDrops;
+	double srttMs;
+	double rtoMs;
+	double cwnd;
+	size_t inFlight;
+	size_t queuedBytes;
+}UDP_CHANNEL_STATS;
+
+// Reliable messages to one peer over a UdpSocket. Packets carry a sequence number and are acknowledged with
+// selective ACKs, lost packets are resent on a SACK gap or an RTT based timeout and a congestion window limits
+// the packets in flight. Messages are ordered per stream only, so a loss on one stream does not hold up the others.
+// Feed every datagram the socket receives from the peer to Receive
+class UdpChannel
+{
+public:
+	PRIMESOCKET_API UdpChannel(UdpSocket* socket, UDP_ENDPOINT* peer, UDP_CHANNEL_MESSAGE_CALLBACK messageCallback, void* dataPointers);
+	PRIMESOCKET_API ~UdpChannel();
+
+	// Queues the message on the stream, returns false when UDP_CHANNEL_MAX_QUEUED bytes are already waiting or the
+	// stream would be one more than UDP_CHANNEL_MAX_STREAMS
+	PRIMESOCKET_API bool Send(unsigned short stream, char* data, size_t len);
+	// Datagram from the peer, delivers the messages it completes on the calling thread
+	PRIMESOCKET_API void Receive(char* data, size_t len);
+
+	PRIMESOCKET_API void setLossSimulator(UDP_LOSS_SIMULATOR* simulator);
+	PRIMESOCKET_API void getStats(UDP_CHANNEL_STATS* stats);
+
+private:
+	typedef struct
+	{
+		unsigned long long seq;
+		unsigned long long sentUs;
+		bool retransmitted; // No RTT sample from retransmitted packets (Karn)
+		bool fastRetransmitted;
+		bool lost; // Waiting to be resent after a timeout, not in flight
+		std::string packet;
+	}SENT_PACKET;
+
+	typedef struct
+	{
+		unsigned long long next; // Next fragment to deliver
+		std::unordered_map<unsigned long long, std::string> pending; // Fragments that arrived early, flags byte first
+		std::string message; // Fragments of the message being reassembled
+	}RECV_STREAM;
+
+	typedef struct
+	{
+		unsigned long long dueUs;
+		std::string packet;
+	}DELAYED_PACKET;
+
+	typedef struct
+	{
+		unsigned short stream;
+		std::string message;
+	}DELIVERY;
+
+	static DWORD WINAPI TimerLoop_ThreadCall(LPVOID param)
+	{
+		UdpChannel* _instance = (UdpChannel*)param;
+		return _instance->TimerLoop();
+	}
+	DWORD TimerLoop();
+
+	static unsigned long long NowUs();
+	void TrySend();
+	void Transmit(const std::string& packet, unsigned long long now);
+	void Retransmit(SENT_PACKET* sent, unsigned long long now);
+	void OnData(char* data, size_t len, std::list<DELIVERY>* deliveries);
+	void OnAck(char* data, size_t len);
+	void SendAck();
+	void UpdateRtt(unsigned long long sampleUs);
+	void OnLoss(bool timeout);
+
+	UdpSocket* _socket;
+	UDP_ENDPOINT _peer;
+	UDP_CHANNEL_MESSAGE_CALLBACK _messageCallback;
+	void* _dataPointers;
+
+	std::mutex _lock;
+	std::condition_variable _wake;
+	HANDLE _hTimer;
+	bool _running;
+
+	// Sender
+	unsigned long long _nextSeq;
+	std::list<SENT_PACKET> _unacked; // In sequence order
+	size_t _lostCount; // Packets of _unacked marked lost by the last timeout and not resent yet
+	std::list<std::string> _queue; // Fragments waiting for the congestion window, sequence not set yet
+	size_t _queuedBytes;
+	std::unordered_map<unsigned short, unsigned long long> _sendFragments;
+
+	// Congestion control and RTT estimation (RFC 6298)
+	double _cwnd;
+	double _ssthresh;
+	unsigned long long _recoveryPoint; // Losses of packets sent before this belong to the same loss event
+	double _srttUs;
+	double _rttvarUs;
+	double _rtoUs;
+
+	// Receiver
+	unsigned long long _recvNext; // Every packet below this was received
+	std::list<std::pair<unsigned long long, unsigned long long>> _recvRanges; // Received [start, end) ranges above _recvNext
+	std::unordered_map<unsigned short, RECV_STREAM> _recvStreams;
+
+	bool _simulate;
+	UDP_LOSS_SIMULATOR _simulator;
+	std::list<DELAYED_PACKET> _delayed; // Ordered by due time
+	unsigned long long _random;
+
+	unsigned long long _messagesSent;
+	unsigned long long _messagesDelivered;
+	unsigned long long _packetsSent;
+	unsigned long long _retransmissions;
+	unsigned long long _timeouts;
+	unsigned long long _fastRetransmits;
+	unsigned long long _simulatedDrops;
+};
\ No newline at end of file
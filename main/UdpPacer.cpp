@@ -0,0 +1,486 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#include "PrimeSocket.h"
+
+#define PACER_TICK_NS (UDP_PACER_TICK_US * 1000ULL)
+#define PACER_IDLE_WAIT_NS 100000000ULL
+
+UdpPacer::UdpPacer(UdpSocket* socket, ULONGLONG globalBytesPerSecond, ULONGLONG destinationBytesPerSecond, size_t burstBytes)
+{
+	_socket = socket;
+	_kernelPacing = false;
+	_global.bytesPerSecond = globalBytesPerSecond;
+	_global.tatNs = 0;
+	_destinationBytesPerSecond = destinationBytesPerSecond;
+	_burstBytes = burstBytes;
+
+	_wheel = (SLOT*)calloc(UDP_PACER_WHEEL_SLOTS, sizeof(SLOT));
+	_cursorTick = NowNs() / PACER_TICK_NS;
+	_wheelCount = 0;
+	_readyHead = 0;
+	_readyTail = 0;
+	_wakeNs = 0;
+	_queuedDatagrams = 0;
+	_queuedBytes = 0;
+
+	_datagramsSent = 0;
+	_bytesSent = 0;
+	_datagramsDropped = 0;
+	_windowStartNs = NowNs();
+	_windowBytes = 0;
+	_windowDatagrams = 0;
+	_windowDelayNs = 0;
+	_windowMaxDelayNs = 0;
+	_windowLatenessNs = 0;
+
+	_running = true;
+	_hPacer = SocketPolicy::CreateIoThread(PacerLoop_ThreadCall, this);
+}
+
+UdpPacer::~UdpPacer()
+{
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		_running = false;
+	}
+	_wake.notify_all();
+	if (_hPacer)
+	{
+		WaitForSingleObject(_hPacer, INFINITE);
+		CloseHandle(_hPacer);
+	}
+
+	// Datagrams still queued are dropped
+	for (size_t i = 0; i < UDP_PACER_WHEEL_SLOTS; i++)
+	{
+		while (_wheel[i].head)
+		{
+			PACED_DATAGRAM* next = _wheel[i].head->next;
+			free(_wheel[i].head);
+			_wheel[i].head = next;
+		}
+	}
+	for (std::list<PACED_DATAGRAM*>::iterator it = _overflow.begin(); it != _overflow.end(); ++it)
+		free(*it);
+	while (_readyHead)
+	{
+		PACED_DATAGRAM* next = _readyHead->next;
+		free(_readyHead);
+		_readyHead = next;
+	}
+	for (std::unordered_map<std::string, DESTINATION*>::iterator it = _destinations.begin(); it != _destinations.end(); ++it)
+		free(it->second);
+	free(_wheel);
+}
+
+ULONGLONG UdpPacer::NowNs()
+{
+	// steady_clock is CLOCK_MONOTONIC, the clock SO_TXTIME departure times are given in
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool UdpPacer::setKernelPacing(bool enable)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	if (!enable)
+	{
+		_kernelPacing = false;
+		return true;
+	}
+
+#ifdef SO_TXTIME
+	sock_txtime config;
+	config.clockid = CLOCK_MONOTONIC;
+	config.flags = 0;
+	if (setsockopt(_socket->_sock, SOL_SOCKET, SO_TXTIME, (char*)&config, sizeof(sock_txtime)) == SOCKET_ERROR)
+		return false;
+
+	_kernelPacing = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void UdpPacer::setGlobalRate(ULONGLONG bytesPerSecond)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	_global.bytesPerSecond = bytesPerSecond;
+}
+
+bool UdpPacer::setDestinationRate(UDP_ENDPOINT* to, ULONGLONG bytesPerSecond)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	DESTINATION* destination = FindDestination(to, NowNs());
+	if (!destination)
+		return false;
+
+	destination->bucket.bytesPerSecond = bytesPerSecond;
+	destination->ownRate = true;
+	return true;
+}
+
+UdpPacer::DESTINATION* UdpPacer::FindDestination(UDP_ENDPOINT* to, ULONGLONG nowNs)
+{
+	// Port and address only, the rest of the sockaddr is padding or scope
+	if (to->address.ss_family == AF_INET6)
+	{
+		sockaddr_in6* address = (sockaddr_in6*)&to->address;
+		_key.assign((char*)&address->sin6_port, 2);
+		_key.append((char*)&address->sin6_addr, 16);
+	}
+	else
+	{
+		sockaddr_in* address = (sockaddr_in*)&to->address;
+		_key.assign((char*)&address->sin_port, 2);
+		_key.append((char*)&address->sin_addr, 4);
+	}
+
+	std::unordered_map<std::string, DESTINATION*>::iterator it = _destinations.find(_key);
+	if (it != _destinations.end())
+		return it->second;
+
+	if (_destinations.size() >= UDP_PACER_MAX_DESTINATIONS)
+	{
+		EvictIdleDestinations(nowNs);
+		if (_destinations.size() >= UDP_PACER_MAX_DESTINATIONS)
+			return 0;
+	}
+
+	DESTINATION* destination = (DESTINATION*)calloc(1, sizeof(DESTINATION));
+	if (!destination)
+		return 0;
+	destination->endpoint = *to;
+	destination->bucket.bytesPerSecond = _destinationBytesPerSecond;
+	_destinations[_key] = destination;
+	return destination;
+}
+
+void UdpPacer::EvictIdleDestinations(ULONGLONG nowNs)
+{
+	// A bucket that refilled behaves exactly like a new one, nothing is lost by forgetting it
+	for (std::unordered_map<std::string, DESTINATION*>::iterator it = _destinations.begin(); it != _destinations.end();)
+	{
+		DESTINATION* destination = it->second;
+		if (destination->ownRate || destination->queued || destination->bucket.tatNs > nowNs)
+		{
+			++it;
+			continue;
+		}
+
+		free(destination);
+		it = _destinations.erase(it);
+	}
+}
+
+ULONGLONG UdpPacer::Allowed(BUCKET* bucket, ULONGLONG earliestNs)
+{
+	// When the bucket lets a datagram go, no earlier than earliestNs
+	if (!bucket->bytesPerSecond)
+		return earliestNs;
+
+	ULONGLONG burstNs = (ULONGLONG)(_burstBytes * 1e9 / bucket->bytesPerSecond);
+	return bucket->tatNs > earliestNs + burstNs ? bucket->tatNs - burstNs : earliestNs;
+}
+
+void UdpPacer::Charge(BUCKET* bucket, int len, ULONGLONG departureNs)
+{
+	if (!bucket->bytesPerSecond)
+		return;
+
+	ULONGLONG start = bucket->tatNs > departureNs ? bucket->tatNs : departureNs;
+	bucket->tatNs = start + (ULONGLONG)(len * 1e9 / bucket->bytesPerSecond);
+}
+
+void UdpPacer::Release(PACED_DATAGRAM* datagram)
+{
+	datagram->destination->queued--;
+	_queuedDatagrams--;
+	_queuedBytes -= datagram->len;
+	free(datagram);
+}
+
+bool UdpPacer::Write(UDP_ENDPOINT* to, char* datagram, int datagram_len)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	ULONGLONG now = NowNs();
+	DESTINATION* destination = FindDestination(to, now);
+	if (!destination)
+	{
+		_datagramsDropped++;
+		return false;
+	}
+
+	if (_kernelPacing)
+	{
+		// Both buckets are charged at the departure, see setKernelPacing
+		ULONGLONG departure = Allowed(&_global, Allowed(&destination->bucket, now));
+		Charge(&destination->bucket, datagram_len, departure);
+		Charge(&_global, datagram_len, departure);
+		if (!SendTimed(destination, datagram, datagram_len, departure))
+		{
+			_datagramsDropped++;
+			return false;
+		}
+		RecordSent(datagram_len, now, departure, departure);
+		return true;
+	}
+
+	PACED_DATAGRAM* paced = _queuedBytes + datagram_len <= UDP_PACER_MAX_QUEUED ? (PACED_DATAGRAM*)malloc(sizeof(PACED_DATAGRAM) + datagram_len) : 0;
+	if (!paced)
+	{
+		_datagramsDropped++;
+		return false;
+	}
+
+	// The wheel orders by what the destination allows, the global rate is charged when the pacer thread sends: a
+	// datagram held back by a slow destination takes no global capacity from the others until it leaves
+	paced->destination = destination;
+	paced->queuedNs = now;
+	paced->departureNs = Allowed(&destination->bucket, now);
+	Charge(&destination->bucket, datagram_len, paced->departureNs);
+	paced->len = datagram_len;
+	memcpy(paced->data, datagram, datagram_len);
+
+	// An idle wheel restarts at the current tick instead of catching up on the ticks it slept through
+	if (_wheelCount == 0 && _cursorTick < now / PACER_TICK_NS)
+		_cursorTick = now / PACER_TICK_NS;
+	_queuedDatagrams++;
+	_queuedBytes += datagram_len;
+	destination->queued++;
+	Enqueue(paced);
+
+	if (paced->departureNs < _wakeNs)
+		_wake.notify_one();
+	return true;
+}
+
+void UdpPacer::Enqueue(PACED_DATAGRAM* datagram)
+{
+	ULONGLONG tick = datagram->departureNs / PACER_TICK_NS;
+	if (tick < _cursorTick)
+		tick = _cursorTick;
+	if (tick >= _cursorTick + UDP_PACER_WHEEL_SLOTS)
+	{
+		_overflow.push_back(datagram);
+		return;
+	}
+
+	SLOT* slot = &_wheel[tick % UDP_PACER_WHEEL_SLOTS];
+	datagram->next = 0;
+	if (slot->tail)
+		slot->tail->next = datagram;
+	else
+		slot->head = datagram;
+	slot->tail = datagram;
+	_wheelCount++;
+}
+
+bool UdpPacer::SendTimed(DESTINATION* destination, char* datagram, int datagram_len, ULONGLONG departureNs)
+{
+#ifdef SO_TXTIME
+	iovec vector;
+	vector.iov_base = datagram;
+	vector.iov_len = datagram_len;
+
+	char control[CMSG_SPACE(sizeof(ULONGLONG))];
+	ZeroMemory(control, sizeof(control));
+
+	msghdr message;
+	ZeroMemory(&message, sizeof(msghdr));
+	message.msg_name = &destination->endpoint.address;
+	message.msg_namelen = destination->endpoint.addressLen;
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	// The fq qdisc holds the datagram until its departure time
+	cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(ULONGLONG));
+	memcpy(CMSG_DATA(cmsg), &departureNs, sizeof(ULONGLONG));
+
+	return sendmsg(_socket->_sock, &message, 0) != SOCKET_ERROR;
+#else
+	return false;
+#endif
+}
+
+void UdpPacer::RecordSent(int len, ULONGLONG queuedNs, ULONGLONG departureNs, ULONGLONG sentNs)
+{
+	_datagramsSent++;
+	_bytesSent += len;
+	_windowDatagrams++;
+	_windowBytes += len;
+
+	double delay = (double)(sentNs - queuedNs);
+	_windowDelayNs += delay;
+	if (delay > _windowMaxDelayNs)
+		_windowMaxDelayNs = delay;
+	_windowLatenessNs += sentNs > departureNs ? (double)(sentNs - departureNs) : 0;
+}
+
+DWORD UdpPacer::PacerLoop()
+{
+	UDP_BATCH_DATAGRAM batch[UDP_SEND_BATCH_CHUNK];
+	PACED_DATAGRAM* sending[UDP_SEND_BATCH_CHUNK];
+
+	std::unique_lock<std::mutex> guard(_lock);
+	while (_running)
+	{
+		ULONGLONG now = NowNs();
+		ULONGLONG nowTick = now / PACER_TICK_NS;
+
+		// Every slot that is due joins the ready queue, in departure order
+		while (_cursorTick <= nowTick)
+		{
+			if (_wheelCount == 0)
+			{
+				_cursorTick = nowTick + 1;
+				break;
+			}
+
+			SLOT* slot = &_wheel[_cursorTick % UDP_PACER_WHEEL_SLOTS];
+			for (PACED_DATAGRAM* datagram = slot->head; datagram; datagram = datagram->next)
+				_wheelCount--;
+			if (slot->head)
+			{
+				if (_readyTail)
+					_readyTail->next = slot->head;
+				else
+					_readyHead = slot->head;
+				_readyTail = slot->tail;
+				slot->head = 0;
+				slot->tail = 0;
+			}
+			_cursorTick++;
+		}
+
+		// Departures that came within the horizon move into the wheel
+		for (std::list<PACED_DATAGRAM*>::iterator it = _overflow.begin(); it != _overflow.end();)
+		{
+			if ((*it)->departureNs / PACER_TICK_NS < _cursorTick + UDP_PACER_WHEEL_SLOTS)
+			{
+				Enqueue(*it);
+				it = _overflow.erase(it);
+			}
+			else
+				++it;
+		}
+
+		// Send as much as the global rate allows, without the lock so Write is not held up, UDP_SEND_BATCH_CHUNK
+		// datagrams per WriteBatch. The global bucket is charged here, at the actual departure
+		while (_readyHead && Allowed(&_global, now) <= now)
+		{
+			int count = 0;
+			while (_readyHead && count < UDP_SEND_BATCH_CHUNK && Allowed(&_global, now) <= now)
+			{
+				PACED_DATAGRAM* datagram = _readyHead;
+				_readyHead = datagram->next;
+				if (!_readyHead)
+					_readyTail = 0;
+				Charge(&_global, datagram->len, now);
+
+				sending[count] = datagram;
+				batch[count].data = datagram->data;
+				batch[count].len = datagram->len;
+				batch[count].to = &datagram->destination->endpoint;
+				count++;
+			}
+
+			guard.unlock();
+			_socket->WriteBatch(batch, count);
+			ULONGLONG sent = NowNs();
+			guard.lock();
+
+			for (int i = 0; i < count; i++)
+			{
+				if (batch[i].result == SOCKET_ERROR)
+					_datagramsDropped++;
+				else
+					RecordSent(sending[i]->len, sending[i]->queuedNs, sending[i]->departureNs, sent);
+				Release(sending[i]);
+			}
+			now = sent;
+		}
+
+		// Sleep until the global rate lets the next ready datagram go, the next occupied slot or the earliest
+		// overflow departure
+		now = NowNs();
+		ULONGLONG wake = now + PACER_IDLE_WAIT_NS;
+		if (_readyHead)
+			wake = Allowed(&_global, now);
+		if (_wheelCount)
+		{
+			for (ULONGLONG tick = _cursorTick; tick < _cursorTick + UDP_PACER_WHEEL_SLOTS; tick++)
+			{
+				if (_wheel[tick % UDP_PACER_WHEEL_SLOTS].head)
+				{
+					if (tick * PACER_TICK_NS < wake)
+						wake = tick * PACER_TICK_NS;
+					break;
+				}
+			}
+		}
+		for (std::list<PACED_DATAGRAM*>::iterator it = _overflow.begin(); it != _overflow.end(); ++it)
+		{
+			if ((*it)->departureNs < wake)
+				wake = (*it)->departureNs;
+		}
+
+		_wakeNs = wake;
+		if (wake > now)
+			_wake.wait_until(guard, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(wake)));
+		_wakeNs = 0;
+	}
+	return 0;
+}
+
+void UdpPacer::getStats(UDP_PACER_STATS* stats)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	ULONGLONG now = NowNs();
+	double elapsed = (double)(now - _windowStartNs) / 1e9;
+
+	stats->kernelPacing = _kernelPacing;
+	stats->datagramsSent = _datagramsSent;
+	stats->bytesSent = _bytesSent;
+	stats->datagramsDropped = _datagramsDropped;
+	stats->queuedDatagrams = _queuedDatagrams;
+	stats->queuedBytes = _queuedBytes;
+	stats->achievedBytesPerSecond = elapsed > 0 ? _windowBytes / elapsed : 0;
+	stats->averageQueueDelayUs = _windowDatagrams ? _windowDelayNs / _windowDatagrams / 1000 : 0;
+	stats->maxQueueDelayUs = _windowMaxDelayNs / 1000;
+	stats->averageLatenessUs = _windowDatagrams ? _windowLatenessNs / _windowDatagrams / 1000 : 0;
+
+	_windowStartNs = now;
+	_windowBytes = 0;
+	_windowDatagrams = 0;
+	_windowDelayNs = 0;
+	_windowMaxDelayNs = 0;
+	_windowLatenessNs = 0;
+}
\ No newline at end of file
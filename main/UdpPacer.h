@@ -0,0 +1,152 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#define UDP_PACER_DEFAULT_BURST 16384 // Bytes a bucket lets go back to back after being idle
+#define UDP_PACER_MAX_QUEUED (64 * 1024 * 1024) // Bytes waiting in the timer wheel before Write refuses datagrams
+#define UDP_PACER_TICK_US 50 // Timer wheel resolution, datagrams due in the same tick leave in one WriteBatch
+#define UDP_PACER_WHEEL_SLOTS 4096 // About 200 ms ahead at 50 us ticks, later departures wait in an overflow list
+#define UDP_PACER_MAX_DESTINATIONS 65536 // Idle destinations are forgotten to make room, Write refuses new ones when none is idle
+
+typedef struct
+{
+	bool kernelPacing; // SO_TXTIME: departure times are handed to the fq qdisc, otherwise the timer wheel thread sends
+	unsigned long long datagramsSent;
+	unsigned long long bytesSent;
+	unsigned long long datagramsDropped; // Refused because the queue was full, or failed to send
+	size_t queuedDatagrams;
+	size_t queuedBytes;
+	// Since the previous getStats call
+	double achievedBytesPerSecond;
+	double averageQueueDelayUs; // Write to departure
+	double maxQueueDelayUs;
+	double averageLatenessUs; // Timer wheel only, actual departure after the destination allowed it, includes waiting for the global rate
+}UDP_PACER_STATS;
+
+// Spreads the datagrams written through it evenly over time, limited by a global rate and a rate per destination.
+// With SO_TXTIME (Linux, fq qdisc on the egress device) Write sends right away with a departure time for the kernel
+// to honour, otherwise the datagrams are queued in a timer wheel by the time their destination allows them and the
+// pacer thread sends them in that order as the global rate allows. Thread safe
+class UdpPacer
+{
+public:
+	// Rates in bytes per second, 0 for unlimited. destinationBytesPerSecond applies to every destination without its own rate
+	PRIMESOCKET_API UdpPacer(UdpSocket* socket, ULONGLONG globalBytesPerSecond, ULONGLONG destinationBytesPerSecond = 0, size_t burstBytes = UDP_PACER_DEFAULT_BURST);
+	PRIMESOCKET_API ~UdpPacer();
+
+	// SO_TXTIME pacing, only enable it when the egress device runs the fq qdisc: other qdiscs ignore the departure time
+	// and send at once. Returns false where SO_TXTIME is not supported, the timer wheel is used then.
+	// The departure is fixed in Write, so the global rate is charged at it: a datagram held back by its destination
+	// also holds back the datagrams written after it, to any destination
+	PRIMESOCKET_API bool setKernelPacing(bool enable);
+	PRIMESOCKET_API void setGlobalRate(ULONGLONG bytesPerSecond);
+	// A destination with its own rate is never forgotten, false when there is no room for another destination
+	PRIMESOCKET_API bool setDestinationRate(UDP_ENDPOINT* to, ULONGLONG bytesPerSecond);
+
+	// Copies the datagram and schedules it, false when the queue or the destinations are full or the send failed
+	PRIMESOCKET_API bool Write(UDP_ENDPOINT* to, char* datagram, int datagram_len);
+	PRIMESOCKET_API void getStats(UDP_PACER_STATS* stats);
+
+private:
+	// Token bucket in its virtual scheduling form: tatNs is when the bucket will be full again, a datagram may leave
+	// once that is no more than the burst ahead of it
+	typedef struct
+	{
+		ULONGLONG bytesPerSecond;
+		ULONGLONG tatNs;
+	}BUCKET;
+
+	typedef struct
+	{
+		UDP_ENDPOINT endpoint;
+		BUCKET bucket;
+		bool ownRate; // Set by setDestinationRate
+		size_t queued; // Datagrams waiting in the pacer
+	}DESTINATION;
+
+	typedef struct _PACED_DATAGRAM
+	{
+		struct _PACED_DATAGRAM* next;
+		DESTINATION* destination;
+		ULONGLONG queuedNs;
+		ULONGLONG departureNs;
+		int len;
+		char data[1];
+	}PACED_DATAGRAM;
+
+	typedef struct
+	{
+		PACED_DATAGRAM* head;
+		PACED_DATAGRAM* tail;
+	}SLOT;
+
+	static DWORD WINAPI PacerLoop_ThreadCall(LPVOID param)
+	{
+		UdpPacer* _instance = (UdpPacer*)param;
+		return _instance->PacerLoop();
+	}
+	DWORD PacerLoop();
+	static ULONGLONG NowNs();
+	ULONGLONG Allowed(BUCKET* bucket, ULONGLONG earliestNs);
+	void Charge(BUCKET* bucket, int len, ULONGLONG departureNs);
+	DESTINATION* FindDestination(UDP_ENDPOINT* to, ULONGLONG nowNs);
+	void EvictIdleDestinations(ULONGLONG nowNs);
+	void Release(PACED_DATAGRAM* datagram);
+	void Enqueue(PACED_DATAGRAM* datagram);
+	bool SendTimed(DESTINATION* destination, char* datagram, int datagram_len, ULONGLONG departureNs);
+	void RecordSent(int len, ULONGLONG queuedNs, ULONGLONG departureNs, ULONGLONG sentNs);
+
+	UdpSocket* _socket;
+	std::mutex _lock;
+	std::condition_variable _wake;
+	HANDLE _hPacer;
+	bool _running;
+	bool _kernelPacing;
+
+	BUCKET _global;
+	ULONGLONG _destinationBytesPerSecond;
+	size_t _burstBytes;
+	std::unordered_map<std::string, DESTINATION*> _destinations; // Keyed by the port and address bytes of the endpoint
+	std::string _key; // Reused for lookups, so finding a destination does not allocate
+
+	SLOT* _wheel;
+	ULONGLONG _cursorTick; // Next tick the pacer thread sends
+	size_t _wheelCount; // Datagrams in the wheel slots
+	std::list<PACED_DATAGRAM*> _overflow; // Due beyond the wheel horizon
+	PACED_DATAGRAM* _readyHead; // Allowed by their destination, waiting for the global rate in that order
+	PACED_DATAGRAM* _readyTail;
+	ULONGLONG _wakeNs; // When the pacer thread sleeps until
+	size_t _queuedDatagrams;
+	size_t _queuedBytes;
+
+	unsigned long long _datagramsSent;
+	unsigned long long _bytesSent;
+	unsigned long long _datagramsDropped;
+	ULONGLONG _windowStartNs;
+	unsigned long long _windowBytes;
+	unsigned long long _windowDatagrams;
+	double _windowDelayNs;
+	double _windowMaxDelayNs;
+	double _windowLatenessNs;
+};
\ No newline at end of file
@@ -0,0 +1,85 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#include "PrimeSocket.h"
+
+const size_t UdpPacketPool::_sizeClasses[UDP_PACKET_SIZE_CLASSES] = { 256, 1024, 2048, 9216, 16384, 65536 };
+UdpPacketPool::FREE_LIST UdpPacketPool::_freeLists[UDP_PACKET_SIZE_CLASSES];
+
+UDP_PACKET* UdpPacketPool::Alloc(size_t len)
+{
+	int sizeClass = 0;
+	while (sizeClass < UDP_PACKET_SIZE_CLASSES && _sizeClasses[sizeClass] < len)
+		sizeClass++;
+	if (sizeClass == UDP_PACKET_SIZE_CLASSES)
+		return 0;
+
+	FREE_LIST* freeList = &_freeLists[sizeClass];
+	UDP_PACKET* packet = 0;
+	{
+		std::lock_guard<std::mutex> guard(freeList->lock);
+		packet = freeList->head;
+		if (packet)
+		{
+			freeList->head = packet->next;
+			freeList->count--;
+		}
+	}
+
+	if (!packet)
+	{
+		// Only the header is initialized, the payload is overwritten by the receive anyway
+		packet = (UDP_PACKET*)malloc(offsetof(UDP_PACKET, data) + _sizeClasses[sizeClass]);
+		if (!packet)
+			return 0;
+		packet->capacity = _sizeClasses[sizeClass];
+		packet->sizeClass = sizeClass;
+	}
+
+	packet->next = 0;
+	packet->len = 0;
+	packet->peerLen = 0;
+	packet->peerString[0] = 0;
+	return packet;
+}
+
+void UdpPacketPool::Release(UDP_PACKET* packet)
+{
+	if (!packet)
+		return;
+
+	FREE_LIST* freeList = &_freeLists[packet->sizeClass];
+	{
+		std::lock_guard<std::mutex> guard(freeList->lock);
+		if (freeList->count < UDP_PACKET_POOL_MAX_CACHED)
+		{
+			packet->next = freeList->head;
+			freeList->head = packet;
+			freeList->count++;
+			return;
+		}
+	}
+
+	free(packet);
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#define UDP_PACKET_SIZE_CLASSES 6
+#define UDP_PACKET_POOL_MAX_CACHED 1024 // Free packets kept per size class, the rest go back to the heap
+
+// Received datagram sized to its payload. The peer is kept in binary form, UdpSocket::getPeerAddress formats it on first use
+typedef struct _UDP_PACKET
+{
+	struct _UDP_PACKET* next; // Free list link while the packet is in the pool
+	size_t len;
+	size_t capacity;
+	int sizeClass;
+	int peerLen;
+	sockaddr_storage peer;
+	char peerString[INET6_ADDRSTRLEN];
+	RECEIVE_TIMESTAMP timestamp; // Set when UdpSocket::setReceiveTimestamps is enabled
+	char data[1];
+}UDP_PACKET;
+
+// Free lists of UDP_PACKET per payload size class, shared by every UdpSocket
+class UdpPacketPool
+{
+public:
+	// Packet with room for at least len bytes of payload, 0 if len is larger than a datagram
+	PRIMESOCKET_API static UDP_PACKET* Alloc(size_t len);
+	PRIMESOCKET_API static void Release(UDP_PACKET* packet);
+
+private:
+	typedef struct
+	{
+		std::mutex lock;
+		UDP_PACKET* head;
+		int count;
+	}FREE_LIST;
+
+	static const size_t _sizeClasses[UDP_PACKET_SIZE_CLASSES];
+	static FREE_LIST _freeLists[UDP_PACKET_SIZE_CLASSES];
+};
\ No newline at end of file
@@ -0,0 +1,284 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#include "PrimeSocket.h"
+
+UdpSessionTable::UdpSessionTable(UDP_SESSION_OPEN_CALLBACK openCallback, UDP_SESSION_DATAGRAM_CALLBACK datagramCallback, UDP_SESSION_CLOSED_CALLBACK closedCallback,
+	void* dataPointers, size_t maxSessions, DWORD idleTimeoutMs)
+{
+	_openCallback = openCallback;
+	_datagramCallback = datagramCallback;
+	_closedCallback = closedCallback;
+	_dataPointers = dataPointers;
+	_idleTimeoutMs = idleTimeoutMs;
+	_nextExpiry = GetTickCount64() + UDP_SESSION_EXPIRE_INTERVAL_MS;
+	_maxSessions = maxSessions ? maxSessions : 1;
+
+	// At most half the slots are used, probe sequences stay short
+	size_t slotCount = 16;
+	while (slotCount < _maxSessions * 2)
+		slotCount <<= 1;
+	_slotMask = slotCount - 1;
+
+	_slots = (SLOT*)malloc(slotCount * sizeof(SLOT));
+	for (size_t i = 0; i < slotCount; i++)
+		_slots[i].session = -1;
+
+	_sessions = (UDP_SESSION*)malloc(_maxSessions * sizeof(UDP_SESSION));
+	_sessionHashes = (unsigned int*)malloc(_maxSessions * sizeof(unsigned int));
+	_freeSessions = (int*)malloc(_maxSessions * sizeof(int));
+	for (size_t i = 0; i < _maxSessions; i++)
+		_freeSessions[i] = (int)(_maxSessions - 1 - i);
+	_freeCount = _maxSessions;
+
+	_opened = 0;
+	_expired = 0;
+	_rejected = 0;
+	_dropped = 0;
+}
+
+UdpSessionTable::~UdpSessionTable()
+{
+	for (size_t i = 0; i <= _slotMask; i++)
+	{
+		if (_slots[i].session >= 0 && _closedCallback)
+			_closedCallback(&_sessions[_slots[i].session], _dataPointers);
+	}
+
+	free(_slots);
+	free(_sessions);
+	free(_sessionHashes);
+	free(_freeSessions);
+}
+
+unsigned int UdpSessionTable::HashPeer(sockaddr_storage* peer)
+{
+	unsigned int words[4];
+	int wordCount;
+	unsigned long long h;
+	if (peer->ss_family == AF_INET6)
+	{
+		sockaddr_in6* address = (sockaddr_in6*)peer;
+		memcpy(words, &address->sin6_addr, 16);
+		wordCount = 4;
+		h = address->sin6_port;
+	}
+	else
+	{
+		sockaddr_in* address = (sockaddr_in*)peer;
+		memcpy(words, &address->sin_addr, 4);
+		wordCount = 1;
+		h = address->sin_port;
+	}
+
+	h = (h + 0x9E3779B97F4A7C15ULL) * 0xFF51AFD7ED558CCDULL;
+	for (int i = 0; i < wordCount; i++)
+		h = (h ^ words[i]) * 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return (unsigned int)h;
+}
+
+bool UdpSessionTable::SamePeer(sockaddr_storage* a, UDP_ENDPOINT* b)
+{
+	if (a->ss_family != b->address.ss_family)
+		return false;
+
+	if (a->ss_family == AF_INET6)
+	{
+		sockaddr_in6* a6 = (sockaddr_in6*)a;
+		sockaddr_in6* b6 = (sockaddr_in6*)&b->address;
+		return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
+	}
+
+	sockaddr_in* a4 = (sockaddr_in*)a;
+	sockaddr_in* b4 = (sockaddr_in*)&b->address;
+	return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+size_t UdpSessionTable::FindSlot(sockaddr_storage* peer, unsigned int hash)
+{
+	// Linear probing, stops at the peer's slot or at the empty slot it would go in
+	size_t slot = hash & _slotMask;
+	while (_slots[slot].session >= 0)
+	{
+		if (_slots[slot].hash == hash && SamePeer(peer, &_sessions[_slots[slot].session].peer))
+			return slot;
+		slot = (slot + 1) & _slotMask;
+	}
+	return slot;
+}
+
+void UdpSessionTable::BatchReceived(UDP_DATAGRAM_BATCH* batch, void* table)
+{
+	((UdpSessionTable*)table)->Dispatch(batch);
+}
+
+void UdpSessionTable::Dispatch(UDP_DATAGRAM_BATCH* batch)
+{
+	ULONGLONG now = GetTickCount64();
+	if (now >= _nextExpiry)
+		ExpireIdle();
+
+	for (size_t i = 0; i < batch->count; i++)
+		Deliver(&batch->entries[i].from, batch->entries[i].data, batch->entries[i].len, now);
+}
+
+void UdpSessionTable::Dispatch(sockaddr_storage* from, char* data, size_t len)
+{
+	ULONGLONG now = GetTickCount64();
+	if (now >= _nextExpiry)
+		ExpireIdle();
+
+	Deliver(from, data, len, now);
+}
+
+void UdpSessionTable::Deliver(sockaddr_storage* from, char* data, size_t len, ULONGLONG now)
+{
+	unsigned int hash = HashPeer(from);
+	size_t slot = FindSlot(from, hash);
+
+	UDP_SESSION* session;
+	if (_slots[slot].session >= 0)
+		session = &_sessions[_slots[slot].session];
+	else
+	{
+		session = Open(from, hash, slot, now);
+		if (!session)
+			return;
+	}
+
+	session->lastActivity = now;
+	session->datagramsReceived++;
+	session->bytesReceived += len;
+	_datagramCallback(session, data, len, _dataPointers);
+}
+
+UDP_SESSION* UdpSessionTable::Open(sockaddr_storage* peer, unsigned int hash, size_t slot, ULONGLONG now)
+{
+	if (_freeCount == 0)
+	{
+		_dropped++;
+		return 0;
+	}
+
+	int index = _freeSessions[--_freeCount];
+	UDP_SESSION* session = &_sessions[index];
+	ZeroMemory(session, sizeof(UDP_SESSION));
+	session->peer.addressLen = peer->ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+	memcpy(&session->peer.address, peer, session->peer.addressLen);
+	session->created = now;
+	session->lastActivity = now;
+
+	if (_openCallback && !_openCallback(session, _dataPointers))
+	{
+		_freeSessions[_freeCount++] = index;
+		_rejected++;
+		return 0;
+	}
+
+	_slots[slot].hash = hash;
+	_slots[slot].session = index;
+	_sessionHashes[index] = hash;
+	_opened++;
+	return session;
+}
+
+UDP_SESSION* UdpSessionTable::Find(sockaddr_storage* peer)
+{
+	size_t slot = FindSlot(peer, HashPeer(peer));
+	if (_slots[slot].session < 0)
+		return 0;
+
+	return &_sessions[_slots[slot].session];
+}
+
+void UdpSessionTable::Close(UDP_SESSION* session)
+{
+	int index = (int)(session - _sessions);
+	size_t slot = FindSlot(&session->peer.address, _sessionHashes[index]);
+	if (_slots[slot].session != index)
+		return;
+
+	if (_closedCallback)
+		_closedCallback(session, _dataPointers);
+
+	RemoveSlot(slot);
+	_freeSessions[_freeCount++] = index;
+}
+
+void UdpSessionTable::RemoveSlot(size_t slot)
+{
+	// Backward shift deletion: pull later entries of the probe sequence into the hole, so lookups never need tombstones
+	size_t hole = slot;
+	size_t next = slot;
+	while (true)
+	{
+		next = (next + 1) & _slotMask;
+		if (_slots[next].session < 0)
+			break;
+
+		size_t home = _slots[next].hash & _slotMask;
+		if (((next - home) & _slotMask) >= ((next - hole) & _slotMask))
+		{
+			_slots[hole] = _slots[next];
+			hole = next;
+		}
+	}
+	_slots[hole].session = -1;
+}
+
+size_t UdpSessionTable::ExpireIdle()
+{
+	ULONGLONG now = GetTickCount64();
+	_nextExpiry = now + UDP_SESSION_EXPIRE_INTERVAL_MS;
+	if (_idleTimeoutMs == 0)
+		return 0;
+
+	size_t closed = 0;
+	size_t slot = 0;
+	while (slot <= _slotMask)
+	{
+		int index = _slots[slot].session;
+		if (index >= 0 && now - _sessions[index].lastActivity > _idleTimeoutMs)
+		{
+			// Removing shifts a later entry into this slot, look at it again
+			Close(&_sessions[index]);
+			closed++;
+			continue;
+		}
+		slot++;
+	}
+
+	_expired += closed;
+	return closed;
+}
+
+void UdpSessionTable::getStats(UDP_SESSION_STATS* stats)
+{
+	stats->sessions = _maxSessions - _freeCount;
+	stats->opened = _opened;
+	stats->expired = _expired;
+	stats->rejected = _rejected;
+	stats->dropped = _dropped;
+}
\ No newline at end of file
@@ -0,0 +1,109 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#define UDP_SESSION_DEFAULT_MAX 65536
+#define UDP_SESSION_DEFAULT_IDLE_MS 30000
+#define UDP_SESSION_EXPIRE_INTERVAL_MS 1000 // How often Dispatch looks for idle sessions
+
+// Virtual connection of one peer, the pointer stays valid until the closed callback returns
+typedef struct _UDP_SESSION
+{
+	UDP_ENDPOINT peer; // Reply with UdpSocket::Write(&session->peer, ...)
+	void* context; // Per-peer state, set it in the open callback
+	ULONGLONG created;
+	ULONGLONG lastActivity;
+	unsigned long long datagramsReceived;
+	unsigned long long bytesReceived;
+}UDP_SESSION;
+
+// Return false from the open callback to ignore the peer, its datagram is dropped and no session is created
+typedef bool(__stdcall* UDP_SESSION_OPEN_CALLBACK)(UDP_SESSION* session, void* dataPointers);
+typedef void(__stdcall* UDP_SESSION_DATAGRAM_CALLBACK)(UDP_SESSION* session, char* data, size_t len, void* dataPointers);
+typedef void(__stdcall* UDP_SESSION_CLOSED_CALLBACK)(UDP_SESSION* session, void* dataPointers);
+
+typedef struct
+{
+	size_t sessions;
+	unsigned long long opened;
+	unsigned long long expired;
+	unsigned long long rejected; // Refused by the open callback
+	unsigned long long dropped; // Datagrams of new peers while the table was full
+}UDP_SESSION_STATS;
+
+// Maps datagrams to per-peer sessions by binary address and port. Sessions are preallocated and indexed by an open
+// addressing table, so a lookup is one hash and usually one cache line and no allocation. Not thread safe: use one
+// table per read loop (per shard with UdpShardedSocket) and call it from that loop only
+class UdpSessionTable
+{
+public:
+	PRIMESOCKET_API UdpSessionTable(UDP_SESSION_OPEN_CALLBACK openCallback, UDP_SESSION_DATAGRAM_CALLBACK datagramCallback, UDP_SESSION_CLOSED_CALLBACK closedCallback,
+		void* dataPointers, size_t maxSessions = UDP_SESSION_DEFAULT_MAX, DWORD idleTimeoutMs = UDP_SESSION_DEFAULT_IDLE_MS);
+	PRIMESOCKET_API ~UdpSessionTable();
+
+	// Bind a UdpSocket with this as the batch callback and the table as dataPointers to feed it directly
+	PRIMESOCKET_API static void __stdcall BatchReceived(UDP_DATAGRAM_BATCH* batch, void* table);
+	PRIMESOCKET_API void Dispatch(UDP_DATAGRAM_BATCH* batch);
+	PRIMESOCKET_API void Dispatch(sockaddr_storage* from, char* data, size_t len);
+
+	PRIMESOCKET_API UDP_SESSION* Find(sockaddr_storage* peer);
+	PRIMESOCKET_API void Close(UDP_SESSION* session);
+	// Closes the sessions idle for longer than the timeout, returns how many were closed
+	PRIMESOCKET_API size_t ExpireIdle();
+	PRIMESOCKET_API void getStats(UDP_SESSION_STATS* stats);
+
+private:
+	typedef struct
+	{
+		unsigned int hash;
+		int session; // Index into _sessions, -1 for an empty slot
+	}SLOT;
+
+	static unsigned int HashPeer(sockaddr_storage* peer);
+	static bool SamePeer(sockaddr_storage* a, UDP_ENDPOINT* b);
+	size_t FindSlot(sockaddr_storage* peer, unsigned int hash);
+	void Deliver(sockaddr_storage* from, char* data, size_t len, ULONGLONG now);
+	UDP_SESSION* Open(sockaddr_storage* peer, unsigned int hash, size_t slot, ULONGLONG now);
+	void RemoveSlot(size_t slot);
+
+	UDP_SESSION_OPEN_CALLBACK _openCallback;
+	UDP_SESSION_DATAGRAM_CALLBACK _datagramCallback;
+	UDP_SESSION_CLOSED_CALLBACK _closedCallback;
+	void* _dataPointers;
+	DWORD _idleTimeoutMs;
+	ULONGLONG _nextExpiry;
+
+	SLOT* _slots;
+	size_t _slotMask;
+	UDP_SESSION* _sessions;
+	unsigned int* _sessionHashes;
+	int* _freeSessions; // Stack of unused indices into _sessions
+	size_t _freeCount;
+	size_t _maxSessions;
+
+	unsigned long long _opened;
+	unsigned long long _expired;
+	unsigned long long _rejected;
+	unsigned long long _dropped;
+};
\ No newline at end of file
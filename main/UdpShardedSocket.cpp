@@ -0,0 +1,167 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define LIBRARY_EXPORTS
+#include "PrimeSocket.h"
+
+UdpShardedSocket::UdpShardedSocket(int family)
+{
+	_family = family;
+	_flowSteering = false;
+	_batchSize = UDP_RECV_BATCH_DEFAULT;
+	_batchDatagramSize = UDP_MAX_DATAGRAM_SIZE;
+	_shardCount = 0;
+	ZeroMemory(_shards, sizeof(_shards));
+}
+
+bool UdpShardedSocket::setFlowSteering(bool enable)
+{
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+	return false;
+#else
+	if (_shardCount)
+		return false;
+
+	_flowSteering = enable;
+	return true;
+#endif
+}
+
+bool UdpShardedSocket::setReceiveBatch(unsigned int batchSize, size_t maxDatagramSize)
+{
+	if (_shardCount || batchSize == 0 || batchSize > UDP_RECV_BATCH_MAX)
+		return false;
+	if (maxDatagramSize == 0 || maxDatagramSize > UDP_MAX_DATAGRAM_SIZE)
+		return false;
+
+	_batchSize = batchSize;
+	_batchDatagramSize = maxDatagramSize;
+	return true;
+}
+
+bool UdpShardedSocket::Bind(char* addr, char* port, unsigned int shardCount, DATAGRAM_BATCH_RECEIVED_CALLBACK batchReceivedCallback, void* dataPointers, ULONGLONG cpuMask)
+{
+	if (_shardCount || shardCount == 0 || shardCount > UDP_MAX_SHARDS)
+		return false;
+#ifndef SO_REUSEPORT
+	shardCount = 1;
+#endif
+
+	int cpu = -1;
+	for (unsigned int i = 0; i < shardCount; i++)
+	{
+		// Next CPU of the mask, wrapping around when there are more shards than CPUs
+		if (cpuMask)
+		{
+			do
+				cpu = (cpu + 1) % 64;
+			while (!(cpuMask & (1ULL << cpu)));
+		}
+		else
+			cpu = i % 64;
+
+		UdpSocket* shard = new UdpSocket(_family);
+		shard->_shardIndex = i;
+		_shards[i] = shard;
+		_shardCount = i + 1;
+
+		// The reuseport group orders sockets by bind, so shard i is index i for the steering program
+		if ((shardCount > 1 && !shard->setSocketOption(UdpSocket::SOCKETOPT::ReusePort, TRUE)) ||
+			!shard->setReceiveBatch(_batchSize, _batchDatagramSize) || !shard->setReadLoopAffinity(1ULL << cpu) ||
+			!shard->Bind(addr, port, batchReceivedCallback, dataPointers))
+		{
+			Close();
+			return false;
+		}
+	}
+
+	if (_flowSteering && !AttachFlowSteering())
+	{
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool UdpShardedSocket::AttachFlowSteering()
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	// The kernel only fills the skb flow hash when the NIC computed one (not on loopback), so hash the source address
+	// and port out of the packet: A = (saddr ^ sport) * golden ratio >> 16; return A % shardCount
+	sock_filter code[] = {
+		{ BPF_LD | BPF_B | BPF_ABS, 0, 0, (unsigned int)SKF_NET_OFF },
+		{ BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4 },
+		{ BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 6 },
+		// IPv4: X = header length, UDP source port right after the header, last word of the source address at 12
+		{ BPF_LDX | BPF_B | BPF_MSH, 0, 0, (unsigned int)SKF_NET_OFF },
+		{ BPF_LD | BPF_H | BPF_IND, 0, 0, (unsigned int)SKF_NET_OFF },
+		{ BPF_ST, 0, 0, 0 },
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (unsigned int)(SKF_NET_OFF + 12) },
+		{ BPF_JMP | BPF_JA, 0, 0, 3 },
+		// IPv6: fixed 40 byte header, last word of the source address at 20
+		{ BPF_LD | BPF_H | BPF_ABS, 0, 0, (unsigned int)(SKF_NET_OFF + 40) },
+		{ BPF_ST, 0, 0, 0 },
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (unsigned int)(SKF_NET_OFF + 20) },
+		{ BPF_LDX | BPF_W | BPF_MEM, 0, 0, 0 },
+		{ BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+		{ BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9E3779B1 },
+		{ BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, _shardCount },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+
+	sock_fprog program;
+	program.len = sizeof(code) / sizeof(sock_filter);
+	program.filter = code;
+
+	// The program belongs to the whole reuseport group, attaching it to one shard is enough
+	return setsockopt(_shards[0]->_sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, (char*)&program, sizeof(sock_fprog)) != SOCKET_ERROR;
+#else
+	return false;
+#endif
+}
+
+unsigned int UdpShardedSocket::getShardCount()
+{
+	return _shardCount;
+}
+
+UdpSocket* UdpShardedSocket::getShard(unsigned int index)
+{
+	if (index >= _shardCount)
+		return 0;
+
+	return _shards[index];
+}
+
+void UdpShardedSocket::Close()
+{
+	for (unsigned int i = 0; i < _shardCount; i++)
+	{
+		_shards[i]->Close();
+		delete _shards[i];
+		_shards[i] = 0;
+	}
+	_shardCount = 0;
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+/*
+ * MIT License
+ * Copyright (c) 2023 Kamran
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#define UDP_MAX_SHARDS 64
+
+// Receives one UDP port on several cores: each shard is a SO_REUSEPORT socket with its own batch read loop
+// pinned to one CPU, the kernel spreads the datagrams over the shards by flow
+class UdpShardedSocket
+{
+public:
+	PRIMESOCKET_API UdpShardedSocket(int family = AF_INET);
+
+	// Pick the shard with a reuseport BPF program hashing the peer address and port, so a peer always lands on the same shard
+	// whatever the number of senders. Linux only, call before Bind
+	PRIMESOCKET_API bool setFlowSteering(bool enable);
+	PRIMESOCKET_API bool setReceiveBatch(unsigned int batchSize = UDP_RECV_BATCH_DEFAULT, size_t maxDatagramSize = UDP_MAX_DATAGRAM_SIZE);
+	// Shard i is pinned to the i-th CPU of cpuMask (CPU i when cpuMask is 0). Without SO_REUSEPORT (Windows) a single shard is opened
+	PRIMESOCKET_API bool Bind(char* addr, char* port, unsigned int shardCount, DATAGRAM_BATCH_RECEIVED_CALLBACK batchReceivedCallback, void* dataPointers, ULONGLONG cpuMask = 0);
+
+	PRIMESOCKET_API unsigned int getShardCount();
+	PRIMESOCKET_API UdpSocket* getShard(unsigned int index);
+	PRIMESOCKET_API void Close();
+
+private:
+	bool AttachFlowSteering();
+
+	int _family;
+	bool _flowSteering;
+	unsigned int _batchSize;
+	size_t _batchDatagramSize;
+	unsigned int _shardCount;
+	UdpSocket* _shards[UDP_MAX_SHARDS];
+};
\ No newline at end of file
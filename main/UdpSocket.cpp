@@ -23,13 +23,38 @@
 
 #include "PrimeSocket.h"
 
-UdpSocket::UdpSocket()
+UdpSocket::UdpSocket() : UdpSocket(AF_INET)
 {
-    _sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+}
+
+UdpSocket::UdpSocket(int family)
+{
+    _ai_family = family;
+    _sock = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+    if (family == AF_INET6)
+    {
+        // Dual-stack, IPv4 peers show up as v4-mapped addresses
+        int v6Only = 0;
+        setsockopt(_sock, IPPROTO_IPV6, IPV6_V6ONLY, (char*)&v6Only, sizeof(int));
+    }
+    _connected = false;
     _datagramReceivedCallback = 0;
     _datagramReceivedMemberCallback = 0;
+    _packetReceivedCallback = 0;
+    _batchReceivedCallback = 0;
+    _bound = false;
+    _batchSize = UDP_RECV_BATCH_DEFAULT;
+    _batchDatagramSize = UDP_MAX_DATAGRAM_SIZE;
+    _receiveOffload = false;
+    _readLoopAffinity = 0;
+    _shardIndex = 0;
+    _receiveTimestamps = false;
+    _groups = 0;
+    _groupCount = 0;
+    _groupVersion = 0;
     _hReadLoop = INVALID_HANDLE_VALUE;
     _hMemCallback = INVALID_HANDLE_VALUE;
+    ZeroMemory(&_busyPoll, sizeof(BUSY_POLL_POLICY));
 }
 
 bool UdpSocket::Bind(char* addr, char* port, DATAGRAM_RECEIVED_CALLBACK datagramReceivedCallback)
@@ -38,7 +63,7 @@ bool UdpSocket::Bind(char* addr, char* port, DATAGRAM_RECEIVED_CALLBACK datagram
     int iResult;
 
     ZeroMemory(&hints, sizeof(hints));
-    hints.ai_family = AF_INET;
+    hints.ai_family = _ai_family;
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_protocol = IPPROTO_UDP;
     hints.ai_flags = AI_PASSIVE;
@@ -57,7 +82,7 @@ bool UdpSocket::Bind(char* addr, char* port, DATAGRAM_RECEIVED_CALLBACK datagram
     _bound = true;
     _datagramReceivedCallback = datagramReceivedCallback;
     callbackType = 0;
-    _hReadLoop = CreateThread(0, 0, DatagramReadLoop_ThreadCall, this, 0, 0);
+    _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
 
     return true;
 }
@@ -68,7 +93,7 @@ bool UdpSocket::Bind(char* addr, char* port, DATAGRAM_RECEIVED_P_CALLBACK datagr
     int iResult;
 
     ZeroMemory(&hints, sizeof(hints));
-    hints.ai_family = AF_INET;
+    hints.ai_family = _ai_family;
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_protocol = IPPROTO_UDP;
     hints.ai_flags = AI_PASSIVE;
@@ -88,7 +113,76 @@ bool UdpSocket::Bind(char* addr, char* port, DATAGRAM_RECEIVED_P_CALLBACK datagr
     _datagramReceivedMemberCallback = datagramReceivedCallback;
     _dataPointers = dataPointers;
     callbackType = 1;
-    _hReadLoop = CreateThread(0, 0, DatagramReadLoop_ThreadCall, this, 0, 0);
+    _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
+
+    return true;
+}
+
+bool UdpSocket::Bind(char* addr, char* port, DATAGRAM_PACKET_RECEIVED_CALLBACK packetReceivedCallback, void* dataPointers)
+{
+    struct addrinfo* result = NULL, hints;
+    int iResult;
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = _ai_family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_flags = AI_PASSIVE;
+
+    iResult = getaddrinfo(addr, port, &hints, &result);
+    if (iResult != 0) {
+        return false;
+    }
+
+    iResult = bind(_sock, result->ai_addr, (int)result->ai_addrlen);
+    if (iResult == SOCKET_ERROR) {
+        return false;
+    }
+    freeaddrinfo(result); // No longer needed
+
+    _bound = true;
+    _packetReceivedCallback = packetReceivedCallback;
+    _dataPointers = dataPointers;
+    callbackType = 3;
+    _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
+
+    return true;
+}
+
+bool UdpSocket::Bind(char* addr, char* port, DATAGRAM_BATCH_RECEIVED_CALLBACK batchReceivedCallback, void* dataPointers)
+{
+    struct addrinfo* result = NULL, hints;
+    int iResult;
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = _ai_family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_flags = AI_PASSIVE;
+
+    iResult = getaddrinfo(addr, port, &hints, &result);
+    if (iResult != 0) {
+        return false;
+    }
+
+    iResult = bind(_sock, result->ai_addr, (int)result->ai_addrlen);
+    if (iResult == SOCKET_ERROR) {
+        return false;
+    }
+    freeaddrinfo(result); // No longer needed
+
+#ifdef UDP_GRO
+    // Not fatal, older kernels just deliver the datagrams one by one
+    int gro = _receiveOffload ? 1 : 0;
+    if (_receiveOffload && setsockopt(_sock, IPPROTO_UDP, UDP_GRO, (char*)&gro, sizeof(int)) == SOCKET_ERROR)
+        _receiveOffload = false;
+#endif
+
+    _bound = true;
+    _batchReceivedCallback = batchReceivedCallback;
+    _dataPointers = dataPointers;
+    callbackType = 2;
+    _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
 
     return true;
 }
@@ -114,9 +208,33 @@ bool UdpSocket::setReceiverCallback(DATAGRAM_RECEIVED_P_CALLBACK datagramReceive
     return true;
 }
 
+bool UdpSocket::setReceiverCallback(DATAGRAM_PACKET_RECEIVED_CALLBACK packetReceivedCallback, void* dataPointers)
+{
+    if (!_sock || _sock == INVALID_SOCKET || _sock == SOCKET_ERROR)
+        return false;
+
+    _packetReceivedCallback = packetReceivedCallback;
+    _dataPointers = dataPointers;
+    callbackType = 3;
+    return true;
+}
+
+// SO_RCVTIMEO and SO_SNDTIMEO take milliseconds on Windows, a timeval everywhere else
+static int SetTimeoutOption(SOCKET sock, int name, DWORD value)
+{
+#ifdef _WIN32
+    return setsockopt(sock, SOL_SOCKET, name, (char*)&value, sizeof(DWORD));
+#else
+    timeval tv;
+    tv.tv_sec = value / 1000;
+    tv.tv_usec = (value % 1000) * 1000;
+    return setsockopt(sock, SOL_SOCKET, name, (char*)&tv, sizeof(timeval));
+#endif
+}
+
 bool UdpSocket::setSocketOption(SOCKETOPT opt, DWORD value)
 {
-    if (opt == 0 || opt > 5)
+    if (opt == 0 || opt > 6)
         return false;
 
     int result = 0;
@@ -134,6 +252,9 @@ bool UdpSocket::setSocketOption(SOCKETOPT opt, DWORD value)
 
         break;
     case ChecksumEnabled:
+#ifndef UDP_CHECKSUM_COVERAGE
+        return false; // UDP-Lite checksum coverage is a Windows socket option
+#else
         if (value != TRUE && value != FALSE)
             return false;
 
@@ -160,13 +281,17 @@ bool UdpSocket::setSocketOption(SOCKETOPT opt, DWORD value)
             else
                 return false;
         }
+#endif
 
         break;
     case SendMsgSize:
 #ifdef _WIN32
         result = WSASetUdpSendMessageSize(_sock, value);
+#elif defined(UDP_SEGMENT)
+        // Linux equivalent of the Windows UDP send offload message size
+        result = setsockopt(_sock, IPPROTO_UDP, UDP_SEGMENT, (char*)&value, sizeof(int));
 #else
-        result = setsockopt(_sock, IPPROTO_UDP, UDP_SEND_MSG_SIZE, (char*)&value, sizeof(unsigned long));
+        return false;
 #endif
 
         if (result != SOCKET_ERROR)
@@ -176,7 +301,7 @@ bool UdpSocket::setSocketOption(SOCKETOPT opt, DWORD value)
 
         break;
     case RecvTimeout:
-        result = setsockopt(_sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&value, sizeof(DWORD));
+        result = SetTimeoutOption(_sock, SO_RCVTIMEO, value);
         if (result != SOCKET_ERROR)
             return true;
         else
@@ -184,11 +309,26 @@ bool UdpSocket::setSocketOption(SOCKETOPT opt, DWORD value)
 
         break;
     case SendTimeout:
-        result = setsockopt(_sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&value, sizeof(DWORD));
+        result = SetTimeoutOption(_sock, SO_SNDTIMEO, value);
+        if (result != SOCKET_ERROR)
+            return true;
+        else
+            return false;
+
+        break;
+    case ReusePort:
+#ifndef SO_REUSEPORT
+        return false; // Windows has no load balancing port sharing
+#else
+        if (value != TRUE && value != FALSE)
+            return false;
+
+        result = setsockopt(_sock, SOL_SOCKET, SO_REUSEPORT, (char*)&value, sizeof(int));
         if (result != SOCKET_ERROR)
             return true;
         else
             return false;
+#endif
 
         break;
     }
@@ -196,30 +336,325 @@ bool UdpSocket::setSocketOption(SOCKETOPT opt, DWORD value)
     return false;
 }
 
-bool UdpSocket::Write(char* addr, int port, char* datagram, int datagram_len)
+bool UdpSocket::setReceiveBatch(unsigned int batchSize, size_t maxDatagramSize)
 {
-    sockaddr_in *so_addr = (sockaddr_in*)malloc(sizeof sockaddr_in);
-    ZeroMemory(so_addr, sizeof sockaddr_in);
-    int slen = sizeof(sockaddr_in);
+    if (_bound || batchSize == 0 || batchSize > UDP_RECV_BATCH_MAX)
+        return false;
+    if (maxDatagramSize == 0 || maxDatagramSize > UDP_MAX_DATAGRAM_SIZE)
+        return false;
 
-    so_addr->sin_family = AF_INET;
-    so_addr->sin_port = htons(port);
-    so_addr->sin_addr.S_un.S_addr = inet_addr(addr);
+    _batchSize = batchSize;
+    _batchDatagramSize = maxDatagramSize;
+    return true;
+}
+
+bool UdpSocket::setReceiveOffload(bool enable)
+{
+#ifndef UDP_GRO
+    return false; // UDP_GRO is Linux only
+#else
+    if (_bound)
+        return false;
+
+    _receiveOffload = enable;
+    return true;
+#endif
+}
+
+bool UdpSocket::setReadLoopAffinity(ULONGLONG cpuMask)
+{
+    if (_bound)
+        return false;
 
-    if (sendto(_sock, datagram, datagram_len, 0, (const sockaddr*)so_addr, slen) == SOCKET_ERROR)
+    _readLoopAffinity = cpuMask;
+    return true;
+}
+
+bool UdpSocket::setReceiveTimestamps(bool enable, bool hardware)
+{
+    if (_bound || !SocketPolicy::EnableReceiveTimestamps(_sock, enable, hardware))
+        return false;
+
+    _receiveTimestamps = enable;
+    if (enable && !_receiveDelay)
+        _receiveDelay.reset(new ReceiveDelayHistogram());
+    return true;
+}
+
+bool UdpSocket::getReceiveDelayStats(RECEIVE_DELAY_STATS* stats, bool reset)
+{
+    if (!_receiveDelay)
+        return false;
+
+    _receiveDelay->getStats(stats);
+    if (reset)
+        _receiveDelay->Reset();
+    return true;
+}
+
+int UdpSocket::ReceiveFrom(char* buf, int len, sockaddr* from, int* fromLen, RECEIVE_TIMESTAMP* timestamp)
+{
+    if (_receiveTimestamps)
+        return SocketPolicy::ReceiveWithTimestamp(_sock, buf, len, from, fromLen, timestamp);
+
+    ZeroMemory(timestamp, sizeof(RECEIVE_TIMESTAMP));
+    return recvfrom(_sock, buf, len, 0, from, fromLen);
+}
+
+bool UdpSocket::setBusyPoll(bool enable, DWORD spinMicroseconds, DWORD parkMicroseconds)
+{
+    if (!_sock || _sock == INVALID_SOCKET || _sock == SOCKET_ERROR)
+        return false;
+
+    BUSY_POLL_POLICY policy;
+    policy.enabled = enable;
+    policy.spinMicroseconds = spinMicroseconds;
+    policy.parkMicroseconds = parkMicroseconds;
+    if (!SocketPolicy::ApplyBusyPoll(_sock, &policy))
+        return false;
+
+    _busyPoll = policy;
+    return true;
+}
+
+// Numeric group or source address of either family, independent of the socket's family
+static bool ResolveMulticastAddress(char* addr, sockaddr_storage* address)
+{
+    struct addrinfo* result = NULL, hints;
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    if (getaddrinfo(addr, 0, &hints, &result) != 0)
+        return false;
+
+    ZeroMemory(address, sizeof(sockaddr_storage));
+    memcpy(address, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    return true;
+}
+
+// Compares the addresses only, an IPv4 address equals its v4-mapped form seen by a dual-stack socket
+static bool SameAddress(const sockaddr_storage* a, const sockaddr_storage* b)
+{
+    const char* bytes[2];
+    int lengths[2];
+    const sockaddr_storage* addresses[2] = { a, b };
+    for (int i = 0; i < 2; i++)
+    {
+        if (addresses[i]->ss_family == AF_INET6)
+        {
+            const in6_addr* address = &((const sockaddr_in6*)addresses[i])->sin6_addr;
+            bool mapped = IN6_IS_ADDR_V4MAPPED(address) != 0;
+            bytes[i] = (const char*)address + (mapped ? 12 : 0);
+            lengths[i] = mapped ? 4 : 16;
+        }
+        else
+        {
+            bytes[i] = (const char*)&((const sockaddr_in*)addresses[i])->sin_addr;
+            lengths[i] = 4;
+        }
+    }
+    return lengths[0] == lengths[1] && memcmp(bytes[0], bytes[1], lengths[0]) == 0;
+}
+
+int UdpSocket::JoinGroup(char* group, char* source, unsigned int interfaceIndex, DATAGRAM_BATCH_RECEIVED_CALLBACK groupCallback, void* dataPointers)
+{
+    MULTICAST_GROUP joined;
+    ZeroMemory(&joined, sizeof(MULTICAST_GROUP));
+    if (!ResolveMulticastAddress(group, &joined.group) || (source && !ResolveMulticastAddress(source, &joined.source)))
+        return -1;
+    if ((joined.group.ss_family == AF_INET6 && _ai_family != AF_INET6) || (source && joined.source.ss_family != joined.group.ss_family))
+        return -1;
+
+    joined.joined = true;
+    joined.interfaceIndex = interfaceIndex;
+    joined.callback = groupCallback;
+    joined.dataPointers = dataPointers;
+
+    std::lock_guard<std::mutex> guard(_groupLock);
+    if (!_groups)
     {
-        free(so_addr);
+        _groups = (MULTICAST_GROUP*)calloc(UDP_MAX_GROUPS, sizeof(MULTICAST_GROUP));
+        if (!_groups)
+            return -1;
+
+        // The batch read loop tells the groups apart by the destination address of each datagram
+        int enable = 1;
+        setsockopt(_sock, IPPROTO_IP, IP_PKTINFO, (char*)&enable, sizeof(int));
+#ifdef IPV6_RECVPKTINFO
+        if (_ai_family == AF_INET6)
+            setsockopt(_sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, (char*)&enable, sizeof(int));
+#else
+        if (_ai_family == AF_INET6)
+            setsockopt(_sock, IPPROTO_IPV6, IPV6_PKTINFO, (char*)&enable, sizeof(int));
+#endif
+    }
+
+    int index = 0;
+    while (index < _groupCount && _groups[index].joined)
+        index++;
+    if (index == UDP_MAX_GROUPS || !SetGroupMembership(true, &joined))
+        return -1;
+
+    _groups[index] = joined;
+    if (index == _groupCount)
+        _groupCount++;
+    _groupVersion++;
+    return index;
+}
+
+bool UdpSocket::LeaveGroup(char* group, char* source, unsigned int interfaceIndex)
+{
+    sockaddr_storage groupAddress, sourceAddress;
+    if (!ResolveMulticastAddress(group, &groupAddress) || (source && !ResolveMulticastAddress(source, &sourceAddress)))
+        return false;
+
+    std::lock_guard<std::mutex> guard(_groupLock);
+    for (int i = 0; i < _groupCount; i++)
+    {
+        MULTICAST_GROUP* joined = &_groups[i];
+        if (!joined->joined || joined->interfaceIndex != interfaceIndex || !SameAddress(&joined->group, &groupAddress))
+            continue;
+        if ((joined->source.ss_family != 0) != (source != 0) || (source && !SameAddress(&joined->source, &sourceAddress)))
+            continue;
+
+        if (!SetGroupMembership(false, joined))
+            return false;
+        joined->joined = false;
+        _groupVersion++;
+        return true;
+    }
+
+    return false;
+}
+
+bool UdpSocket::SetGroupMembership(bool join, MULTICAST_GROUP* group)
+{
+    // Protocol independent requests, the level follows the family of the group so a dual-stack socket joins IPv4 groups too
+    int level = group->group.ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    int result = 0;
+    if (group->source.ss_family == 0)
+    {
+        group_req request;
+        ZeroMemory(&request, sizeof(group_req));
+        request.gr_interface = group->interfaceIndex;
+        memcpy(&request.gr_group, &group->group, sizeof(sockaddr_storage));
+        result = setsockopt(_sock, level, join ? MCAST_JOIN_GROUP : MCAST_LEAVE_GROUP, (char*)&request, sizeof(group_req));
+    }
+    else
+    {
+        group_source_req request;
+        ZeroMemory(&request, sizeof(group_source_req));
+        request.gsr_interface = group->interfaceIndex;
+        memcpy(&request.gsr_group, &group->group, sizeof(sockaddr_storage));
+        memcpy(&request.gsr_source, &group->source, sizeof(sockaddr_storage));
+        result = setsockopt(_sock, level, join ? MCAST_JOIN_SOURCE_GROUP : MCAST_LEAVE_SOURCE_GROUP, (char*)&request, sizeof(group_source_req));
+    }
+
+    return result != SOCKET_ERROR;
+}
+
+int UdpSocket::MatchGroup(MULTICAST_GROUP* groups, int groupCount, sockaddr_storage* destination, sockaddr_storage* from)
+{
+    for (int i = 0; i < groupCount; i++)
+    {
+        MULTICAST_GROUP* group = &groups[i];
+        if (group->joined && SameAddress(&group->group, destination) && (group->source.ss_family == 0 || SameAddress(&group->source, from)))
+            return i;
+    }
+    return -1;
+}
+
+void UdpSocket::SnapshotGroups(MULTICAST_GROUP** groups, int* groupCount, unsigned int* version)
+{
+    if (_groupVersion == *version)
+        return;
+
+    std::lock_guard<std::mutex> guard(_groupLock);
+    if (!*groups)
+        *groups = (MULTICAST_GROUP*)malloc(UDP_MAX_GROUPS * sizeof(MULTICAST_GROUP));
+    *groupCount = 0;
+    if (*groups && _groups)
+    {
+        memcpy(*groups, _groups, _groupCount * sizeof(MULTICAST_GROUP));
+        *groupCount = _groupCount;
+    }
+    *version = _groupVersion;
+}
+
+bool UdpSocket::setMulticastInterface(unsigned int interfaceIndex)
+{
+    int result = 0;
+    if (_ai_family == AF_INET6 && setsockopt(_sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, (char*)&interfaceIndex, sizeof(unsigned int)) == SOCKET_ERROR)
+        return false;
+
+    // IPv4 groups, a dual-stack socket reaches them too
+#ifdef _WIN32
+    DWORD index = htonl(interfaceIndex); // An address in 0.0.0.0/8 is taken as an interface index
+    result = setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_IF, (char*)&index, sizeof(DWORD));
+#else
+    ip_mreqn request;
+    ZeroMemory(&request, sizeof(ip_mreqn));
+    request.imr_ifindex = interfaceIndex;
+    result = setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_IF, (char*)&request, sizeof(ip_mreqn));
+#endif
+    return _ai_family == AF_INET6 || result != SOCKET_ERROR;
+}
+
+bool UdpSocket::setMulticastLoopback(bool enable)
+{
+    int value = enable ? 1 : 0;
+    if (_ai_family == AF_INET6 && setsockopt(_sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, (char*)&value, sizeof(int)) == SOCKET_ERROR)
+        return false;
+
+    int result = setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_LOOP, (char*)&value, sizeof(int));
+    return _ai_family == AF_INET6 || result != SOCKET_ERROR;
+}
+
+bool UdpSocket::setMulticastHops(int hops)
+{
+    if (_ai_family == AF_INET6 && setsockopt(_sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char*)&hops, sizeof(int)) == SOCKET_ERROR)
         return false;
+
+    int result = setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_TTL, (char*)&hops, sizeof(int));
+    return _ai_family == AF_INET6 || result != SOCKET_ERROR;
+}
+
+unsigned int UdpSocket::getInterfaceIndex(char* name)
+{
+    return if_nametoindex(name);
+}
+
+bool UdpSocket::Write(char* addr, int port, char* datagram, int datagram_len)
+{
+    if (_ai_family != AF_INET)
+    {
+        UDP_ENDPOINT endpoint;
+        if (!ResolveEndpoint(addr, port, &endpoint))
+            return false;
+        return Write(&endpoint, datagram, datagram_len);
     }
 
-    free(so_addr);
+    sockaddr_in so_addr;
+    ZeroMemory(&so_addr, sizeof(sockaddr_in));
+    int slen = sizeof(sockaddr_in);
+
+    so_addr.sin_family = AF_INET;
+    so_addr.sin_port = htons(port);
+    so_addr.sin_addr.S_un.S_addr = inet_addr(addr);
+
+    if (sendto(_sock, datagram, datagram_len, 0, (const sockaddr*)&so_addr, slen) == SOCKET_ERROR)
+        return false;
 
     // If not bound, create the read loop after first call to Write
     // This is because we are not able to Read first before Writing when the socket is not bound
     if (!_bound && (!_hReadLoop || _hReadLoop == INVALID_HANDLE_VALUE)
-        && (_datagramReceivedCallback || _datagramReceivedMemberCallback))
+        && (_datagramReceivedCallback || _datagramReceivedMemberCallback || _packetReceivedCallback))
     {
-        _hReadLoop = CreateThread(0, 0, DatagramReadLoop_ThreadCall, this, 0, 0);
+        _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
     }
 
     return true;
@@ -227,28 +662,199 @@ bool UdpSocket::Write(char* addr, int port, char* datagram, int datagram_len)
 
 bool UdpSocket::Write(UDP_DATAGRAM *datagram)
 {
-    sockaddr_in* so_addr = (sockaddr_in*)malloc(sizeof sockaddr_in);
-    int slen = sizeof(sockaddr_in);
+    return Write(datagram->peer.addr, datagram->peer.port, datagram->data, (int)datagram->len);
+}
 
-    memset((char*)&so_addr, 0, sizeof(so_addr));
-    so_addr->sin_family = AF_INET;
-    so_addr->sin_port = htons(datagram->peer.port);
-    so_addr->sin_addr.S_un.S_addr = inet_addr(datagram->peer.addr);
+bool UdpSocket::Write(UDP_ENDPOINT* to, char* datagram, int datagram_len)
+{
+    if (sendto(_sock, datagram, datagram_len, 0, (const sockaddr*)&to->address, to->addressLen) == SOCKET_ERROR)
+        return false;
 
-    if (sendto(_sock, datagram->data, datagram->len, 0, (const sockaddr*)so_addr, slen) == SOCKET_ERROR)
+    // If not bound, create the read loop after first call to Write
+    // This is because we are not able to Read first before Writing when the socket is not bound
+    if (!_bound && (!_hReadLoop || _hReadLoop == INVALID_HANDLE_VALUE)
+        && (_datagramReceivedCallback || _datagramReceivedMemberCallback || _packetReceivedCallback))
     {
-        free(so_addr);
+        _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
+    }
+
+    return true;
+}
+
+bool UdpSocket::Connect(UDP_ENDPOINT* peer)
+{
+    if (connect(_sock, (const sockaddr*)&peer->address, peer->addressLen) == SOCKET_ERROR)
         return false;
+
+    _connected = true;
+
+    // Connecting binds the socket to a local port, start receiving replies from the peer
+    if (!_bound && (!_hReadLoop || _hReadLoop == INVALID_HANDLE_VALUE)
+        && (_datagramReceivedCallback || _datagramReceivedMemberCallback || _packetReceivedCallback))
+    {
+        _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
     }
 
-    free(so_addr);
+    return true;
+}
+
+bool UdpSocket::Send(char* datagram, int datagram_len)
+{
+    if (!_connected)
+        return false;
+
+    return send(_sock, datagram, datagram_len, 0) != SOCKET_ERROR;
+}
+
+bool UdpSocket::ResolveEndpoint(char* addr, int port, UDP_ENDPOINT* endpoint)
+{
+    struct addrinfo* result = NULL, hints;
+
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = _ai_family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    // A dual-stack socket sends to IPv4 peers through their v4-mapped address
+    hints.ai_flags = _ai_family == AF_INET6 ? AI_V4MAPPED : 0;
+
+    if (getaddrinfo(addr, 0, &hints, &result) != 0)
+        return false;
+
+    ZeroMemory(endpoint, sizeof(UDP_ENDPOINT));
+    memcpy(&endpoint->address, result->ai_addr, result->ai_addrlen);
+    endpoint->addressLen = (int)result->ai_addrlen;
+    if (endpoint->address.ss_family == AF_INET6)
+        ((sockaddr_in6*)&endpoint->address)->sin6_port = htons(port);
+    else
+        ((sockaddr_in*)&endpoint->address)->sin_port = htons(port);
+    freeaddrinfo(result);
+    return true;
+}
+
+int UdpSocket::WriteBatch(UDP_BATCH_DATAGRAM* datagrams, unsigned int count)
+{
+    int sentCount = 0;
+    unsigned int next = 0;
+
+#ifdef MSG_WAITFORONE
+    mmsghdr messages[UDP_SEND_BATCH_CHUNK];
+    iovec vectors[UDP_SEND_BATCH_CHUNK];
+    ZeroMemory(messages, sizeof(messages));
+
+    while (next < count)
+    {
+        unsigned int chunk = count - next < UDP_SEND_BATCH_CHUNK ? count - next : UDP_SEND_BATCH_CHUNK;
+        for (unsigned int i = 0; i < chunk; i++)
+        {
+            vectors[i].iov_base = datagrams[next + i].data;
+            vectors[i].iov_len = datagrams[next + i].len;
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &datagrams[next + i].to->address;
+            messages[i].msg_hdr.msg_namelen = datagrams[next + i].to->addressLen;
+        }
+
+        int sent = sendmmsg(_sock, messages, chunk, 0);
+        if (sent <= 0)
+        {
+            // sendmmsg only fails when the first datagram fails, record it and carry on with the rest
+            datagrams[next].result = SOCKET_ERROR;
+            datagrams[next].error = errno;
+            next++;
+            continue;
+        }
+
+        for (int i = 0; i < sent; i++)
+        {
+            datagrams[next + i].result = messages[i].msg_len;
+            datagrams[next + i].error = 0;
+        }
+        sentCount += sent;
+        next += sent;
+    }
+#else
+    // No sendmmsg, one sendto per datagram but still without resolving the destination again
+    for (; next < count; next++)
+    {
+        int result = sendto(_sock, datagrams[next].data, (int)datagrams[next].len, 0, (const sockaddr*)&datagrams[next].to->address, datagrams[next].to->addressLen);
+        datagrams[next].result = result;
+        datagrams[next].error = 0;
+        if (result == SOCKET_ERROR)
+            datagrams[next].error = WSAGetLastError();
+        else
+            sentCount++;
+    }
+#endif
 
     // If not bound, create the read loop after first call to Write
     // This is because we are not able to Read first before Writing when the socket is not bound
-    if (!_bound && (!_hReadLoop || _hReadLoop == INVALID_HANDLE_VALUE)
-        && (_datagramReceivedCallback || _datagramReceivedMemberCallback))
+    if (sentCount > 0 && !_bound && (!_hReadLoop || _hReadLoop == INVALID_HANDLE_VALUE)
+        && (_datagramReceivedCallback || _datagramReceivedMemberCallback || _packetReceivedCallback))
+    {
+        _hReadLoop = SocketPolicy::CreateIoThread(DatagramReadLoop_ThreadCall, this);
+    }
+
+    return sentCount;
+}
+
+bool UdpSocket::WriteSegmented(UDP_ENDPOINT* to, char* data, size_t len, unsigned short segmentSize)
+{
+    if (segmentSize == 0 || segmentSize > UDP_OFFLOAD_MAX_BYTES)
+        return false;
+
+    // As many whole segments as one send can carry, the kernel splits each send into datagrams of segmentSize
+    size_t segments = UDP_OFFLOAD_MAX_BYTES / segmentSize;
+    if (segments > UDP_OFFLOAD_MAX_SEGMENTS)
+        segments = UDP_OFFLOAD_MAX_SEGMENTS;
+    size_t sendSize = segments * segmentSize;
+
+    size_t offset = 0;
+    while (offset < len)
     {
-        _hReadLoop = CreateThread(0, 0, DatagramReadLoop_ThreadCall, this, 0, 0);
+        size_t chunk = len - offset < sendSize ? len - offset : sendSize;
+#ifdef UDP_SEGMENT
+        if (chunk > segmentSize)
+        {
+            iovec vector;
+            vector.iov_base = data + offset;
+            vector.iov_len = chunk;
+
+            char control[CMSG_SPACE(sizeof(uint16_t))];
+            ZeroMemory(control, sizeof(control));
+
+            msghdr message;
+            ZeroMemory(&message, sizeof(msghdr));
+            message.msg_name = &to->address;
+            message.msg_namelen = to->addressLen;
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t*)CMSG_DATA(cmsg) = segmentSize;
+
+            if (sendmsg(_sock, &message, 0) != SOCKET_ERROR)
+            {
+                offset += chunk;
+                continue;
+            }
+            // EIO means the device can't checksum the segments, send them one by one instead
+            if (errno != EIO)
+                return false;
+        }
+#endif
+
+        for (size_t sent = 0; sent < chunk; sent += segmentSize)
+        {
+            int datagramSize = (int)(chunk - sent < segmentSize ? chunk - sent : segmentSize);
+            if (sendto(_sock, data + offset + sent, datagramSize, 0, (const sockaddr*)&to->address, to->addressLen) == SOCKET_ERROR)
+                return false;
+        }
+        offset += chunk;
     }
 
     return true;
@@ -258,17 +864,27 @@ UDP_DATAGRAM* UdpSocket::Read(size_t len)
 {
     int len_read = (len == 0 ? 65536 : len);
     int iResult = 0;
-    struct sockaddr_in si_other;
-    int slen = sizeof(sockaddr_in);
+    sockaddr_storage si_other;
+    int slen = sizeof(sockaddr_storage);
+
+    if (_busyPoll.enabled)
+    {
+        int ready = 0;
+        while (ready == 0)
+            ready = SocketPolicy::WaitReadable(_sock, &_busyPoll);
+        if (ready < 0)
+            return 0;
+    }
 
     char* buf = (char*)malloc(65536);
-    iResult = recvfrom(_sock, buf, 65536, 0, (struct sockaddr*)&si_other, &slen);
+    RECEIVE_TIMESTAMP timestamp;
+    iResult = ReceiveFrom(buf, 65536, (struct sockaddr*)&si_other, &slen, &timestamp);
     if (iResult > 0)
     {
         UDP_DATAGRAM* datagram = (UDP_DATAGRAM*)malloc(sizeof UDP_DATAGRAM);
         ZeroMemory(datagram, sizeof UDP_DATAGRAM);
-        datagram->peer.addr = inet_ntoa(si_other.sin_addr);
-        datagram->peer.port = ntohs(si_other.sin_port);
+        SetDatagramPeer(datagram, &si_other);
+        datagram->timestamp = timestamp;
 
         memcpy(datagram->data, buf, iResult);
         datagram->len = iResult;
@@ -281,35 +897,130 @@ UDP_DATAGRAM* UdpSocket::Read(size_t len)
     return 0;
 }
 
+UDP_PACKET* UdpSocket::ReadPacket()
+{
+    if (_busyPoll.enabled)
+    {
+        int ready = 0;
+        while (ready == 0)
+            ready = SocketPolicy::WaitReadable(_sock, &_busyPoll);
+        if (ready < 0)
+            return 0;
+    }
+
+    // Receive into a full size packet, then move small datagrams into a packet of their size class
+    UDP_PACKET* received = UdpPacketPool::Alloc(UDP_MAX_DATAGRAM_SIZE);
+    if (!received)
+        return 0;
+
+    int slen = sizeof(sockaddr_storage);
+    int iResult = ReceiveFrom(received->data, UDP_MAX_DATAGRAM_SIZE, (struct sockaddr*)&received->peer, &slen, &received->timestamp);
+    if (iResult < 0)
+    {
+        UdpPacketPool::Release(received);
+        return 0;
+    }
+    received->len = iResult;
+    received->peerLen = slen;
+
+    UDP_PACKET* packet = UdpPacketPool::Alloc(iResult);
+    if (!packet || packet->capacity == received->capacity)
+    {
+        UdpPacketPool::Release(packet);
+        return received;
+    }
+
+    memcpy(packet->data, received->data, iResult);
+    memcpy(&packet->peer, &received->peer, slen);
+    packet->len = iResult;
+    packet->peerLen = slen;
+    packet->timestamp = received->timestamp;
+    UdpPacketPool::Release(received);
+    return packet;
+}
+
+const char* UdpSocket::getPeerAddress(UDP_PACKET* packet)
+{
+    if (packet->peerString[0] == 0)
+    {
+        // inet_ntop writes into the packet, unlike inet_ntoa's shared static buffer
+        void* address = packet->peer.ss_family == AF_INET6 ? (void*)&((sockaddr_in6*)&packet->peer)->sin6_addr : (void*)&((sockaddr_in*)&packet->peer)->sin_addr;
+        if (!inet_ntop(packet->peer.ss_family, address, packet->peerString, INET6_ADDRSTRLEN))
+            packet->peerString[0] = 0;
+    }
+    return packet->peerString;
+}
+
+void UdpSocket::SetDatagramPeer(UDP_DATAGRAM* datagram, sockaddr_storage* from)
+{
+    // Formatted into the datagram by family, inet_ntoa only knows IPv4 and shares one buffer between threads
+    void* address = from->ss_family == AF_INET6 ? (void*)&((sockaddr_in6*)from)->sin6_addr : (void*)&((sockaddr_in*)from)->sin_addr;
+    if (!inet_ntop(from->ss_family, address, datagram->peerString, INET6_ADDRSTRLEN))
+        datagram->peerString[0] = 0;
+    datagram->peer.addr = datagram->peerString;
+    datagram->peer.port = ntohs(from->ss_family == AF_INET6 ? ((sockaddr_in6*)from)->sin6_port : ((sockaddr_in*)from)->sin_port);
+}
+
+int UdpSocket::getPeerPort(UDP_PACKET* packet)
+{
+    if (packet->peer.ss_family == AF_INET6)
+        return ntohs(((sockaddr_in6*)&packet->peer)->sin6_port);
+    return ntohs(((sockaddr_in*)&packet->peer)->sin_port);
+}
+
 DWORD UdpSocket::DatagramReadLoop()
 {
+    if (_readLoopAffinity)
+        SocketPolicy::PinCurrentThread(_readLoopAffinity);
+
+    if (callbackType == 2)
+        return BatchReadLoop();
+    if (callbackType == 3)
+        return PacketReadLoop();
+
     int iResult = 0;
-    struct sockaddr_in si_other;
-    int slen = sizeof(sockaddr_in);
+    sockaddr_storage si_other;
+    int slen;
 
     char* buf = (char*)malloc(65536);
     while(true)
     {
-        iResult = recvfrom(_sock, buf, 65536, 0, (struct sockaddr*)&si_other, &slen);
+        if (_busyPoll.enabled && SocketPolicy::WaitReadable(_sock, &_busyPoll) == 0)
+            continue;
+
+        RECEIVE_TIMESTAMP timestamp;
+        slen = sizeof(sockaddr_storage);
+        iResult = ReceiveFrom(buf, 65536, (struct sockaddr*)&si_other, &slen, &timestamp);
         if (iResult > 0)
         {
             UDP_DATAGRAM* datagram = (UDP_DATAGRAM*)malloc(sizeof UDP_DATAGRAM);
             ZeroMemory(datagram, sizeof UDP_DATAGRAM);
-            datagram->peer.addr = inet_ntoa(si_other.sin_addr);
-            datagram->peer.port = ntohs(si_other.sin_port);
+            SetDatagramPeer(datagram, &si_other);
+            datagram->timestamp = timestamp;
 
             memcpy(datagram->data, buf, iResult);
             datagram->len = iResult;
-            if(callbackType == 0)
+            // The plain callback runs as the thread routine itself, its delay is taken when the thread is created
+            if (_receiveDelay && (_busyPoll.enabled || callbackType == 0))
+                _receiveDelay->Record(&datagram->timestamp);
+            if (_busyPoll.enabled)
+            {
+                // Busy poll mode, deliver on this thread so the datagram is handled on the core that received it
+                if (callbackType == 0)
+                    _datagramReceivedCallback(datagram);
+                else
+                    _datagramReceivedMemberCallback(datagram, _dataPointers);
+            }
+            else if(callbackType == 0)
             {
-                CreateThread(0, 0, (LPTHREAD_START_ROUTINE)_datagramReceivedCallback, datagram, 0, 0);
+                SocketPolicy::CreateWorkerThread((LPTHREAD_START_ROUTINE)_datagramReceivedCallback, datagram);
             }
             else
             {
                 MEMBER_CALLBACK_CALLINFO* _mcci = (MEMBER_CALLBACK_CALLINFO*)malloc(sizeof MEMBER_CALLBACK_CALLINFO);
                 _mcci->datagram = datagram;
                 _mcci->_instance = this;
-                _hMemCallback = CreateThread(0, 0, MemberCallback_StaticCall, _mcci, 0, 0); 
+                _hMemCallback = SocketPolicy::CreateWorkerThread(MemberCallback_StaticCall, _mcci); 
             }
         }
         ZeroMemory(buf, 65536);
@@ -317,9 +1028,279 @@ DWORD UdpSocket::DatagramReadLoop()
     return 0;
 }
 
+DWORD UdpSocket::PacketReadLoop()
+{
+    // One full size receive buffer for the loop, each datagram is copied into a pooled packet of its size
+    char* buf = (char*)malloc(UDP_MAX_DATAGRAM_SIZE);
+    if (!buf)
+        return 1;
+
+    while (true)
+    {
+        if (_busyPoll.enabled && SocketPolicy::WaitReadable(_sock, &_busyPoll) == 0)
+            continue;
+
+        sockaddr_storage from;
+        int slen = sizeof(sockaddr_storage);
+        RECEIVE_TIMESTAMP timestamp;
+        int iResult = ReceiveFrom(buf, UDP_MAX_DATAGRAM_SIZE, (struct sockaddr*)&from, &slen, &timestamp);
+        if (iResult < 0)
+        {
+            // The socket was closed or failed for good, see WaitAfterReceiveError
+            if (!WaitAfterReceiveError())
+                break;
+            continue;
+        }
+
+        UDP_PACKET* packet = UdpPacketPool::Alloc(iResult);
+        if (!packet)
+            continue;
+        memcpy(packet->data, buf, iResult);
+        memcpy(&packet->peer, &from, slen);
+        packet->len = iResult;
+        packet->peerLen = slen;
+        packet->timestamp = timestamp;
+
+        if (_busyPoll.enabled)
+        {
+            if (_receiveDelay)
+                _receiveDelay->Record(&packet->timestamp);
+            _packetReceivedCallback(packet, _dataPointers);
+        }
+        else
+        {
+            PACKET_CALLBACK_CALLINFO* _pcci = (PACKET_CALLBACK_CALLINFO*)malloc(sizeof(PACKET_CALLBACK_CALLINFO));
+            _pcci->packet = packet;
+            _pcci->_instance = this;
+            _hMemCallback = SocketPolicy::CreateWorkerThread(PacketCallback_StaticCall, _pcci);
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+DWORD UdpSocket::BatchReadLoop()
+{
+    // Coalesced receives can hold up to UDP_OFFLOAD_MAX_SEGMENTS datagrams, each one becomes its own entry of the batch
+    size_t bufferSize = _receiveOffload ? UDP_MAX_DATAGRAM_SIZE : _batchDatagramSize;
+    size_t maxEntries = _receiveOffload ? _batchSize * UDP_OFFLOAD_MAX_SEGMENTS : _batchSize;
+
+    // Receive buffers are allocated once and reused, the callback consumes each batch before the next receive
+    char* buffers = (char*)malloc(_batchSize * bufferSize);
+    UDP_BATCH_ENTRY* entries = (UDP_BATCH_ENTRY*)malloc(maxEntries * sizeof(UDP_BATCH_ENTRY));
+    if (!buffers || !entries)
+    {
+        free(buffers);
+        free(entries);
+        return 1;
+    }
+
+    UDP_DATAGRAM_BATCH batch;
+    batch.entries = entries;
+    batch.count = 0;
+    batch.socket = this;
+    batch.shard = _shardIndex;
+
+    MULTICAST_GROUP* groups = 0;
+    int groupCount = 0;
+    unsigned int groupVersion = 0;
+
+#ifdef MSG_WAITFORONE
+    mmsghdr* messages = (mmsghdr*)malloc(_batchSize * sizeof(mmsghdr));
+    iovec* vectors = (iovec*)malloc(_batchSize * sizeof(iovec));
+    sockaddr_storage* addresses = (sockaddr_storage*)malloc(_batchSize * sizeof(sockaddr_storage));
+    // Room for the GRO segment size, the destination address of multicast datagrams, which can arrive in both IPv4 and IPv6 form, and the receive timestamp
+    size_t controlSize = CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(in_pktinfo)) + CMSG_SPACE(sizeof(in6_pktinfo)) + RECEIVE_TIMESTAMP_CONTROL_SIZE;
+    char* control = (char*)malloc(_batchSize * controlSize);
+    ZeroMemory(messages, _batchSize * sizeof(mmsghdr));
+    for (unsigned int i = 0; i < _batchSize; i++)
+    {
+        vectors[i].iov_base = buffers + i * bufferSize;
+        vectors[i].iov_len = bufferSize;
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+        messages[i].msg_hdr.msg_control = control + i * controlSize;
+    }
+#endif
+
+    while (true)
+    {
+        if (_busyPoll.enabled && SocketPolicy::WaitReadable(_sock, &_busyPoll) == 0)
+            continue;
+
+#ifdef MSG_WAITFORONE
+        for (unsigned int i = 0; i < _batchSize; i++)
+        {
+            messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            messages[i].msg_hdr.msg_controllen = controlSize;
+        }
+
+        // Blocks for the first datagram only, then takes whatever else is already queued
+        int received = recvmmsg(_sock, messages, _batchSize, MSG_WAITFORONE, 0);
+        if (received < 0 && !WaitAfterReceiveError())
+            break;
+        if (received <= 0)
+            continue;
+
+        SnapshotGroups(&groups, &groupCount, &groupVersion);
+        int count = 0;
+        for (int i = 0; i < received; i++)
+        {
+            char* data = (char*)vectors[i].iov_base;
+            size_t len = messages[i].msg_len;
+            size_t segmentSize = len;
+            sockaddr_storage destination;
+            destination.ss_family = 0;
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&messages[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&messages[i].msg_hdr, cmsg))
+            {
+#ifdef UDP_GRO
+                if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO && *(int*)CMSG_DATA(cmsg) > 0)
+                    segmentSize = *(int*)CMSG_DATA(cmsg);
+#endif
+                if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+                {
+                    destination.ss_family = AF_INET;
+                    ((sockaddr_in*)&destination)->sin_addr = ((in_pktinfo*)CMSG_DATA(cmsg))->ipi_addr;
+                }
+                else if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
+                {
+                    destination.ss_family = AF_INET6;
+                    ((sockaddr_in6*)&destination)->sin6_addr = ((in6_pktinfo*)CMSG_DATA(cmsg))->ipi6_addr;
+                }
+            }
+            int group = groupCount && destination.ss_family ? MatchGroup(groups, groupCount, &destination, &addresses[i]) : -1;
+            RECEIVE_TIMESTAMP timestamp;
+            ZeroMemory(&timestamp, sizeof(RECEIVE_TIMESTAMP));
+            if (_receiveTimestamps)
+                SocketPolicy::ReadReceiveTimestamp(&messages[i].msg_hdr, &timestamp);
+
+            // Split a coalesced receive back into the datagrams the peer sent, only the last one can be shorter
+            size_t offset = 0;
+            do
+            {
+                entries[count].data = data + offset;
+                entries[count].len = len - offset < segmentSize ? len - offset : segmentSize;
+                entries[count].from = addresses[i];
+                entries[count].group = group;
+                entries[count].timestamp = timestamp;
+                offset += entries[count].len;
+                count++;
+            } while (offset < len);
+        }
+#else
+        // No recvmmsg, receive the first datagram then drain what is already queued without blocking
+        int count = 0;
+        bool closed = false;
+        pollfd pending;
+        pending.fd = _sock;
+        pending.events = POLLIN;
+        do
+        {
+            int slen = sizeof(sockaddr_storage);
+            char* buf = buffers + count * bufferSize;
+            int iResult = ReceiveFrom(buf, (int)bufferSize, (struct sockaddr*)&entries[count].from, &slen, &entries[count].timestamp);
+            if (iResult < 0 && count == 0 && !WaitAfterReceiveError())
+                closed = true;
+            if (iResult <= 0)
+                break;
+
+            // No destination address on this path, every datagram goes to the Bind callback
+            entries[count].data = buf;
+            entries[count].len = iResult;
+            entries[count].group = -1;
+            count++;
+            pending.revents = 0;
+        } while ((unsigned int)count < _batchSize && SocketPolicy::PollSockets(&pending, 1, 0) > 0);
+
+        if (closed)
+            break;
+        if (count == 0)
+            continue;
+        SnapshotGroups(&groups, &groupCount, &groupVersion);
+#endif
+
+        if (_receiveDelay)
+        {
+            ULONGLONG now = ReceiveDelayHistogram::NowNs();
+            for (int i = 0; i < count; i++)
+                _receiveDelay->Record(&entries[i].timestamp, now);
+        }
+
+        if (!groupCount)
+        {
+            batch.count = count;
+            _batchReceivedCallback(&batch, _dataPointers);
+            continue;
+        }
+
+        // Each run of datagrams of the same group goes to that group's callback as a batch of its own, pointing into the same entries
+        int start = 0;
+        while (start < count)
+        {
+            int end = start + 1;
+            while (end < count && entries[end].group == entries[start].group)
+                end++;
+
+            MULTICAST_GROUP* group = entries[start].group >= 0 ? &groups[entries[start].group] : 0;
+            batch.entries = entries + start;
+            batch.count = end - start;
+            if (group && group->callback)
+                group->callback(&batch, group->dataPointers);
+            else
+                _batchReceivedCallback(&batch, _dataPointers);
+            start = end;
+        }
+        batch.entries = entries;
+    }
+
+#ifdef MSG_WAITFORONE
+    free(messages);
+    free(vectors);
+    free(addresses);
+    free(control);
+#endif
+    free(buffers);
+    free(entries);
+    free(groups);
+    return 0;
+}
+
+bool UdpSocket::WaitAfterReceiveError()
+{
+    if (SocketPolicy::LastErrorWouldBlock())
+    {
+        // Busy poll made the socket non-blocking, the loop spins in WaitReadable itself
+        if (!_busyPoll.enabled)
+        {
+            pollfd pfd;
+            pfd.fd = _sock;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            SocketPolicy::PollSockets(&pfd, 1, -1);
+        }
+        return true;
+    }
+
+#ifdef _WIN32
+    // ICMP port unreachable from an earlier send and truncated datagrams, the socket is still usable
+    int error = WSAGetLastError();
+    return error == WSAECONNRESET || error == WSAEMSGSIZE || error == WSAEINTR;
+#else
+    // ECONNREFUSED reports an ICMP error on a connected socket
+    return errno == EINTR || errno == ECONNREFUSED;
+#endif
+}
+
 void UdpSocket::Close()
 {
     if (_hReadLoop)
         TerminateThread(_hReadLoop, 0);
     closesocket(_sock);
-}
+    std::lock_guard<std::mutex> guard(_groupLock);
+    free(_groups);
+    _groups = 0;
+    _groupCount = 0;
+    _groupVersion++;
+}
\ No newline at end of file
@@ -33,11 +33,60 @@ typedef struct
 {
 	char data[65536];
 	size_t len;
-	UDP_PEER peer;
+	UDP_PEER peer; // IPv4 peers of a dual-stack socket come in their v4-mapped form, Write(UDP_DATAGRAM*) replies to them
+	RECEIVE_TIMESTAMP timestamp; // Set when setReceiveTimestamps is enabled
+	char peerString[INET6_ADDRSTRLEN]; // peer.addr points here
 }UDP_DATAGRAM;
 
+class UdpSocket;
+
+// One datagram of a received batch, data points into the socket's receive buffers and is only valid until the batch callback returns
+typedef struct
+{
+	char* data;
+	size_t len;
+	sockaddr_storage from;
+	int group; // Index JoinGroup returned for the multicast group the datagram was sent to, -1 for unicast
+	RECEIVE_TIMESTAMP timestamp; // Set when setReceiveTimestamps is enabled
+}UDP_BATCH_ENTRY;
+
+typedef struct
+{
+	UDP_BATCH_ENTRY* entries;
+	size_t count;
+	UdpSocket* socket; // Socket that received the batch, replies sent on it leave from the same shard
+	int shard; // Index of that socket in its UdpShardedSocket, 0 when not sharded
+}UDP_DATAGRAM_BATCH;
+
+// Destination resolved once with ResolveEndpoint, IPv4 or IPv6, and reused for every send
+typedef struct
+{
+	sockaddr_storage address;
+	int addressLen;
+}UDP_ENDPOINT;
+
+// One datagram of WriteBatch, many datagrams can share the same endpoint
+typedef struct
+{
+	char* data;
+	size_t len;
+	UDP_ENDPOINT* to;
+	int result; // Set by WriteBatch: bytes sent, or SOCKET_ERROR with the socket error code in error
+	int error;
+}UDP_BATCH_DATAGRAM;
+
 typedef void(__stdcall* DATAGRAM_RECEIVED_CALLBACK)(UDP_DATAGRAM* datagram);
 typedef void(__stdcall* DATAGRAM_RECEIVED_P_CALLBACK)(UDP_DATAGRAM* datagram, void* dataPointers);
+typedef void(__stdcall* DATAGRAM_PACKET_RECEIVED_CALLBACK)(UDP_PACKET* packet, void* dataPointers);
+typedef void(__stdcall* DATAGRAM_BATCH_RECEIVED_CALLBACK)(UDP_DATAGRAM_BATCH* batch, void* dataPointers);
+
+#define UDP_RECV_BATCH_DEFAULT 32
+#define UDP_RECV_BATCH_MAX 1024
+#define UDP_MAX_DATAGRAM_SIZE 65536
+#define UDP_SEND_BATCH_CHUNK 64
+#define UDP_OFFLOAD_MAX_SEGMENTS 64 // Kernel limit of segments per GSO send or GRO receive
+#define UDP_OFFLOAD_MAX_BYTES 65507 // Largest IPv4 UDP payload
+#define UDP_MAX_GROUPS 64 // Multicast groups joined per socket
 
 class UdpSocket
 {
@@ -48,34 +97,102 @@ public:
 		ChecksumEnabled = 2,
 		SendMsgSize = 3,
 		RecvTimeout = 4,
-		SendTimeout = 5
+		SendTimeout = 5,
+		ReusePort = 6
 	};
 
 	PRIMESOCKET_API UdpSocket();
+	// AF_INET or AF_INET6, an AF_INET6 socket is dual-stack and also reaches IPv4 peers
+	PRIMESOCKET_API UdpSocket(int family);
 
 	PRIMESOCKET_API bool Bind(char* addr, char* port, DATAGRAM_RECEIVED_CALLBACK datagramReceivedCallback);
 	PRIMESOCKET_API bool Bind(char* addr, char* port, DATAGRAM_RECEIVED_P_CALLBACK datagramReceivedCallback, void* dataPointers);
+	// Datagrams are delivered as pooled UDP_PACKETs sized to their payload, release them with UdpPacketPool::Release
+	PRIMESOCKET_API bool Bind(char* addr, char* port, DATAGRAM_PACKET_RECEIVED_CALLBACK packetReceivedCallback, void* dataPointers);
+	// Batched receive: the read loop pulls up to the configured batch of datagrams per syscall (recvmmsg) and calls the callback once per batch on the read loop thread
+	PRIMESOCKET_API bool Bind(char* addr, char* port, DATAGRAM_BATCH_RECEIVED_CALLBACK batchReceivedCallback, void* dataPointers);
 	PRIMESOCKET_API bool setReceiverCallback(DATAGRAM_RECEIVED_CALLBACK datagramReceivedCallback);
 	PRIMESOCKET_API bool setReceiverCallback(DATAGRAM_RECEIVED_P_CALLBACK datagramReceivedCallback, void* dataPointers);
+	PRIMESOCKET_API bool setReceiverCallback(DATAGRAM_PACKET_RECEIVED_CALLBACK packetReceivedCallback, void* dataPointers);
 
 	// Enable/Disable/Modify a socket option 
 	PRIMESOCKET_API bool setSocketOption(SOCKETOPT opt, DWORD value);
+	// Datagrams per receive call and size of each receive buffer used by the batch callback, call before Bind
+	PRIMESOCKET_API bool setReceiveBatch(unsigned int batchSize = UDP_RECV_BATCH_DEFAULT, size_t maxDatagramSize = UDP_MAX_DATAGRAM_SIZE);
+	// UDP_GRO: the kernel coalesces datagrams of a flow into one receive, the batch read loop splits them back into entries. Batch receive only, call before Bind
+	PRIMESOCKET_API bool setReceiveOffload(bool enable);
+	// Pin the read loop thread to these CPUs instead of the THREADING_CONFIG io CPUs, call before Bind
+	PRIMESOCKET_API bool setReadLoopAffinity(ULONGLONG cpuMask);
+	// Kernel receive timestamps on every UDP_DATAGRAM, UDP_PACKET and batch entry, and the receive to callback delay in
+	// getReceiveDelayStats. hardware also asks for the NIC timestamp. Linux only, call before Bind
+	PRIMESOCKET_API bool setReceiveTimestamps(bool enable, bool hardware = false);
+	PRIMESOCKET_API bool getReceiveDelayStats(RECEIVE_DELAY_STATS* stats, bool reset = false);
+	// Low-latency mode: spin on the socket instead of blocking in recvfrom and run the receiver callback on the read loop thread
+	PRIMESOCKET_API bool setBusyPoll(bool enable, DWORD spinMicroseconds = BUSY_POLL_DEFAULT_SPIN_US, DWORD parkMicroseconds = BUSY_POLL_DEFAULT_PARK_US);
 
 	PRIMESOCKET_API bool Write(char* addr, int port, char* datagram, int datagram_len = 0L);
 	PRIMESOCKET_API bool Write(UDP_DATAGRAM* datagram);
+	PRIMESOCKET_API bool Write(UDP_ENDPOINT* to, char* datagram, int datagram_len);
+	// Resolves the address (numeric or host name) for this socket's family, the endpoint can then be reused for any number of sends
+	PRIMESOCKET_API bool ResolveEndpoint(char* addr, int port, UDP_ENDPOINT* endpoint);
+	// Connected mode for single peer flows: Send skips the per-datagram route lookup and the socket only receives from the peer
+	PRIMESOCKET_API bool Connect(UDP_ENDPOINT* peer);
+	PRIMESOCKET_API bool Send(char* datagram, int datagram_len);
+	// Sends the datagrams with as few sendmmsg calls as possible, returns how many were sent and sets result/error on each one
+	PRIMESOCKET_API int WriteBatch(UDP_BATCH_DATAGRAM* datagrams, unsigned int count);
+	// UDP_SEGMENT: hands up to UDP_OFFLOAD_MAX_SEGMENTS datagrams of segmentSize bytes to the kernel per send, the last datagram can be shorter
+	PRIMESOCKET_API bool WriteSegmented(UDP_ENDPOINT* to, char* data, size_t len, unsigned short segmentSize);
 	PRIMESOCKET_API UDP_DATAGRAM* Read(size_t len = 0L);
+	PRIMESOCKET_API UDP_PACKET* ReadPacket();
+
+	// Joins a multicast group, or only its traffic from source when given (source-specific multicast), on the interface or the one the routing table picks for 0.
+	// Datagrams of the group go to groupCallback as batches of their own when one is given, otherwise to the Bind callback. Returns the group index or -1
+	PRIMESOCKET_API int JoinGroup(char* group, char* source = 0, unsigned int interfaceIndex = 0, DATAGRAM_BATCH_RECEIVED_CALLBACK groupCallback = 0, void* dataPointers = 0);
+	PRIMESOCKET_API bool LeaveGroup(char* group, char* source = 0, unsigned int interfaceIndex = 0);
+	// Interface multicast datagrams are sent from, 0 lets the routing table choose
+	PRIMESOCKET_API bool setMulticastInterface(unsigned int interfaceIndex);
+	// Whether this host's own members of a group receive what the socket sends to it
+	PRIMESOCKET_API bool setMulticastLoopback(bool enable);
+	PRIMESOCKET_API bool setMulticastHops(int hops);
+	// Index of a network interface by name ("eth0", "lo"), 0 if there is no such interface
+	PRIMESOCKET_API static unsigned int getInterfaceIndex(char* name);
+
+	// Peer of a received packet as a string, formatted into the packet on the first call
+	PRIMESOCKET_API static const char* getPeerAddress(UDP_PACKET* packet);
+	PRIMESOCKET_API static int getPeerPort(UDP_PACKET* packet);
 
 	PRIMESOCKET_API void Close();
 
 private:
+	friend class UdpShardedSocket;
+	friend class UdpPacer;
+
 	typedef struct
 	{
 		UdpSocket* _instance;
 		UDP_DATAGRAM* datagram;
 	}MEMBER_CALLBACK_CALLINFO;
 
+	typedef struct
+	{
+		UdpSocket* _instance;
+		UDP_PACKET* packet;
+	}PACKET_CALLBACK_CALLINFO;
+
+	typedef struct
+	{
+		bool joined;
+		sockaddr_storage group;
+		sockaddr_storage source; // ss_family 0 for any source
+		unsigned int interfaceIndex;
+		DATAGRAM_BATCH_RECEIVED_CALLBACK callback;
+		void* dataPointers;
+	}MULTICAST_GROUP;
+
 	DATAGRAM_RECEIVED_CALLBACK _datagramReceivedCallback;
 	DATAGRAM_RECEIVED_P_CALLBACK _datagramReceivedMemberCallback;
+	DATAGRAM_PACKET_RECEIVED_CALLBACK _packetReceivedCallback;
+	DATAGRAM_BATCH_RECEIVED_CALLBACK _batchReceivedCallback;
 
 	void* _dataPointers;
 	int callbackType;
@@ -86,16 +203,52 @@ private:
 		return _instance->DatagramReadLoop();
 	}
 	DWORD DatagramReadLoop();
+	DWORD PacketReadLoop();
+	DWORD BatchReadLoop();
+	int ReceiveFrom(char* buf, int len, sockaddr* from, int* fromLen, RECEIVE_TIMESTAMP* timestamp);
+	// After a failed receive: waits for data when the socket had none, false when the error is persistent and the loop should end
+	bool WaitAfterReceiveError();
+	bool SetGroupMembership(bool join, MULTICAST_GROUP* group);
+	static void SetDatagramPeer(UDP_DATAGRAM* datagram, sockaddr_storage* from);
+	static int MatchGroup(MULTICAST_GROUP* groups, int groupCount, sockaddr_storage* destination, sockaddr_storage* from);
+	// Copies the groups for the read loop when JoinGroup or LeaveGroup changed them since the last copy
+	void SnapshotGroups(MULTICAST_GROUP** groups, int* groupCount, unsigned int* version);
 
 	static DWORD WINAPI MemberCallback_StaticCall(LPVOID param)
 	{
 		MEMBER_CALLBACK_CALLINFO* _mcci = (MEMBER_CALLBACK_CALLINFO*)param;
+		if (_mcci->_instance->_receiveDelay)
+			_mcci->_instance->_receiveDelay->Record(&_mcci->datagram->timestamp);
 		_mcci->_instance->_datagramReceivedMemberCallback(_mcci->datagram, _mcci->_instance->_dataPointers);
 		free(_mcci);
 		return 0;
 	}
 
-	bool _bound;
+	static DWORD WINAPI PacketCallback_StaticCall(LPVOID param)
+	{
+		PACKET_CALLBACK_CALLINFO* _pcci = (PACKET_CALLBACK_CALLINFO*)param;
+		if (_pcci->_instance->_receiveDelay)
+			_pcci->_instance->_receiveDelay->Record(&_pcci->packet->timestamp);
+		_pcci->_instance->_packetReceivedCallback(_pcci->packet, _pcci->_instance->_dataPointers);
+		free(_pcci);
+		return 0;
+	}
+
+	bool _bound, _connected;
+	int _ai_family;
 	HANDLE _hReadLoop, _hMemCallback;
 	SOCKET _sock;
+	BUSY_POLL_POLICY _busyPoll;
+	unsigned int _batchSize;
+	size_t _batchDatagramSize;
+	bool _receiveOffload;
+	ULONGLONG _readLoopAffinity;
+	int _shardIndex;
+	bool _receiveTimestamps;
+	std::unique_ptr<ReceiveDelayHistogram> _receiveDelay; // Freed with the socket, callbacks may record until then
+	// Changed by JoinGroup and LeaveGroup under _groupLock, the read loop works on a copy taken when _groupVersion moves
+	std::mutex _groupLock;
+	MULTICAST_GROUP* _groups;
+	int _groupCount; // Slots in use, left groups keep their slot until it is joined again
+	std::atomic<unsigned int> _groupVersion;
 };
\ No newline at end of file
@@ -24,9 +24,33 @@
 #pragma once
 #ifdef _LINUX
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <net/if.h>
 #include <unistd.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <string>
+#include <unordered_map>
 #endif
\ No newline at end of file
@@ -32,5 +32,14 @@
 #include <iphlpapi.h>
 #include <stdio.h>
 #include <iostream>
+#include <io.h>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <string>
+#include <unordered_map>
 
 #pragma comment(lib, "Ws2_32.lib")
\ No newline at end of file